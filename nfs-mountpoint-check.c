@@ -10,32 +10,215 @@
  * https://github.com/acdha/mountstatus/blob/master/legacy-c-version/main.c
  */
 
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/wait.h>
+#include <linux/io_uring.h>
+#include <linux/perf_event.h>
 #include <dirent.h>
+#include <fnmatch.h>
+#include <netdb.h>
+#include <pthread.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <time.h>
+
+#include "nfscheck.h"
+#include "probes.h"
+
+/* System call numbers which may be missing from older headers */
+#ifndef __NR_pidfd_send_signal
+#define __NR_pidfd_send_signal 424
+#endif
+
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434
+#endif
 
 /* Maximum errno */
 #define ERRNO_MAX 256
 
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
 /*
  * Error status code which means "we were unable to determine the status
  * of the mountpoint." There is no errno code for this situation.
  */
-static const int EUNKNOWN = 255;
+static const int EUNKNOWN = NFSCHECK_EUNKNOWN;
+
+/*
+ * Status codes which mean "the mountpoint is working, but it took longer
+ * than the warning (or critical) latency threshold to check it."
+ */
+static const int ELATENCY_WARN = 253;
+static const int ELATENCY_CRIT = 254;
+
+/* An event source registered with the supervisor's epoll instance */
+struct watcher {
+	int fd;
+	void (*handler)(struct watcher *w, const uint32_t events);
+};
+
+struct check;
+struct shared_result;
+struct uring_probe;
+
+/* A child process which performs checks: one-shot, or a pool worker */
+struct child {
+	pid_t pid;
+	struct watcher pidfd;
+	struct watcher sock;
+	uint64_t deadline;
+	int killed;
+	int worker;
+	int result_fd;
+	struct check *check;
+	struct check *hung_on;
+	struct child *next;
+};
+
+/* Upper bounds of the latency histogram buckets, in milliseconds */
+static const unsigned int latency_buckets_ms[] = {
+	1, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000,
+};
+
+#define NUM_LATENCY_BUCKETS (sizeof(latency_buckets_ms) / sizeof(latency_buckets_ms[0]))
+
+/*
+ * Counters aggregated over every check of a path. They are only ever
+ * updated by the supervisor when a check completes, so reading them (for a
+ * metrics scrape) never involves any filesystem I/O.
+ */
+struct check_stats {
+	uint64_t checks;
+	uint64_t timeouts;
+	uint64_t skipped;
+	uint64_t latency_sum_ns;
+	uint64_t latency_buckets[NUM_LATENCY_BUCKETS];
+	uint64_t status[ERRNO_MAX];
+};
+
+/*
+ * A streaming estimator of the latency of a path, for adaptive timeouts: an
+ * EWMA, and a histogram with exponentially decaying counts (on a log scale,
+ * four buckets per power of two above 64 us) to estimate the P99.
+ */
+#define ADAPT_MIN_SHIFT 16
+#define ADAPT_BUCKETS (1 + 21 * 4)
+
+struct latency_estimator {
+	uint32_t samples;
+	double ewma_ns;
+	double buckets[ADAPT_BUCKETS];
+};
+
+/* The mounts from the same NFS server (see --group-servers) */
+struct server_group {
+	char *server;
+	struct check *rep;
+	int down;
+	struct server_group *next;
+};
+
+/* A single mountpoint check, and its state between rounds (daemon mode) */
+struct check {
+	char *path;
+	int mount_id;
+	int removed;
+	int check_method;
+	struct nfscheck_plan plan;
+	struct nfscheck_plan probe_plan;
+	struct nfscheck_result passive;
+	int timeout_ms;
+	int interval_ms;
+	int inflight;
+	int nhung;
+	int skipped;
+	int timed_out;
+	int backoff;
+	struct child *child;
+	struct check *queue_next;
+	uint64_t deadline;
+	uint64_t started;
+	uint64_t elapsed;
+	uint64_t completed;
+	struct timespec completed_wall;
+	uint64_t next_due;
+	unsigned long rounds;
+	struct nfscheck_result result;
+	struct check_stats stats;
+	struct latency_estimator adapt;
+	int adapt_timeout_ms;
+	int shared;
+	int share_fd;
+	int share_wd;
+	int share_locked;
+	int share_waiting;
+	uint32_t share_seq;
+	struct shared_result *share;
+	int board_slot;
+	struct uring_probe *probe;
+	struct server_group *group;
+	struct check *twin;
+	unsigned int major;
+	unsigned int minor;
+	int group_deferred;
+	int fanned;
+	struct check *verdict_from;
+	int ret;
+	int prev;
+	void (*complete)(struct check *check);
+};
+
+/* Output formats */
+static const int FORMAT_TEXT	= 0;
+static const int FORMAT_JSON	= 1;
 
 /* Global variables */
 static int verbosity = 1;
-static pid_t child = 0;
+static int output_format = 0;
+static int exitcode_map[ERRNO_MAX];
+static struct check **checks = NULL;
+static int nchecks = 0;
+static int checks_size = 0;
+static struct check check_defaults;
+
+static void adapt_restore(struct check *check);
+static struct check *group_verdict(const struct check *check);
+static void group_check_complete(struct check *check);
+static void group_remove(struct check *check);
+static void board_update(struct check *check);
+static void board_release(struct check *check);
+static void passive_merge(struct check *check);
 
 /*
  * Build a logging function which formats a message and outputs it to the
@@ -63,313 +246,5178 @@ DEFINE_LOG_FN(error,	1);
 DEFINE_LOG_FN(verbose,	2);
 DEFINE_LOG_FN(debug,	3);
 
-/* Check methods */
-static const int CHECK_METHOD_STAT	= 0x1;
-static const int CHECK_METHOD_READDIR	= 0x2;
+/* Receives the debug messages of libnfscheck */
+static void library_log(const char *fmt, va_list args)
+{
+	if (verbosity >= 3) {
+		vfprintf(stdout, fmt, args);
+		fflush(stdout);
+	}
+}
 
 /*
- * Check an NFS mountpoint using the readdir method.
- *
- * - Open the mountpoint as a directory
- * - Attempt to read the first directory entry
- * - Close the directory
- *
- * This method has the side effect of performing some read only I/O on the
- * NFS server, but also has a good chance of detecting problems very quickly.
- *
- * Reading a single directory entry is sufficient to check if the server is
- * alive: the current directory (".") is always present, and is also always
- * the first entry returned by readdir().
- *
- * The CentOS 5 NFS client will successfully open and read the contents of
- * a mount point for up to several minutes after the server has crashed. Newer
- * versions behave sensibly (they hang immediately when the server has crashed).
+ * A fixed size output buffer, used to build a complete record before it is
+ * written out with a single write(). Output which does not fit is silently
+ * truncated (and flagged).
  */
-static int check_mountpoint_readdir(const char *path)
+struct outbuf {
+	char *buf;
+	size_t size;
+	size_t len;
+	int truncated;
+	int growable;
+};
+
+/* Make room for at least len more bytes in a growable buffer */
+static int outbuf_grow(struct outbuf *out, const size_t len)
 {
-	struct dirent *dirent;
-	DIR *dirp;
+	size_t size = out->size ? out->size : 4096;
+	char *tmp;
 
-	dirp = opendir(path);
-	if (dirp == NULL) {
-		const int errsave = errno;
-		debug("opendir failed: %s\n", strerror(errsave));
-		return errsave;
+	while (size - out->len <= len) {
+		size *= 2;
 	}
 
-	dirent = readdir(dirp);
-	if (dirent == NULL) {
-		const int errsave = errno;
-		debug("readdir failed: %s\n", strerror(errsave));
-		closedir(dirp);
-		return errsave;
+	tmp = realloc(out->buf, size);
+	if (tmp == NULL) {
+		return ENOMEM;
 	}
 
-	if (closedir(dirp) < 0) {
-		const int errsave = errno;
-		debug("closedir failed: %s\n", strerror(errsave));
-		return errsave;
+	out->buf = tmp;
+	out->size = size;
+	return 0;
+}
+
+static void outbuf_printf(struct outbuf *out, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void outbuf_printf(struct outbuf *out, const char *fmt, ...)
+{
+	va_list args;
+	int ret;
+
+	if (out->growable && out->size == 0 && outbuf_grow(out, 0)) {
+		out->truncated = 1;
+		return;
+	}
+
+	if (out->len + 1 >= out->size) {
+		out->truncated = 1;
+		return;
+	}
+
+	va_start(args, fmt);
+	ret = vsnprintf(out->buf + out->len, out->size - out->len, fmt, args);
+	va_end(args);
+
+	if (ret >= 0 && (size_t)ret >= out->size - out->len && out->growable) {
+		if (outbuf_grow(out, ret) == 0) {
+			va_start(args, fmt);
+			ret = vsnprintf(out->buf + out->len, out->size - out->len, fmt, args);
+			va_end(args);
+		}
+	}
+
+	if (ret < 0 || (size_t)ret >= out->size - out->len) {
+		out->len = out->size - 1;
+		out->truncated = 1;
+		return;
+	}
+
+	out->len += ret;
+}
+
+/* Append a string as a quoted JSON string */
+static void outbuf_json_string(struct outbuf *out, const char *str)
+{
+	const unsigned char *p;
+
+	outbuf_printf(out, "\"");
+	for (p = (const unsigned char *)str; *p != '\0'; p++) {
+		if (*p == '"' || *p == '\\') {
+			outbuf_printf(out, "\\%c", *p);
+		} else if (*p < 0x20) {
+			outbuf_printf(out, "\\u%04x", *p);
+		} else {
+			outbuf_printf(out, "%c", *p);
+		}
+	}
+	outbuf_printf(out, "\"");
+}
+
+/* Write the whole buffer to a file descriptor */
+static int outbuf_write(const struct outbuf *out, const int fd)
+{
+	size_t done = 0;
+
+	while (done < out->len) {
+		const ssize_t ret = write(fd, out->buf + done, out->len - done);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return errno;
+		}
+
+		done += ret;
 	}
 
-	/* success */
 	return 0;
 }
 
 /*
- * Check an NFS mountpoint using the stat method.
+ * Equivalent to nfscheck_parse_duration(), except that it exits with an error
+ * message if the user gave us a bogus value.
+ */
+static int parse_duration_ms(const char *s)
+{
+	int ms = 0;
+
+	if (nfscheck_parse_duration(s, &ms) == 0) {
+		return ms;
+	}
+
+	error("Unable to parse duration: %s\n", s);
+	exit(EINVAL);
+}
+
+/*
+ * Add a check of the given path, with the default settings. The mount id
+ * is the id of the mount in /proc/self/mountinfo which this check was
+ * discovered from, or zero for paths given on the command line. Returns the
+ * new check, or NULL on failure.
+ */
+static struct check *add_check(const char *path, const int mount_id)
+{
+	struct check *check;
+
+	if (nchecks == checks_size) {
+		const int size = checks_size ? checks_size * 2 : 16;
+		struct check **tmp = realloc(checks, size * sizeof(*checks));
+		if (tmp == NULL) {
+			error("Unable to allocate memory for %d checks\n", size);
+			return NULL;
+		}
+
+		checks = tmp;
+		checks_size = size;
+	}
+
+	check = malloc(sizeof(*check));
+	if (check == NULL) {
+		error("Unable to allocate memory for check\n");
+		return NULL;
+	}
+
+	*check = check_defaults;
+	check->path = strdup(path);
+	if (check->path == NULL) {
+		error("Unable to allocate memory for check\n");
+		free(check);
+		return NULL;
+	}
+
+	check->mount_id = mount_id;
+	adapt_restore(check);
+	checks[nchecks++] = check;
+	return check;
+}
+
+/* Find the check of the given path, if there is one */
+static struct check *find_check(const char *path)
+{
+	int i;
+
+	for (i = 0; i < nchecks; i++) {
+		if (strcmp(checks[i]->path, path) == 0) {
+			return checks[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Free every check which has been removed, and which is no longer in use:
+ * not in flight, and with no check process stuck on it.
+ */
+static void sweep_checks(void)
+{
+	int i = 0;
+	int j;
+
+	while (i < nchecks) {
+		struct check *check = checks[i];
+
+		if (!check->removed || check->inflight || check->nhung > 0) {
+			i++;
+			continue;
+		}
+
+		debug("Removed check of %s\n", check->path);
+		board_release(check);
+		for (j = 0; j < nchecks; j++) {
+			if (checks[j]->verdict_from == check) {
+				checks[j]->verdict_from = NULL;
+			}
+		}
+
+		nchecks--;
+		memmove(&checks[i], &checks[i + 1], (nchecks - i) * sizeof(*checks));
+		group_remove(check);
+		free(check->path);
+		free(check);
+	}
+}
+
+/*
+ * The supervisor: an epoll based event loop which watches every outstanding
+ * check process and enforces a deadline on each of them.
  *
- * - Open the mountpoint as a directory
- * - Call fstat to get information about the directory
- * - Close the directory
+ * Each check process is watched through a pidfd, which becomes readable when
+ * the process exits. Older kernels (before Linux 5.3) do not support pidfds,
+ * in which case we fall back to a signalfd which reports SIGCHLD. All of the
+ * per-check deadlines are implemented with a single timerfd, which is always
+ * armed for the earliest outstanding deadline.
  *
- * This method performs a minimal amount of read I/O on the NFS server, and
- * has a decent chance of detecting problems quickly. This method is
- * method is more reliable on newer systems.
+ * Since there are no signal handlers involved, there are no signal handler
+ * races, and none of the system calls here can be interrupted (EINTR).
  *
- * The CentOS 5 NFS client will successfully open the directory and retrieve
- * the status information for up to several minutes after the server has
- * crashed (or the mount has been made stale), with no indication of failure.
- * Newer versions behave better, though there can still be a small delay
- * between the server side problems and being able to detect them on the
- * client side.
+ * When a check process reaches its deadline, it is killed and its check is
+ * immediately completed with ETIMEDOUT. The process itself stays on the list
+ * of children until it can be reaped: a process stuck in uninterruptible
+ * sleep inside the NFS client may take a long time to actually die.
  */
-static int check_mountpoint_stat(const char *path)
+static int supervisor_epfd = -1;
+static int supervisor_use_pidfd = 0;
+static struct watcher supervisor_timer = { .fd = -1, };
+static struct watcher supervisor_sigchld = { .fd = -1, };
+static struct child *children = NULL;
+static int nchildren = 0;
+static int ninflight = 0;
+
+/* Check engines */
+static const int ENGINE_FORK	= 0;
+static const int ENGINE_POOL	= 1;
+static const int ENGINE_URING	= 2;
+static const int ENGINE_THREADS	= 3;
+static const int ENGINE_SPAWN	= 4;
+
+/* Supervisor configuration */
+static int engine = 0;
+static int pool_size = 8;
+static int max_hung = 1;
+static int max_backoff_ms = 300000;
+static int warn_latency_ms = 0;
+static int crit_latency_ms = 0;
+static int fd_cache = 0;
+static int parallel_methods = 0;
+static double max_retrans_pct = 5.0;
+static int max_rtt_ms = 1000;
+
+/*
+ * Directory descriptors cached by every pool worker or thread (see
+ * --fd-cache), and the generation of the cache: it is bumped whenever a
+ * mount disappears, which makes every worker close its descriptors.
+ */
+#define FD_CACHE_SIZE 64
+static unsigned int fd_cache_generation = 0;
+
+/* Pool workers, and the queue of checks waiting for an idle worker */
+static int nworkers = 0;
+static struct check *queue_head = NULL;
+static struct check *queue_tail = NULL;
+
+static void pool_dispatch(void);
+static void share_detach(void);
+static void uring_expire(struct check *check);
+
+static int sys_pidfd_open(const pid_t pid, const unsigned int flags)
 {
-	struct stat buf;
-	int fd;
+	return syscall(__NR_pidfd_open, pid, flags);
+}
 
-	/* open the directory */
-	fd = open(path, O_RDONLY | O_SYNC);
-	if (fd < 0) {
+static int sys_pidfd_send_signal(const int pidfd, const int sig)
+{
+	return syscall(__NR_pidfd_send_signal, pidfd, sig, NULL, 0);
+}
+
+/* Add a watcher to the supervisor's epoll instance */
+static int supervisor_watch(struct watcher *w, const uint32_t events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = w;
+
+	if (epoll_ctl(supervisor_epfd, EPOLL_CTL_ADD, w->fd, &ev) < 0) {
 		const int errsave = errno;
-		debug("open failed: %s\n", strerror(errsave));
+		debug("epoll_ctl failed: %s\n", strerror(errsave));
 		return errsave;
 	}
 
-	/* call fstat on the directory */
-	if (fstat(fd, &buf) < 0) {
-		const int errsave = errno;
-		debug("fstat failed: %s\n", strerror(errsave));
-		close(fd);
-		return errsave;
+	return 0;
+}
+
+/* Remove a watcher from the supervisor's epoll instance, and close it */
+static void supervisor_unwatch(struct watcher *w)
+{
+	if (w->fd < 0) {
+		return;
 	}
 
-	/* close the directory */
-	if (close(fd) < 0) {
-		const int errsave = errno;
-		debug("close failed: %s\n", strerror(errsave));
-		return errsave;
+	epoll_ctl(supervisor_epfd, EPOLL_CTL_DEL, w->fd, NULL);
+	close(w->fd);
+	w->fd = -1;
+}
+
+/* Arm a timerfd for an absolute time on the monotonic clock (0 disarms) */
+static void arm_timerfd(const int fd, const uint64_t when)
+{
+	struct itimerspec its;
+
+	/* an all-zero it_value disarms the timer */
+	memset(&its, 0, sizeof(its));
+	if (when != 0) {
+		its.it_value.tv_sec = when / NSEC_PER_SEC;
+		its.it_value.tv_nsec = when % NSEC_PER_SEC;
 	}
 
-	/* success */
-	return 0;
+	if (timerfd_settime(fd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+		debug("timerfd_settime failed: %s\n", strerror(errno));
+	}
 }
 
 /*
- * Check a NFS mount point to see if it is working, stale, or hung.
- *
- * We attempt to avoid hangs or stalls in this process, but that is not always
- * possible. We also attempt to detect server-side failures quickly, however
- * the Linux Kernel NFS client has several attribute caches which cannot be
- * bypassed. It may take several minutes for the Linux Kernel NFS client to
- * notice that the server has hung, or that the mount point has become stale.
- *
- * This behavior varies widely across Linux Kernel versions. Older Kernel
- * versions are especially bad (they take up to minutes to notice that the
- * server has crashed).
- *
- * Please read "man 5 nfs" very carefully, especially the section
- * titled "DATA AND METADATA COHERENCE".
+ * Arm the timerfd for the earliest deadline of any child not yet killed, of
+ * any check waiting for the result of another invocation (--share-dir), or
+ * of any check performed through io_uring.
  */
-static int check_mountpoint(const char *path, const int check_method)
+static void supervisor_arm_timer(void)
 {
-	int ret = 0;
+	uint64_t deadline = 0;
+	struct child *child;
+	int i;
 
-	if (check_method & CHECK_METHOD_STAT) {
-		debug("before check_mountpoint_stat\n");
-		ret = check_mountpoint_stat(path);
-		debug("check_mountpoint_stat: ret=%d\n", ret);
-		if (ret) {
-			debug("check method stat failed: %d\n", ret);
-			return ret;
+	for (child = children; child != NULL; child = child->next) {
+		/* killed already, or no deadline at all */
+		if (child->killed || child->deadline == 0) {
+			continue;
+		}
+
+		if (deadline == 0 || child->deadline < deadline) {
+			deadline = child->deadline;
 		}
 	}
 
-	if (check_method & CHECK_METHOD_READDIR) {
-		debug("before check_mountpoint_readdir\n");
-		ret = check_mountpoint_readdir(path);
-		debug("check_mountpoint_readdir: ret=%d\n", ret);
-		if (ret) {
-			debug("check method readdir failed: %d\n", ret);
-			return ret;
+	for (i = 0; i < nchecks; i++) {
+		const struct check *check = checks[i];
+
+		/* the checks which are not performed by a child process */
+		if (!check->share_waiting && check->probe == NULL) {
+			continue;
+		}
+
+		if (check->deadline == 0) {
+			continue;
+		}
+
+		if (deadline == 0 || check->deadline < deadline) {
+			deadline = check->deadline;
 		}
 	}
 
-	return ret;
+	arm_timerfd(supervisor_timer.fd, deadline);
 }
 
-/*
- * Wait for a child process to exit, with a maximum time limit.
- *
- * The check process can hang for an arbitrary amount of time if the NFS
- * server is hung. This method implements a way to wait for a bounded time
- * for the check process to end, and then kill it if it takes too long.
- *
- * A subtlety here is that we need to handle the case where we are interrupted
- * by our ALRM signal while we are waiting inside waitpid(). We do this by
- * retrying our waitpid() if it was interrupted by a system call.
- */
-static int wait_for_child(const int timeout)
+/* Kill a check process which has exceeded its deadline (or is abandoned) */
+static void supervisor_kill(struct child *child)
 {
-	int status;
+	int ret;
 
-	/*
-	 * Set an alarm so that we are interrupted if the child does not exit
-	 * in a timely manner (the mount point is hung).
-	 */
-	alarm(timeout);
+	if (child->killed) {
+		return;
+	}
 
 	/*
-	 * Wait for the child to exit, making sure to safely handle the case
-	 * where we are interrupted by our SIGALRM signal handler.
+	 * Signalling through the pidfd means that we can never kill an
+	 * unrelated process which happened to reuse the pid.
 	 */
-	while (1) {
-		if (waitpid(child, &status, 0) < 0) {
-			/* interrupted by signal, try again */
-			if (errno == EINTR) {
-				continue;
-			}
+	if (child->pidfd.fd >= 0) {
+		ret = sys_pidfd_send_signal(child->pidfd.fd, SIGKILL);
+	} else {
+		ret = kill(child->pid, SIGKILL);
+	}
 
-			debug("waitpid failed: %s\n", strerror(errno));
-			exit(1);
+	if (ret < 0) {
+		debug("unable to kill child %d: %s\n", child->pid, strerror(errno));
+	}
+
+	PROBE2(child__kill, child->check != NULL ? child->check->path : NULL, child->pid);
+
+	/* a killed pool worker is retired: it will never serve another check */
+	if (child->worker) {
+		supervisor_unwatch(&child->sock);
+		nworkers--;
+	}
+
+	child->killed = 1;
+}
+
+/* Add a completed check to the counters of its path */
+static void update_check_stats(struct check *check)
+{
+	struct check_stats *stats = &check->stats;
+	unsigned int i;
+
+	stats->checks++;
+	stats->status[check->ret]++;
+	if (check->timed_out) {
+		stats->timeouts++;
+	}
+
+	/* a skipped check never probed anything, so it has no latency */
+	if (check->skipped) {
+		stats->skipped++;
+		return;
+	}
+
+	stats->latency_sum_ns += check->elapsed;
+	for (i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+		if (check->elapsed <= (uint64_t)latency_buckets_ms[i] * NSEC_PER_MSEC) {
+			stats->latency_buckets[i]++;
+			break;
 		}
+	}
+}
 
-		/*
-		 * The call to waitpid succeeded, we have the status
-		 * information we need. Break out of the loop.
-		 */
-		break;
+/*
+ * Adaptive timeouts: the timeout of every check of a path is derived from
+ * the latency history of that path, as a multiple of the larger of its EWMA
+ * and its P99, bounded by --min-timeout and --timeout. Until enough samples
+ * have been observed, the full --timeout is used.
+ *
+ * A check which timed out is recorded at its timeout, so that the estimate
+ * of a path which became slower (rather than hung) keeps growing until its
+ * checks succeed again. A single such sample never moves the P99 by itself.
+ */
+#define ADAPT_WARMUP 8
+#define ADAPT_WINDOW 128.0
+#define ADAPT_EWMA_WEIGHT 0.125
+
+static double adapt_multiplier = 0;
+static int adapt_min_timeout_ms = 50;
+static const char *adapt_state_file = NULL;
+
+/* Histogram bucket of a latency */
+static int adapt_bucket(const uint64_t ns)
+{
+	int octave;
+	int idx;
+
+	if (ns < (1ULL << ADAPT_MIN_SHIFT)) {
+		return 0;
 	}
 
-	/* Cancel the alarm */
-	alarm(0);
+	octave = 63 - __builtin_clzll(ns);
+	idx = 1 + (octave - ADAPT_MIN_SHIFT) * 4 + (int)((ns >> (octave - 2)) & 3);
+	return idx < ADAPT_BUCKETS ? idx : ADAPT_BUCKETS - 1;
+}
 
-	/* Child exited normally, return the child's exit status */
-	if (WIFEXITED(status)) {
-		const int ret = WEXITSTATUS(status);
-		debug("child exited with ret = %d\n", ret);
-		return ret;
+/* Upper bound of a histogram bucket, in nanoseconds */
+static uint64_t adapt_bucket_max(const int idx)
+{
+	int octave;
+
+	if (idx == 0) {
+		return 1ULL << ADAPT_MIN_SHIFT;
 	}
 
-	/* Child was killed by a signal */
-	if (WIFSIGNALED(status)) {
-		const int ret = WTERMSIG(status);
-		debug("child exited from signal = %d\n", ret);
-		/*
-		 * The child was most likely killed by the timeout handler, so
-		 * we assume the mount is hung. We'll use ETIMEDOUT for this
-		 * error case.
-		 */
-		if (ret == SIGKILL) {
-			debug("child was killed by timeout, mountpoint hung\n");
-			return ETIMEDOUT;
+	octave = (idx - 1) / 4 + ADAPT_MIN_SHIFT;
+	return (uint64_t)(4 + (idx - 1) % 4 + 1) << (octave - 2);
+}
+
+static void adapt_update(struct latency_estimator *e, const uint64_t ns)
+{
+	int i;
+
+	for (i = 0; i < ADAPT_BUCKETS; i++) {
+		e->buckets[i] *= 1.0 - 1.0 / ADAPT_WINDOW;
+	}
+
+	e->buckets[adapt_bucket(ns)] += 1.0;
+	if (e->samples++ == 0) {
+		e->ewma_ns = ns;
+	} else {
+		e->ewma_ns += ((double)ns - e->ewma_ns) * ADAPT_EWMA_WEIGHT;
+	}
+}
+
+/* The (decayed) 99th percentile of the latency, in nanoseconds */
+static uint64_t adapt_p99(const struct latency_estimator *e)
+{
+	double total = 0;
+	double sum = 0;
+	int i;
+
+	for (i = 0; i < ADAPT_BUCKETS; i++) {
+		total += e->buckets[i];
+	}
+
+	for (i = 0; i < ADAPT_BUCKETS; i++) {
+		sum += e->buckets[i];
+		if (sum >= total * 0.99) {
+			break;
 		}
+	}
 
-		/*
-		 * Otherwise, the child was killed through some unknown means
-		 * that we did not initiate. We could not determine anything
-		 * about the status of the mountpoint.
-		 */
+	return adapt_bucket_max(i < ADAPT_BUCKETS ? i : ADAPT_BUCKETS - 1);
+}
+
+/* Learn from a completed check */
+static void adapt_record(struct check *check)
+{
+	if (adapt_multiplier == 0 || check->skipped || check->shared) {
+		return;
+	}
+
+	/* failures are usually quick, and say nothing about the latency */
+	if (check->ret != 0 && check->ret != ELATENCY_WARN && check->ret != ELATENCY_CRIT &&
+	    check->ret != ETIMEDOUT) {
+		return;
+	}
+
+	adapt_update(&check->adapt, check->elapsed);
+}
+
+/*
+ * The deadline of the next check of a path, which is started now (zero for
+ * no deadline). The timeout it was derived from is kept for the output.
+ */
+static uint64_t check_deadline(struct check *check, const uint64_t now)
+{
+	const struct latency_estimator *e = &check->adapt;
+	int timeout_ms = check->timeout_ms;
+
+	if (timeout_ms > 0 && adapt_multiplier > 0 && e->samples >= ADAPT_WARMUP) {
+		const uint64_t p99 = adapt_p99(e);
+		const double baseline = e->ewma_ns > p99 ? e->ewma_ns : p99;
+		const double ms = adapt_multiplier * baseline / NSEC_PER_MSEC;
+
+		if (ms < timeout_ms && adapt_min_timeout_ms < timeout_ms) {
+			timeout_ms = ms > adapt_min_timeout_ms ? (int)(ms + 0.5) : adapt_min_timeout_ms;
+		}
+
+		debug("adaptive timeout of %s: %d ms (ewma %.3f ms, p99 %.3f ms)\n", check->path,
+		      timeout_ms, e->ewma_ns / NSEC_PER_MSEC, (double)p99 / NSEC_PER_MSEC);
+	}
+
+	check->adapt_timeout_ms = timeout_ms;
+	return timeout_ms > 0 ? now + (uint64_t)timeout_ms * NSEC_PER_MSEC : 0;
+}
+
+/*
+ * The estimators loaded from the state file. They are restored into the
+ * checks of the same paths as they are added, and saved back (along with
+ * any which were not used this time) on exit.
+ */
+struct adapt_saved {
+	char *path;
+	struct latency_estimator e;
+};
+
+static struct adapt_saved *adapt_saved = NULL;
+static int nadapt_saved = 0;
+
+static struct adapt_saved *adapt_find_saved(const char *path)
+{
+	int i;
+
+	for (i = 0; i < nadapt_saved; i++) {
+		if (strcmp(adapt_saved[i].path, path) == 0) {
+			return &adapt_saved[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* Add (or replace) a saved estimator. Returns 0 on success, or -1 on failure. */
+static int adapt_save_one(const char *path, const struct latency_estimator *e)
+{
+	struct adapt_saved *saved = adapt_find_saved(path);
+	struct adapt_saved *tmp;
+
+	if (saved != NULL) {
+		saved->e = *e;
+		return 0;
+	}
+
+	tmp = realloc(adapt_saved, (nadapt_saved + 1) * sizeof(*tmp));
+	if (tmp == NULL) {
+		return -1;
+	}
+
+	adapt_saved = tmp;
+	adapt_saved[nadapt_saved].path = strdup(path);
+	if (adapt_saved[nadapt_saved].path == NULL) {
+		return -1;
+	}
+
+	adapt_saved[nadapt_saved++].e = *e;
+	return 0;
+}
+
+/* Restore the saved estimator of a check, if there is one */
+static void adapt_restore(struct check *check)
+{
+	const struct adapt_saved *saved = adapt_find_saved(check->path);
+
+	if (saved != NULL) {
+		check->adapt = saved->e;
+	}
+}
+
+/*
+ * Load the state file. Every line holds the estimator of one path: the
+ * number of samples, the EWMA (in nanoseconds), the non-empty histogram
+ * buckets (as index:count), and finally the path itself, after a tab. A
+ * missing file is not an error: it is created on exit.
+ */
+static int adapt_load(const char *filename)
+{
+	FILE *f = fopen(filename, "re");
+	size_t size = 0;
+	char *line = NULL;
+	int ret = 0;
+
+	if (f == NULL) {
+		if (errno == ENOENT) {
+			return 0;
+		}
+
+		ret = errno;
+		error("Unable to open state file %s: %s\n", filename, strerror(ret));
+		return ret;
+	}
+
+	while (getline(&line, &size, f) > 0) {
+		struct latency_estimator e;
+		char *path = strchr(line, '\t');
+		char *save = NULL;
+		char *tok;
+
+		if (path == NULL) {
+			continue;
+		}
+
+		*path++ = '\0';
+		path[strcspn(path, "\n")] = '\0';
+
+		memset(&e, 0, sizeof(e));
+		if (sscanf(line, "%" SCNu32 " %lf", &e.samples, &e.ewma_ns) != 2) {
+			continue;
+		}
+
+		strtok_r(line, " ", &save);
+		strtok_r(NULL, " ", &save);
+		while ((tok = strtok_r(NULL, " ", &save)) != NULL) {
+			double count;
+			int idx;
+
+			if (sscanf(tok, "%d:%lf", &idx, &count) == 2 && idx >= 0 && idx < ADAPT_BUCKETS) {
+				e.buckets[idx] = count;
+			}
+		}
+
+		if (adapt_save_one(path, &e) < 0) {
+			ret = ENOMEM;
+			error("Unable to allocate memory for the state of %s\n", path);
+			break;
+		}
+	}
+
+	free(line);
+	fclose(f);
+	debug("loaded %d latency estimators from %s\n", nadapt_saved, filename);
+	return ret;
+}
+
+/*
+ * Save the estimators of every check (and the other ones which were loaded)
+ * to the state file. It is replaced atomically, so a concurrent invocation
+ * reads either the old or the new file, never a partial one.
+ */
+static int adapt_store(const char *filename)
+{
+	char tmpname[PATH_MAX];
+	FILE *f;
+	int ret = 0;
+	int i;
+	int j;
+
+	for (i = 0; i < nchecks; i++) {
+		if (adapt_save_one(checks[i]->path, &checks[i]->adapt) < 0) {
+			error("Unable to allocate memory for the state of %s\n", checks[i]->path);
+			return ENOMEM;
+		}
+	}
+
+	if (snprintf(tmpname, sizeof(tmpname), "%s.%ld", filename, (long)getpid()) >= (int)sizeof(tmpname)) {
+		return ENAMETOOLONG;
+	}
+
+	f = fopen(tmpname, "we");
+	if (f == NULL) {
+		ret = errno;
+		error("Unable to create state file %s: %s\n", tmpname, strerror(ret));
+		return ret;
+	}
+
+	for (i = 0; i < nadapt_saved; i++) {
+		const struct latency_estimator *e = &adapt_saved[i].e;
+
+		/* a path with a newline could never be read back */
+		if (e->samples == 0 || strchr(adapt_saved[i].path, '\n') != NULL) {
+			continue;
+		}
+
+		fprintf(f, "%" PRIu32 " %.0f", e->samples, e->ewma_ns);
+		for (j = 0; j < ADAPT_BUCKETS; j++) {
+			if (e->buckets[j] >= 0.0001) {
+				fprintf(f, " %d:%.4f", j, e->buckets[j]);
+			}
+		}
+
+		fprintf(f, "\t%s\n", adapt_saved[i].path);
+	}
+
+	if (fflush(f) != 0 || fsync(fileno(f)) < 0) {
+		ret = errno;
+	}
+
+	if (fclose(f) != 0 && ret == 0) {
+		ret = errno;
+	}
+
+	if (ret == 0 && rename(tmpname, filename) < 0) {
+		ret = errno;
+	}
+
+	if (ret) {
+		error("Unable to write state file %s: %s\n", filename, strerror(ret));
+		unlink(tmpname);
+	}
+
+	return ret;
+}
+
+/* Complete a check with the given result, and detach it from its child */
+static void complete_check(struct check *check, int ret)
+{
+	/*
+	 * A working mountpoint which was slow to respond is reported with
+	 * its own status code, so that it can be drained before it hangs.
+	 */
+	if (check->passive.methods != 0) {
+		passive_merge(check);
+	}
+
+	check->result.error = ret;
+	if (ret == 0) {
+		const uint64_t latency = nfscheck_result_latency(&check->result);
+
+		if (crit_latency_ms > 0 && latency >= (uint64_t)crit_latency_ms * NSEC_PER_MSEC) {
+			ret = ELATENCY_CRIT;
+		} else if (warn_latency_ms > 0 && latency >= (uint64_t)warn_latency_ms * NSEC_PER_MSEC) {
+			ret = ELATENCY_WARN;
+		}
+	}
+
+	check->ret = ret;
+	check->completed = nfscheck_now();
+	check->elapsed = check->completed - check->started;
+	PROBE3(check__done, check->path, ret, check->elapsed);
+	clock_gettime(CLOCK_REALTIME, &check->completed_wall);
+	check->inflight = 0;
+	if (check->child != NULL) {
+		check->child->check = NULL;
+		check->child = NULL;
+	}
+
+	ninflight--;
+	update_check_stats(check);
+	adapt_record(check);
+	group_check_complete(check);
+
+	if (check->complete != NULL) {
+		check->complete(check);
+	}
+}
+
+/* Name of a check status code (an errno value, or one of our own codes) */
+static const char *status_name(const int status)
+{
+	if (status == EUNKNOWN) {
+		return "EUNKNOWN";
+	}
+
+	if (status == ELATENCY_WARN) {
+		return "ELATENCY_WARN";
+	}
+
+	if (status == ELATENCY_CRIT) {
+		return "ELATENCY_CRIT";
+	}
+
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 32)
+	return strerrorname_np(status);
+#else
+	return NULL;
+#endif
+}
+
+/*
+ * Format a completed check as a single line JSON record. The age of the
+ * result is included, unless it is negative.
+ */
+/* The plan of a check, in the order in which its methods were performed (see passive_check()) */
+static void performed_plan(const struct check *check, struct nfscheck_plan *order)
+{
+	int i;
+
+	*order = check->plan;
+	order->nsteps = 0;
+	for (i = 0; i < check->plan.nsteps; i++) {
+		if (check->plan.steps[i].method == NFSCHECK_METHOD_MOUNTSTATS) {
+			order->steps[order->nsteps++] = check->plan.steps[i];
+		}
+	}
+
+	for (i = 0; i < check->plan.nsteps; i++) {
+		if (check->plan.steps[i].method != NFSCHECK_METHOD_MOUNTSTATS) {
+			order->steps[order->nsteps++] = check->plan.steps[i];
+		}
+	}
+}
+
+static void format_check_json(struct outbuf *out, const struct check *check, const int64_t age_ns)
+{
+	struct nfscheck_plan order;
+	const char *name = status_name(check->ret);
+	char performed[256];
+	char method[256];
+	int i;
+
+	nfscheck_format_plan(&check->plan, method, sizeof(method));
+	performed_plan(check, &order);
+	nfscheck_format_performed(&order, check->result.methods, performed, sizeof(performed));
+
+	outbuf_printf(out, "{\"time\":%lld.%03ld,\"path\":",
+		      (long long)check->completed_wall.tv_sec, check->completed_wall.tv_nsec / 1000000);
+	outbuf_json_string(out, check->path);
+	outbuf_printf(out, ",\"method\":");
+	outbuf_json_string(out, method);
+	outbuf_printf(out, ",\"performed\":");
+	outbuf_json_string(out, performed);
+	outbuf_printf(out, ",\"status\":%d,\"errno\":", check->ret);
+	if (check->ret != 0 && name != NULL) {
+		outbuf_json_string(out, name);
+	} else {
+		outbuf_printf(out, "null");
+	}
+
+	outbuf_printf(out, ",\"timed_out\":%s,\"skipped\":%s,\"hung\":%d",
+		      check->timed_out ? "true" : "false",
+		      check->skipped ? "true" : "false",
+		      check->nhung);
+	if (check->shared) {
+		outbuf_printf(out, ",\"shared\":true");
+	}
+
+	if (check->group != NULL) {
+		outbuf_printf(out, ",\"server\":");
+		outbuf_json_string(out, check->group->server);
+	}
+
+	if (check->fanned && check->verdict_from != NULL) {
+		outbuf_printf(out, ",\"verdict_from\":");
+		outbuf_json_string(out, check->verdict_from->path);
+	}
+
+	if (age_ns >= 0) {
+		outbuf_printf(out, ",\"age_ms\":%.3f", (double)age_ns / NSEC_PER_MSEC);
+	}
+
+	if (adapt_multiplier > 0) {
+		outbuf_printf(out, ",\"timeout_ms\":%d", check->adapt_timeout_ms);
+	}
+
+	outbuf_printf(out, ",\"elapsed_ms\":%.3f,\"latency_ms\":%.3f,\"phases_ms\":{",
+		      (double)check->elapsed / NSEC_PER_MSEC,
+		      (double)nfscheck_result_latency(&check->result) / NSEC_PER_MSEC);
+
+	for (i = 0; i < NFSCHECK_PHASE_MAX; i++) {
+		if (check->result.phase_ns[i] != 0) {
+			outbuf_printf(out, "%s\"%s\":%.3f", out->buf[out->len - 1] == '{' ? "" : ",",
+				      nfscheck_phase_name(i), (double)check->result.phase_ns[i] / NSEC_PER_MSEC);
+		}
+	}
+
+	outbuf_printf(out, "}");
+
+	/* the verdict of every method, when they were performed in parallel */
+	if (check->plan.parallel) {
+		outbuf_printf(out, ",\"verdicts\":{");
+		for (i = 0; i < check->plan.nsteps; i++) {
+			const int method = check->plan.steps[i].method;
+			const int index = __builtin_ctz(method);
+			const int err = check->result.method_error[index];
+
+			outbuf_printf(out, "%s", i == 0 ? "" : ",");
+			outbuf_json_string(out, nfscheck_method_name(method));
+			if (!(check->result.completed & method)) {
+				outbuf_printf(out, ":{\"completed\":false}");
+				continue;
+			}
+
+			outbuf_printf(out, ":{\"completed\":true,\"status\":%d,\"errno\":", err);
+			if (err != 0 && status_name(err) != NULL) {
+				outbuf_json_string(out, status_name(err));
+			} else {
+				outbuf_printf(out, "null");
+			}
+
+			outbuf_printf(out, ",\"latency_ms\":%.3f}",
+				      (double)check->result.method_ns[index] / NSEC_PER_MSEC);
+		}
+
+		outbuf_printf(out, "}");
+	}
+
+	outbuf_printf(out, "}\n");
+}
+
+/*
+ * Print a completed check as a single line JSON record. The record is
+ * written with a single write(), so records are never interleaved.
+ */
+static void print_check_json(const struct check *check)
+{
+	char buf[8192];
+	struct outbuf out = { .buf = buf, .size = sizeof(buf), };
+	int64_t age_ns = -1;
+
+	/* a result published by another invocation may be a little old */
+	if (check->shared) {
+		struct timespec now;
+
+		clock_gettime(CLOCK_REALTIME, &now);
+		age_ns = (int64_t)(now.tv_sec - check->completed_wall.tv_sec) * (int64_t)NSEC_PER_SEC +
+			 (now.tv_nsec - check->completed_wall.tv_nsec);
+	}
+
+	format_check_json(&out, check, age_ns);
+
+	/* never emit a partial record: it could not be parsed */
+	if (out.truncated) {
+		debug("JSON record for %s truncated, not printed\n", check->path);
+		return;
+	}
+
+	fflush(stdout);
+	outbuf_write(&out, STDOUT_FILENO);
+}
+
+/*
+ * Print the time taken by each phase of a completed check, and the verdict
+ * of every method when they were performed in parallel.
+ */
+static void print_check_phases(const struct check *check)
+{
+	int i;
+
+	for (i = 0; i < NFSCHECK_PHASE_MAX; i++) {
+		if (check->result.phase_ns[i] != 0) {
+			verbose("    %-24s %.3f ms\n", nfscheck_phase_name(i),
+				(double)check->result.phase_ns[i] / NSEC_PER_MSEC);
+		}
+	}
+
+	for (i = 0; i < check->plan.nsteps && check->plan.parallel; i++) {
+		const int method = check->plan.steps[i].method;
+		const int index = __builtin_ctz(method);
+
+		if (!(check->result.completed & method)) {
+			verbose("    %-24s still running\n", nfscheck_method_name(method));
+		} else {
+			verbose("    %-24s %s after %.3f ms\n", nfscheck_method_name(method),
+				check->result.method_error[index] ? strerror(check->result.method_error[index]) : "ok",
+				(double)check->result.method_ns[index] / NSEC_PER_MSEC);
+		}
+	}
+}
+
+/*
+ * Convert the wait status of a check process into a check result.
+ */
+static int child_status_to_result(const int status)
+{
+	/* Child exited normally, return the child's exit status */
+	if (WIFEXITED(status)) {
+		const int ret = WEXITSTATUS(status);
+		debug("child exited with ret = %d\n", ret);
+		return ret;
+	}
+
+	/* Child was killed by a signal */
+	if (WIFSIGNALED(status)) {
+		const int ret = WTERMSIG(status);
+		debug("child exited from signal = %d\n", ret);
+		/*
+		 * The child was most likely killed by the timeout handler, so
+		 * we assume the mount is hung. We'll use ETIMEDOUT for this
+		 * error case.
+		 */
+		if (ret == SIGKILL) {
+			debug("child was killed by timeout, mountpoint hung\n");
+			return ETIMEDOUT;
+		}
+
+		/*
+		 * Otherwise, the child was killed through some unknown means
+		 * that we did not initiate. We could not determine anything
+		 * about the status of the mountpoint.
+		 */
 		debug("mountpoint in unknown status\n");
 		return EUNKNOWN;
 	}
 
-	/* Child was stopped */
-	if (WIFSTOPPED(status)) {
-		debug("child was stopped\n");
-		return EUNKNOWN;
+	/* Child was stopped */
+	if (WIFSTOPPED(status)) {
+		debug("child was stopped\n");
+		return EUNKNOWN;
+	}
+
+	/* Child was continued */
+	if (WIFCONTINUED(status)) {
+		debug("child was continued\n");
+		return EUNKNOWN;
+	}
+
+	/* not sure how we'd possibly get here ... */
+	return EUNKNOWN;
+}
+
+/*
+ * Try to reap a check process without blocking. Returns 1 if the process
+ * has exited (and has been freed), 0 otherwise.
+ */
+static int supervisor_reap(struct child *child)
+{
+	struct child **pp;
+	int status;
+	pid_t pid;
+
+	pid = waitpid(child->pid, &status, WNOHANG);
+	if (pid == 0) {
+		return 0;
+	}
+
+	PROBE3(child__reap, child->check != NULL ? child->check->path : NULL, child->pid, status);
+
+	if (child->check != NULL) {
+		struct check *check = child->check;
+
+		if (pid < 0) {
+			debug("waitpid failed: %s\n", strerror(errno));
+			complete_check(check, EUNKNOWN);
+		} else {
+			/* the phase timings, if the check process sent them */
+			if (child->result_fd < 0 || read(child->result_fd, &check->result,
+					sizeof(check->result)) != sizeof(check->result)) {
+				memset(&check->result, 0, sizeof(check->result));
+			}
+
+			complete_check(check, child_status_to_result(status));
+		}
+	} else if (child->hung_on != NULL) {
+		debug("abandoned child %d for %s finally exited\n", child->pid, child->hung_on->path);
+		child->hung_on->nhung--;
+		board_update(child->hung_on);
+		if (child->hung_on->removed) {
+			sweep_checks();
+		}
+	}
+
+	/* a pool worker which exited unexpectedly leaves the pool */
+	if (child->worker && !child->killed) {
+		debug("pool worker %d exited\n", child->pid);
+		supervisor_unwatch(&child->sock);
+		nworkers--;
+	}
+
+	/* remove from the list of children */
+	for (pp = &children; *pp != NULL; pp = &(*pp)->next) {
+		if (*pp == child) {
+			*pp = child->next;
+			break;
+		}
+	}
+
+	supervisor_unwatch(&child->pidfd);
+	if (child->result_fd >= 0) {
+		close(child->result_fd);
+	}
+
+	nchildren--;
+	free(child);
+
+	supervisor_arm_timer();
+	pool_dispatch();
+	return 1;
+}
+
+/* Event handler: a pidfd became readable, so the child process has exited */
+static void handle_pidfd(struct watcher *w, const uint32_t events)
+{
+	struct child *child = container_of(w, struct child, pidfd);
+
+	(void)events;
+	supervisor_reap(child);
+}
+
+/* Event handler: SIGCHLD was delivered (no pidfd support) */
+static void handle_sigchld(struct watcher *w, const uint32_t events)
+{
+	struct signalfd_siginfo info;
+	struct child *child;
+	struct child *next;
+
+	(void)events;
+
+	/* drain the signalfd: multiple SIGCHLD may be coalesced into one */
+	while (read(w->fd, &info, sizeof(info)) == sizeof(info)) {
+		/* nothing to do */
+	}
+
+	for (child = children; child != NULL; child = next) {
+		next = child->next;
+		supervisor_reap(child);
+	}
+}
+
+/* Event handler: the timerfd expired, so at least one deadline was reached */
+static void handle_timer(struct watcher *w, const uint32_t events)
+{
+	const uint64_t now = nfscheck_now();
+	struct child *child;
+	uint64_t expirations;
+	int i;
+
+	(void)events;
+
+	if (read(w->fd, &expirations, sizeof(expirations)) < 0) {
+		/* spurious wakeup */
+		return;
+	}
+
+	for (child = children; child != NULL; child = child->next) {
+		if (child->killed || child->deadline == 0 || child->deadline > now) {
+			continue;
+		}
+
+		debug("child %d reached its deadline\n", child->pid);
+		supervisor_kill(child);
+
+		/*
+		 * Don't wait for the child to actually exit: it may be stuck
+		 * in the NFS client for a long time. Remember which mount it
+		 * is stuck on until it can be reaped.
+		 */
+		if (child->check != NULL) {
+			child->hung_on = child->check;
+			child->hung_on->nhung++;
+			child->check->timed_out = 1;
+			complete_check(child->check, ETIMEDOUT);
+		}
+	}
+
+	for (i = 0; i < nchecks; i++) {
+		struct check *check = checks[i];
+
+		if (check->deadline == 0 || check->deadline > now) {
+			continue;
+		}
+
+		if (check->probe != NULL) {
+			uring_expire(check);
+			continue;
+		}
+
+		/* nobody published a result in time, so the path is probably hung */
+		if (!check->share_waiting) {
+			continue;
+		}
+
+		debug("gave up waiting for the result for %s\n", check->path);
+		check->share_waiting = 0;
+		check->timed_out = 1;
+		complete_check(check, ETIMEDOUT);
+	}
+
+	supervisor_arm_timer();
+
+	/* replace any pool workers which were retired */
+	pool_dispatch();
+}
+
+/*
+ * Setup the supervisor. This must be done before any check processes have
+ * been started. Returns 0 on success, or an errno value on failure.
+ */
+static int supervisor_init(void)
+{
+	sigset_t mask;
+	int fd;
+	int ret;
+
+	supervisor_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (supervisor_epfd < 0) {
+		const int errsave = errno;
+		error("Unable to create epoll instance: %s\n", strerror(errsave));
+		return errsave;
+	}
+
+	supervisor_timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (supervisor_timer.fd < 0) {
+		const int errsave = errno;
+		error("Unable to create timerfd: %s\n", strerror(errsave));
+		return errsave;
+	}
+
+	supervisor_timer.handler = handle_timer;
+	ret = supervisor_watch(&supervisor_timer, EPOLLIN);
+	if (ret) {
+		return ret;
+	}
+
+	/* check whether this kernel supports pidfds */
+	fd = sys_pidfd_open(getpid(), 0);
+	if (fd >= 0) {
+		debug("using pidfd for child supervision\n");
+		supervisor_use_pidfd = 1;
+		close(fd);
+		return 0;
+	}
+
+	/*
+	 * Fall back to signalfd. SIGCHLD must be blocked before any child is
+	 * created, so that it stays pending until we read it from the
+	 * signalfd.
+	 */
+	debug("pidfd_open failed (%s), using signalfd for child supervision\n", strerror(errno));
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+		const int errsave = errno;
+		error("Unable to block SIGCHLD: %s\n", strerror(errsave));
+		return errsave;
+	}
+
+	supervisor_sigchld.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (supervisor_sigchld.fd < 0) {
+		const int errsave = errno;
+		error("Unable to create signalfd: %s\n", strerror(errsave));
+		return errsave;
+	}
+
+	supervisor_sigchld.handler = handle_sigchld;
+	return supervisor_watch(&supervisor_sigchld, EPOLLIN);
+}
+
+/*
+ * Start supervising a check process which has just been created. The check
+ * process will be killed if it has not exited by the given deadline (from
+ * the monotonic clock, in nanoseconds). A deadline of zero means that the
+ * check process is allowed to run forever.
+ */
+static void supervisor_add(struct child *child, const uint64_t deadline)
+{
+	child->deadline = deadline;
+	child->killed = 0;
+	child->pidfd.fd = -1;
+	child->pidfd.handler = handle_pidfd;
+	if (!child->worker) {
+		child->sock.fd = -1;
+	}
+
+	child->next = children;
+	children = child;
+	nchildren++;
+
+	if (supervisor_use_pidfd) {
+		child->pidfd.fd = sys_pidfd_open(child->pid, 0);
+		if (child->pidfd.fd < 0 || supervisor_watch(&child->pidfd, EPOLLIN)) {
+			/* should never happen: the child cannot have been reaped yet */
+			error("Unable to watch child process %d: %s\n", child->pid, strerror(errno));
+			supervisor_kill(child);
+		}
+	}
+
+	supervisor_arm_timer();
+
+	/*
+	 * In the signalfd case, the child may have exited before we added it
+	 * to the list of children. That SIGCHLD is still pending in the
+	 * signalfd, so it will not be lost.
+	 */
+}
+
+/* Kill every check process, for example when exiting */
+static void supervisor_kill_all(void)
+{
+	struct child *child;
+
+	for (child = children; child != NULL; child = child->next) {
+		supervisor_kill(child);
+	}
+}
+
+/*
+ * A request sent to a pool worker: check this path, using these methods.
+ * The worker replies with the result of the check (a struct nfscheck_result).
+ * The worker closes its cached descriptors when the generation changes.
+ */
+struct worker_request {
+	struct nfscheck_plan plan;
+	unsigned int fd_cache_generation;
+	char path[PATH_MAX];
+};
+
+/*
+ * The main loop of a pool worker: receive requests from the supervisor,
+ * check the mountpoint, and send back the result.
+ *
+ * The worker exits as soon as the supervisor closes its end of the socket
+ * (or exits itself).
+ */
+static void worker_main(const int sock)
+{
+	unsigned int generation = fd_cache_generation;
+	struct nfscheck_result result;
+	struct worker_request req;
+
+	while (1) {
+		ssize_t len;
+
+		len = recv(sock, &req, sizeof(req) - 1, 0);
+		if (len <= (ssize_t)offsetof(struct worker_request, path)) {
+			_exit(0);
+		}
+
+		((char *)&req)[len] = '\0';
+		if (req.fd_cache_generation != generation) {
+			nfscheck_fd_cache_flush();
+			generation = req.fd_cache_generation;
+		}
+
+		result.error = nfscheck_check_plan(req.path, &req.plan, &result);
+
+		if (send(sock, &result, sizeof(result), MSG_NOSIGNAL) != sizeof(result)) {
+			_exit(0);
+		}
+	}
+}
+
+/* Event handler: a pool worker sent back the result of a check */
+static void handle_worker_reply(struct watcher *w, const uint32_t events)
+{
+	struct child *child = container_of(w, struct child, sock);
+	struct nfscheck_result result;
+	int ret;
+
+	(void)events;
+
+	if (recv(w->fd, &result, sizeof(result), MSG_DONTWAIT) != sizeof(result)) {
+		/* the worker died: this is handled when it is reaped */
+		supervisor_unwatch(&child->sock);
+		nworkers--;
+		child->worker = 0;
+		return;
+	}
+
+	if (child->check != NULL) {
+		ret = result.error;
+		if (ret < 0 || ret >= ERRNO_MAX) {
+			ret = EUNKNOWN;
+		}
+
+		child->check->result = result;
+
+		/*
+		 * A parallel check left methods running: retire the worker,
+		 * which may be stuck on this mount until it can be reaped.
+		 */
+		if (result.methods & ~result.completed) {
+			debug("pool worker %d has check methods still running\n", child->pid);
+			supervisor_kill(child);
+			child->hung_on = child->check;
+			child->hung_on->nhung++;
+		}
+
+		/* the worker goes back to the pool without a deadline */
+		child->deadline = 0;
+		complete_check(child->check, ret);
+		supervisor_arm_timer();
+	}
+
+	pool_dispatch();
+}
+
+/*
+ * Create a new pool worker. Returns the worker, or NULL on failure.
+ *
+ * Workers are long lived: they are only retired when they exceed the
+ * deadline of a check (and are killed).
+ */
+static struct child *pool_spawn(void)
+{
+	struct child *child;
+	uint64_t created;
+	int sv[2];
+	pid_t pid;
+
+	child = calloc(1, sizeof(*child));
+	if (child == NULL) {
+		error("Unable to allocate memory for pool worker\n");
+		return NULL;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+		error("Unable to create socket pair: %s\n", strerror(errno));
+		free(child);
+		return NULL;
+	}
+
+	/* Make sure all output has been processed */
+	fflush(stdout);
+
+	created = nfscheck_now();
+	pid = fork();
+	if (pid < 0) {
+		error("Unable to create pool worker: %s\n", strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		free(child);
+		return NULL;
+	} else if (pid == 0) {
+		/* this happens within the worker process only */
+		struct child *other;
+
+		/* never outlive the supervisor */
+		prctl(PR_SET_PDEATHSIG, SIGKILL);
+
+		/* don't hold the sockets of any other worker open */
+		for (other = children; other != NULL; other = other->next) {
+			if (other->sock.fd >= 0) {
+				close(other->sock.fd);
+			}
+		}
+
+		close(sv[0]);
+		share_detach();
+		worker_main(sv[1]);
+	}
+
+	/* this happens within the parent process only */
+	PROBE3(child__create, NULL, pid, nfscheck_now() - created);
+	close(sv[1]);
+
+	child->pid = pid;
+	child->worker = 1;
+	child->result_fd = -1;
+	child->sock.fd = sv[0];
+	child->sock.handler = handle_worker_reply;
+	if (supervisor_watch(&child->sock, EPOLLIN)) {
+		close(child->sock.fd);
+		child->sock.fd = -1;
+		child->worker = 0;
+	} else {
+		nworkers++;
+	}
+
+	debug("created pool worker %d\n", pid);
+	supervisor_add(child, 0);
+	return child;
+}
+
+/* Hand a check to an idle pool worker. Returns 0 on success, else errno. */
+static int pool_send(struct child *child, struct check *check)
+{
+	struct worker_request req;
+	size_t len;
+
+	len = strlen(check->path);
+	if (len >= sizeof(req.path)) {
+		return ENAMETOOLONG;
+	}
+
+	req.plan = check->probe_plan;
+	req.fd_cache_generation = fd_cache_generation;
+	memcpy(req.path, check->path, len + 1);
+	len += offsetof(struct worker_request, path) + 1;
+
+	if (send(child->sock.fd, &req, len, MSG_NOSIGNAL) != (ssize_t)len) {
+		const int errsave = errno;
+		debug("unable to send request to worker %d: %s\n", child->pid, strerror(errsave));
+		return errsave;
+	}
+
+	child->check = check;
+	child->deadline = check->deadline;
+	check->child = child;
+	supervisor_arm_timer();
+	return 0;
+}
+
+/*
+ * Start as many queued checks as possible, using idle pool workers, and
+ * creating new workers up to the size of the pool.
+ */
+static void pool_dispatch(void)
+{
+	while (queue_head != NULL) {
+		struct check *check = queue_head;
+		struct child *child;
+		int ret;
+
+		/* find an idle worker */
+		for (child = children; child != NULL; child = child->next) {
+			if (child->worker && !child->killed && child->check == NULL) {
+				break;
+			}
+		}
+
+		if (child == NULL) {
+			if (nworkers >= pool_size) {
+				return;
+			}
+
+			child = pool_spawn();
+			if (child == NULL || !child->worker) {
+				return;
+			}
+		}
+
+		queue_head = check->queue_next;
+		if (queue_head == NULL) {
+			queue_tail = NULL;
+		}
+
+		check->queue_next = NULL;
+
+		/* waited in the queue for so long that it could never start */
+		if (check->deadline != 0 && check->deadline <= nfscheck_now()) {
+			debug("check of %s expired in the queue\n", check->path);
+			complete_check(check, EUNKNOWN);
+			continue;
+		}
+
+		ret = pool_send(child, check);
+		if (ret) {
+			supervisor_kill(child);
+			complete_check(check, EUNKNOWN);
+		}
+	}
+}
+
+/*
+ * The threads engine: checks are performed by a pool of threads within the
+ * supervisor process, which saves a fork() per check (expensive for a large
+ * process, such as a monitoring agent embedding this logic). The threads are
+ * managed by a libnfscheck context, which is driven by the supervisor's
+ * event loop.
+ *
+ * A thread cannot be killed, so a thread which exceeds the deadline of its
+ * check is abandoned instead: the check is completed with ETIMEDOUT, and the
+ * path is counted as hung until the late result arrives. Abandoned threads
+ * are replaced, up to a total of twice the number of workers.
+ */
+static struct nfscheck_ctx *threads_ctx = NULL;
+static struct watcher threads_event = { .fd = -1, };
+
+/* Hand a check to the threads engine. Returns 0 on success, or an errno value. */
+static int threads_start(struct check *check, const uint64_t deadline)
+{
+	const int ret = nfscheck_submit_plan(threads_ctx, check->path, &check->probe_plan, deadline, check);
+
+	if (ret) {
+		error("Unable to start check of %s: %s\n", check->path, strerror(ret));
+		check->inflight = 0;
+		ninflight--;
+	}
+
+	return ret;
+}
+
+/* Event handler: checks completed, or deadlines were reached */
+static void handle_threads_event(struct watcher *w, const uint32_t events)
+{
+	struct nfscheck_completion done[16];
+	int n;
+	int i;
+
+	(void)w;
+	(void)events;
+
+	n = nfscheck_poll(threads_ctx, done, ARRAY_SIZE(done));
+	for (i = 0; i < n; i++) {
+		struct check *check = done[i].cookie;
+		int ret = done[i].result.error;
+
+		/* an abandoned thread finally returned */
+		if (done[i].late) {
+			debug("abandoned worker thread for %s returned\n", check->path);
+			check->nhung--;
+			board_update(check);
+			continue;
+		}
+
+		if (done[i].timed_out) {
+			debug("worker thread for %s reached its deadline, abandoning it\n", check->path);
+			check->nhung++;
+			check->timed_out = 1;
+		}
+
+		if (ret < 0 || ret >= ERRNO_MAX) {
+			ret = EUNKNOWN;
+		}
+
+		check->result = done[i].result;
+		complete_check(check, ret);
+	}
+}
+
+/*
+ * Setup the threads engine. Returns 0 on success, or an errno value on
+ * failure.
+ */
+static int threads_init(void)
+{
+	const struct nfscheck_options options = {
+		.workers = pool_size,
+		.max_threads = 2 * pool_size,
+	};
+
+	threads_ctx = nfscheck_ctx_new(&options);
+	if (threads_ctx == NULL) {
+		const int errsave = errno;
+		error("Unable to create worker threads: %s\n", strerror(errsave));
+		return errsave;
+	}
+
+	threads_event.fd = nfscheck_fd(threads_ctx);
+	threads_event.handler = handle_threads_event;
+	return supervisor_watch(&threads_event, EPOLLIN);
+}
+
+/*
+ * The io_uring engine: every check is performed by the supervisor itself,
+ * as a short sequence of operations submitted to a single io_uring, with no
+ * child process at all. Each operation is linked to a timeout which expires
+ * at the deadline of its check.
+ *
+ * A hung operation is executed (and stuck) in a kernel worker thread, rather
+ * than in one of our own processes. When the deadline is reached, the check
+ * is completed with ETIMEDOUT straight away, and the operation is counted as
+ * hung on its path (just like a hung check process) until it eventually
+ * completes.
+ *
+ * The linked timeout makes the kernel try to cancel the operation, but an
+ * operation stuck in uninterruptible sleep cannot be cancelled, and its
+ * timeout may then not complete either. The supervisor timerfd therefore
+ * enforces the deadlines of these checks too.
+ *
+ * io_uring cannot read directories, so only the stat and statx methods can
+ * be performed this way. Checks using any other method are performed by the
+ * fork engine instead. Every operation is submitted with IOSQE_ASYNC, so
+ * that submitting it can never block the supervisor.
+ */
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#endif
+
+#ifndef __NR_io_uring_enter
+#define __NR_io_uring_enter 426
+#endif
+
+#define URING_ENTRIES 256
+
+/* The steps of a check performed through io_uring, in order */
+enum uring_step {
+	URING_STATX,
+	URING_OPEN,
+	URING_FSTAT,
+	URING_CLOSE,
+	URING_DONE,
+};
+
+/*
+ * The state of a check performed through io_uring. It lives until both the
+ * operation and its timeout have completed, since the kernel may write into
+ * the statx buffer until then.
+ */
+struct uring_probe {
+	struct check *check;
+	struct check *hung_on;
+	enum uring_step step;
+	int fd;
+	int pending;
+	uint64_t t;
+	uint64_t deadline;
+	struct __kernel_timespec ts;
+	struct statx stx;
+};
+
+/* The mapped rings of the io_uring */
+struct uring {
+	struct watcher w;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int *sq_mask;
+	unsigned int *sq_array;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned int sq_entries;
+	unsigned int to_submit;
+};
+
+static struct uring ring = { .w = { .fd = -1, }, };
+
+/* The io_uring_cqe user_data of a timeout: the probe, with the lowest bit set */
+#define URING_TIMEOUT_TAG 1UL
+
+static int sys_io_uring_setup(const unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(const int fd, const unsigned int to_submit, const unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, 0, flags, NULL, 0);
+}
+
+/*
+ * Whether a check plan can be performed through io_uring: only the stat and
+ * statx methods, in that order (statx first), without escalation, and not in
+ * parallel.
+ */
+static int uring_supported(const struct nfscheck_plan *plan)
+{
+	int i;
+
+	if (plan->parallel) {
+		return 0;
+	}
+
+	for (i = 0; i < plan->nsteps; i++) {
+		const struct nfscheck_step *step = &plan->steps[i];
+
+		if (step->escalate_ms > 0) {
+			return 0;
+		}
+
+		if (step->method == NFSCHECK_METHOD_STATX && i == 0) {
+			continue;
+		}
+
+		if (step->method != NFSCHECK_METHOD_STAT) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/* Submit every operation queued so far, in a single system call */
+static void uring_submit(void)
+{
+	int ret;
+
+	while (ring.to_submit > 0) {
+		ret = sys_io_uring_enter(ring.w.fd, ring.to_submit, 0);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			/* should never happen: the completions will free up room */
+			debug("io_uring_enter failed: %s\n", strerror(errno));
+			return;
+		}
+
+		ring.to_submit -= ret;
+	}
+}
+
+/* Get the next free submission queue entry */
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int tail = *ring.sq_tail;
+
+	/* the queue is full: submit what we have */
+	if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) >= ring.sq_entries) {
+		uring_submit();
+	}
+
+	sqe = &ring.sqes[tail & *ring.sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sq_array[tail & *ring.sq_mask] = tail & *ring.sq_mask;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring.to_submit++;
+	return sqe;
+}
+
+/* The next step of a check, after the given one */
+static enum uring_step uring_next_step(const struct check *check, const enum uring_step step)
+{
+	switch (step) {
+	case URING_STATX:
+		if (check->check_method & NFSCHECK_METHOD_STAT) {
+			return URING_OPEN;
+		}
+
+		return URING_DONE;
+	case URING_OPEN:
+		return URING_FSTAT;
+	case URING_FSTAT:
+		return URING_CLOSE;
+	default:
+		return URING_DONE;
+	}
+}
+
+/* Queue the operation of the current step of a probe, and its timeout */
+static void uring_queue_step(struct uring_probe *probe)
+{
+	const struct check *check = probe->check;
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	switch (probe->step) {
+	case URING_STATX:
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t)check->path;
+		sqe->len = STATX_TYPE | STATX_MODE;
+		sqe->off = (uintptr_t)&probe->stx;
+		sqe->statx_flags = AT_STATX_FORCE_SYNC | AT_NO_AUTOMOUNT;
+		break;
+	case URING_OPEN:
+		sqe->opcode = IORING_OP_OPENAT;
+		sqe->fd = AT_FDCWD;
+		sqe->addr = (uintptr_t)check->path;
+		sqe->open_flags = O_RDONLY | O_SYNC | O_CLOEXEC;
+		break;
+	case URING_FSTAT:
+		sqe->opcode = IORING_OP_STATX;
+		sqe->fd = probe->fd;
+		sqe->addr = (uintptr_t)"";
+		sqe->len = STATX_BASIC_STATS;
+		sqe->off = (uintptr_t)&probe->stx;
+		sqe->statx_flags = AT_EMPTY_PATH;
+		break;
+	default:
+		sqe->opcode = IORING_OP_CLOSE;
+		sqe->fd = probe->fd;
+		break;
+	}
+
+	sqe->flags = IOSQE_ASYNC;
+	sqe->user_data = (uintptr_t)probe;
+	probe->pending++;
+	probe->t = nfscheck_now();
+
+	if (probe->deadline == 0) {
+		return;
+	}
+
+	/* every step of a check shares the same absolute deadline */
+	sqe->flags |= IOSQE_IO_LINK;
+
+	sqe = uring_get_sqe();
+	sqe->opcode = IORING_OP_LINK_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)&probe->ts;
+	sqe->len = 1;
+	sqe->timeout_flags = IORING_TIMEOUT_ABS;
+	sqe->user_data = (uintptr_t)probe | URING_TIMEOUT_TAG;
+	probe->pending++;
+}
+
+/* Free a probe once the kernel is done with it */
+static void uring_put_probe(struct uring_probe *probe)
+{
+	if (probe->check == NULL && probe->hung_on == NULL && probe->pending == 0) {
+		free(probe);
+	}
+}
+
+/* Complete the check of a probe, which is then no longer needed */
+static void uring_complete(struct uring_probe *probe, const int ret)
+{
+	struct check *check = probe->check;
+
+	probe->check = NULL;
+	check->probe = NULL;
+	complete_check(check, ret);
+}
+
+/*
+ * The deadline of a check was reached, and its operation could not be
+ * cancelled (yet), so it is stuck in a kernel worker thread. Don't wait for
+ * it: remember which mount it is stuck on until it completes.
+ */
+static void uring_expire(struct check *check)
+{
+	struct uring_probe *probe = check->probe;
+
+	debug("io_uring operation on %s reached its deadline, and is hung\n", check->path);
+	probe->hung_on = check;
+	check->nhung++;
+	check->timed_out = 1;
+	uring_complete(probe, ETIMEDOUT);
+}
+
+/* The operation of a probe completed, with the given result */
+static void uring_step_done(struct uring_probe *probe, const int res)
+{
+	static const enum nfscheck_phase phases[] = {
+		[URING_STATX] = NFSCHECK_PHASE_STATX_STATX,
+		[URING_OPEN] = NFSCHECK_PHASE_STAT_OPEN,
+		[URING_FSTAT] = NFSCHECK_PHASE_STAT_FSTAT,
+		[URING_CLOSE] = NFSCHECK_PHASE_STAT_CLOSE,
+	};
+	struct check *check = probe->check;
+	const enum uring_step step = probe->step;
+
+	/* the check timed out already: the operation was hung */
+	if (check == NULL) {
+		if (step == URING_OPEN && res >= 0) {
+			close(res);
+		} else if (step == URING_FSTAT) {
+			close(probe->fd);
+		}
+
+		if (probe->hung_on != NULL) {
+			debug("hung io_uring operation on %s completed\n", probe->hung_on->path);
+			probe->hung_on->nhung--;
+			board_update(probe->hung_on);
+			probe->hung_on = NULL;
+		}
+
+		return;
+	}
+
+	nfscheck_phase_done(&check->result, phases[step], &probe->t);
+	check->result.methods |= (step == URING_STATX) ? NFSCHECK_METHOD_STATX : NFSCHECK_METHOD_STAT;
+
+	/*
+	 * Cancelled by its timeout (or interrupted by the cancellation): the
+	 * deadline was reached.
+	 */
+	if (res == -ECANCELED ||
+	    (res == -EINTR && probe->deadline != 0 && nfscheck_now() >= probe->deadline)) {
+		debug("io_uring operation on %s reached its deadline\n", check->path);
+		if (step == URING_FSTAT) {
+			close(probe->fd);
+		}
+
+		check->timed_out = 1;
+		uring_complete(probe, ETIMEDOUT);
+		return;
+	}
+
+	if (res < 0) {
+		debug("io_uring operation on %s failed: %s\n", check->path, strerror(-res));
+		if (step == URING_FSTAT) {
+			close(probe->fd);
+		}
+
+		uring_complete(probe, -res < ERRNO_MAX ? -res : EUNKNOWN);
+		return;
+	}
+
+	if (step == URING_OPEN) {
+		probe->fd = res;
+	}
+
+	probe->step = uring_next_step(check, step);
+	if (probe->step == URING_DONE) {
+		uring_complete(probe, 0);
+		return;
+	}
+
+	uring_queue_step(probe);
+}
+
+/* The timeout of a probe completed: -ETIME if it expired */
+static void uring_timeout_done(struct uring_probe *probe, const int res)
+{
+	struct check *check = probe->check;
+
+	/* the operation completed (or was cancelled) first */
+	if (res != -ETIME || check == NULL) {
+		return;
+	}
+
+	uring_expire(check);
+}
+
+/* Event handler: the io_uring has completions */
+static void handle_uring(struct watcher *w, const uint32_t events)
+{
+	unsigned int head = *ring.cq_head;
+
+	(void)w;
+	(void)events;
+
+	while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+		const struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+		const uintptr_t data = cqe->user_data;
+		const int res = cqe->res;
+		struct uring_probe *probe = (struct uring_probe *)(data & ~URING_TIMEOUT_TAG);
+
+		head++;
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+		probe->pending--;
+		if (data & URING_TIMEOUT_TAG) {
+			uring_timeout_done(probe, res);
+		} else {
+			uring_step_done(probe, res);
+		}
+
+		uring_put_probe(probe);
+	}
+
+	uring_submit();
+}
+
+/* Start a check through the io_uring. Returns 0 on success, or an errno value. */
+static int uring_start(struct check *check, const uint64_t deadline)
+{
+	struct uring_probe *probe;
+
+	probe = calloc(1, sizeof(*probe));
+	if (probe == NULL) {
+		error("Unable to allocate memory for io_uring probe\n");
+		check->inflight = 0;
+		ninflight--;
+		return ENOMEM;
+	}
+
+	probe->check = check;
+	probe->fd = -1;
+	probe->deadline = deadline;
+	probe->ts.tv_sec = deadline / NSEC_PER_SEC;
+	probe->ts.tv_nsec = deadline % NSEC_PER_SEC;
+	probe->step = (check->check_method & NFSCHECK_METHOD_STATX) ? URING_STATX : URING_OPEN;
+	check->probe = probe;
+	supervisor_arm_timer();
+
+	/* submitted in a batch, before we next wait for events */
+	uring_queue_step(probe);
+	return 0;
+}
+
+/*
+ * Setup the io_uring engine. Returns 0 on success, or an errno value if
+ * io_uring is not usable (too old a kernel, or disabled by the admin).
+ */
+static int uring_init(void)
+{
+	struct io_uring_params p;
+	size_t sq_size;
+	size_t cq_size;
+	void *sq;
+	void *cq;
+	void *sqes;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = sys_io_uring_setup(URING_ENTRIES, &p);
+	if (fd < 0) {
+		return errno;
+	}
+
+	/* IORING_FEAT_NODROP: completions are never lost (Linux 5.5 and newer) */
+	if (!(p.features & IORING_FEAT_NODROP) || !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		close(fd);
+		return ENOTSUP;
+	}
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (cq_size > sq_size) {
+		sq_size = cq_size;
+	}
+
+	sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED) {
+		const int errsave = errno;
+		close(fd);
+		return errsave;
+	}
+
+	cq = sq;
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		const int errsave = errno;
+		munmap(sq, sq_size);
+		close(fd);
+		return errsave;
+	}
+
+	ring.sq_head = (unsigned int *)((char *)sq + p.sq_off.head);
+	ring.sq_tail = (unsigned int *)((char *)sq + p.sq_off.tail);
+	ring.sq_mask = (unsigned int *)((char *)sq + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned int *)((char *)sq + p.sq_off.array);
+	ring.cq_head = (unsigned int *)((char *)cq + p.cq_off.head);
+	ring.cq_tail = (unsigned int *)((char *)cq + p.cq_off.tail);
+	ring.cq_mask = (unsigned int *)((char *)cq + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)((char *)cq + p.cq_off.cqes);
+	ring.sqes = sqes;
+	ring.sq_entries = p.sq_entries;
+
+	ring.w.fd = fd;
+	ring.w.handler = handle_uring;
+	return supervisor_watch(&ring.w, EPOLLIN);
+}
+
+/*
+ * The spawn engine: like the fork engine, one check process per check, but
+ * it is created by posix_spawn(), which (in glibc) runs the child with
+ * clone(CLONE_VM | CLONE_VFORK) on a small stack of its own, until it
+ * exec()s this program again as a check helper. The page tables of the
+ * supervisor are never copied, so creating a check process takes the same
+ * time however large the supervisor has grown (in daemon mode, or when it
+ * is embedded in a larger program).
+ *
+ * A child sharing our memory cannot run the check methods itself (they
+ * allocate memory and set errno, which would corrupt our own), hence the
+ * exec(). The helper gets the check on its command line, and sends its
+ * result back through a pipe, on SPAWN_RESULT_FD. The supervisor is only
+ * suspended until the exec() completes, which involves nothing but this
+ * program (so it should not be installed on an NFS mount).
+ */
+#define SPAWN_HELPER_ARG "--check-helper"
+#define SPAWN_RESULT_FD 3
+
+static const char *spawn_argv0 = NULL;
+static char spawn_scratch_dir[PATH_MAX];
+static char spawn_rpc_timeout[16];
+
+/* Remember the settings which the check helpers need */
+static void spawn_init(const char *argv0, const char *scratch_dir, const int rpc_timeout_ms)
+{
+	spawn_argv0 = argv0;
+	snprintf(spawn_scratch_dir, sizeof(spawn_scratch_dir), "%s", scratch_dir != NULL ? scratch_dir : "");
+	snprintf(spawn_rpc_timeout, sizeof(spawn_rpc_timeout), "%d", rpc_timeout_ms);
+}
+
+/* Create a check helper for a check, which writes its result into result_fd. Returns 0, or an errno value. */
+static int spawn_helper(struct check *check, const int result_fd, pid_t *pid)
+{
+	posix_spawn_file_actions_t actions;
+	char verbose_str[16];
+	char plan[256];
+	char *argv[] = {
+		(char *)spawn_argv0, SPAWN_HELPER_ARG, plan, check->probe_plan.parallel ? "1" : "0",
+		spawn_scratch_dir, spawn_rpc_timeout, verbose_str, check->path, NULL,
+	};
+	int ret;
+
+	nfscheck_format_plan(&check->probe_plan, plan, sizeof(plan));
+	snprintf(verbose_str, sizeof(verbose_str), "%d", verbosity);
+
+	ret = posix_spawn_file_actions_init(&actions);
+	if (ret) {
+		return ret;
+	}
+
+	ret = posix_spawn_file_actions_adddup2(&actions, result_fd, SPAWN_RESULT_FD);
+	if (ret == 0) {
+		ret = posix_spawn(pid, "/proc/self/exe", &actions, NULL, argv, environ);
+	}
+
+	posix_spawn_file_actions_destroy(&actions);
+	return ret;
+}
+
+/*
+ * The main function of a check helper:
+ * <argv0> --check-helper <plan> <parallel> <scratch dir> <rpc timeout> <verbosity> <path>
+ */
+static int spawn_helper_main(const int argc, char *argv[])
+{
+	struct nfscheck_result result;
+	struct nfscheck_plan plan;
+
+	if (argc != 8 || nfscheck_parse_plan(argv[2], &plan)) {
+		error("Invalid check helper invocation\n");
+		return NFSCHECK_EUNKNOWN;
+	}
+
+	plan.parallel = atoi(argv[3]);
+	if (argv[4][0] != '\0') {
+		nfscheck_set_scratch_dir(argv[4]);
+	}
+
+	nfscheck_set_rpc_timeout(atoi(argv[5]));
+	verbosity = atoi(argv[6]);
+	nfscheck_set_log(library_log);
+
+	result.error = nfscheck_check_plan(argv[7], &plan, &result);
+	if (write(SPAWN_RESULT_FD, &result, sizeof(result)) < 0) {
+		/* the exit code is still good enough */
+	}
+
+	return result.error;
+}
+
+/*
+ * A passive method (mountstats) cannot hang, so the supervisor performs it
+ * itself, before the rest of the plan, whatever its position in the plan:
+ * it never costs a check process, and it is judged against the previous
+ * check of the path by this process, whatever the engine. The rest of the
+ * plan (probe_plan) is only performed if it passed. Returns 1 if the check
+ * is complete, or 0 if the rest of the plan must be started.
+ */
+static int passive_check(struct check *check)
+{
+	struct nfscheck_plan passive;
+	int i;
+
+	check->probe_plan = check->plan;
+	if (!(nfscheck_plan_methods(&check->plan) & NFSCHECK_METHOD_MOUNTSTATS)) {
+		return 0;
+	}
+
+	nfscheck_plan_init(&passive, NFSCHECK_METHOD_MOUNTSTATS);
+	nfscheck_check_plan(check->path, &passive, &check->passive);
+
+	check->probe_plan.nsteps = 0;
+	for (i = 0; i < check->plan.nsteps; i++) {
+		if (check->plan.steps[i].method != NFSCHECK_METHOD_MOUNTSTATS) {
+			check->probe_plan.steps[check->probe_plan.nsteps++] = check->plan.steps[i];
+		}
+	}
+
+	if (check->passive.error == 0 && check->probe_plan.nsteps > 0) {
+		return 0;
+	}
+
+	check->result = check->passive;
+	memset(&check->passive, 0, sizeof(check->passive));
+	complete_check(check, check->result.error);
+	return 1;
+}
+
+/* Add the result of the passive method to the result of the check process */
+static void passive_merge(struct check *check)
+{
+	const int index = __builtin_ctz(NFSCHECK_METHOD_MOUNTSTATS);
+	int i;
+
+	for (i = 0; i < NFSCHECK_PHASE_MAX; i++) {
+		check->result.phase_ns[i] += check->passive.phase_ns[i];
+	}
+
+	check->result.methods |= check->passive.methods;
+	check->result.completed |= check->passive.completed;
+	check->result.method_error[index] = check->passive.method_error[index];
+	check->result.method_ns[index] = check->passive.method_ns[index];
+	memset(&check->passive, 0, sizeof(check->passive));
+}
+
+/*
+ * Start a check, and supervise the child process which performs it. The
+ * check process is killed if it does not complete by the deadline. Returns
+ * 0 on success, or an errno value on failure.
+ *
+ * This is used as a safety measure, to make sure that this program
+ * does not hang forever if the NFS server is not responding to
+ * requests (it has crashed, etc.) and one of the system calls it makes
+ * hangs.
+ *
+ * The child process handles all of the interaction with the filesystem:
+ * either a new child is forked (or spawned) for this check only, or it is
+ * handed to an idle worker from the pool.
+ *
+ * The parent process waits for the child to complete the check. If the child
+ * does not complete the check in a timely manner, it is killed with the
+ * assumption that it is hung within a system call.
+ *
+ * Every child stuck on a mountpoint is counted until it can be reaped. Once
+ * too many are stuck on the same mountpoint (by default: any), no new check
+ * process is created for it, so a hung server cannot exhaust the PID table.
+ */
+static int start_check(struct check *check, const uint64_t deadline)
+{
+	struct check *verdict;
+	struct child *child;
+	uint64_t created;
+	int pipefd[2];
+	pid_t pid;
+	int ret;
+
+	check->started = nfscheck_now();
+	check->deadline = deadline;
+	check->elapsed = 0;
+	PROBE2(check__start, check->path, engine);
+	check->inflight = 1;
+	check->skipped = 0;
+	check->timed_out = 0;
+	check->fanned = 0;
+	check->verdict_from = NULL;
+	memset(&check->result, 0, sizeof(check->result));
+	memset(&check->passive, 0, sizeof(check->passive));
+	ninflight++;
+
+	/*
+	 * Circuit breaker: while earlier check processes are still stuck on
+	 * this mountpoint, another one would almost certainly get stuck too.
+	 * Report the mountpoint as still hung without probing it again.
+	 */
+	if (check->nhung >= max_hung) {
+		debug("%d check processes still hung on %s, not starting another\n",
+		      check->nhung, check->path);
+		check->skipped = 1;
+		check->timed_out = 1;
+		complete_check(check, ETIMEDOUT);
+		return 0;
+	}
+
+	/* the verdict of another mount (see --group-servers) applies to this one */
+	verdict = group_verdict(check);
+	if (verdict != NULL) {
+		debug("%s gets the verdict of %s, not probing it\n", check->path, verdict->path);
+		check->skipped = 1;
+		check->timed_out = verdict->timed_out;
+		check->fanned = 1;
+		check->verdict_from = verdict;
+		check->result = verdict->result;
+		complete_check(check, verdict->result.error);
+		return 0;
+	}
+
+	if (passive_check(check)) {
+		return 0;
+	}
+
+	if (engine == ENGINE_URING && uring_supported(&check->probe_plan)) {
+		return uring_start(check, deadline);
+	}
+
+	if (engine == ENGINE_THREADS) {
+		return threads_start(check, deadline);
+	}
+
+	if (engine == ENGINE_POOL) {
+		if (queue_tail != NULL) {
+			queue_tail->queue_next = check;
+		} else {
+			queue_head = check;
+		}
+
+		queue_tail = check;
+		pool_dispatch();
+		return 0;
+	}
+
+	child = calloc(1, sizeof(*child));
+	if (child == NULL) {
+		error("Unable to allocate memory for child process\n");
+		check->inflight = 0;
+		ninflight--;
+		return ENOMEM;
+	}
+
+	/* the check process sends its phase timings back through a pipe */
+	if (pipe2(pipefd, O_CLOEXEC | O_NONBLOCK) < 0) {
+		const int errsave = errno;
+		error("Unable to create pipe: %s\n", strerror(errsave));
+		check->inflight = 0;
+		ninflight--;
+		free(child);
+		return errsave;
+	}
+
+	/* Make sure all output has been processed */
+	fflush(stdout);
+
+	created = nfscheck_now();
+	if (engine == ENGINE_SPAWN) {
+		ret = spawn_helper(check, pipefd[1], &pid);
+	} else {
+		pid = fork();
+		ret = pid < 0 ? errno : 0;
+	}
+
+	if (ret) {
+		error("Unable to create child process: %s\n", strerror(ret));
+		check->inflight = 0;
+		ninflight--;
+		close(pipefd[0]);
+		close(pipefd[1]);
+		free(child);
+		return ret;
+	} else if (pid == 0) {
+		/* this happens within the child process only */
+		struct nfscheck_result result;
+
+		share_detach();
+		result.error = nfscheck_check_plan(check->path, &check->probe_plan, &result);
+		if (write(pipefd[1], &result, sizeof(result)) < 0) {
+			/* the exit code is still good enough */
+		}
+
+		exit(result.error);
+	}
+
+	/* this happens within the parent process only */
+	PROBE3(child__create, check->path, pid, nfscheck_now() - created);
+	close(pipefd[1]);
+	child->result_fd = pipefd[0];
+	child->pid = pid;
+	child->check = check;
+	check->child = child;
+
+	supervisor_add(child, deadline);
+	return 0;
+}
+
+/* Wait for events, and dispatch them to their handlers */
+static void supervisor_dispatch(const int timeout_ms)
+{
+	struct epoll_event events[64];
+	int nevents;
+	int i;
+
+	/* the io_uring operations queued since the last wait, as a batch */
+	if (ring.w.fd >= 0) {
+		uring_submit();
+	}
+
+	nevents = epoll_wait(supervisor_epfd, events, ARRAY_SIZE(events), timeout_ms);
+	if (nevents < 0) {
+		if (errno != EINTR) {
+			debug("epoll_wait failed: %s\n", strerror(errno));
+		}
+
+		return;
+	}
+
+	for (i = 0; i < nevents; i++) {
+		struct watcher *w = events[i].data.ptr;
+		w->handler(w, events[i].events);
+	}
+}
+
+/*
+ * Single-flight for concurrent invocations (--share-dir): when several
+ * copies of this program check the same path at the same time (typically
+ * from different cron jobs), only one of them probes it, and the others
+ * wait for its result instead of creating check processes of their own,
+ * which would most likely get stuck on the same hung server.
+ *
+ * Every path has a small result file in the share directory, which is
+ * memory mapped by every invocation checking that path. The invocation
+ * which manages to take a write lock on the file probes the path, and then
+ * publishes its result into the file. The others wait for a new result to
+ * be published (bounded by their own timeout), and are woken up through
+ * inotify when the lock holder closes the file. If the lock holder exits
+ * without publishing anything, one of the waiters takes over the lock and
+ * probes the path itself.
+ *
+ * The lock is a classic POSIX record lock, so it is not inherited by the
+ * check processes: a hung check process never keeps the lock held.
+ *
+ * Results are published with a sequence lock (the sequence number is odd
+ * while a result is being written), so a reader never sees a torn result.
+ */
+#define SHARE_MAGIC 0x6e6d6336U
+
+struct shared_result {
+	uint32_t magic;
+	uint32_t seq;
+	struct nfscheck_plan plan;
+	int timed_out;
+	int skipped;
+	uint64_t elapsed;
+	struct timespec completed_wall;
+	struct nfscheck_result result;
+};
+
+static const char *share_dir = NULL;
+static int share_max_age_ms = 0;
+static struct watcher share_inotify = { .fd = -1, };
+
+/*
+ * Take a consistent snapshot of the result published for a check. Returns
+ * 1 if there is a usable result (published by a check with the same
+ * methods), or 0 otherwise.
+ */
+static int share_snapshot(const struct check *check, struct shared_result *snap)
+{
+	const struct shared_result *share = check->share;
+	uint32_t seq;
+	int tries;
+
+	for (tries = 0; tries < 100; tries++) {
+		seq = __atomic_load_n(&share->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			/* a result is being published right now */
+			continue;
+		}
+
+		memcpy(snap, share, sizeof(*snap));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&share->seq, __ATOMIC_RELAXED) == seq) {
+			snap->seq = seq;
+			return snap->magic == SHARE_MAGIC &&
+			       memcmp(&snap->plan, &check->plan, sizeof(snap->plan)) == 0;
+		}
+	}
+
+	return 0;
+}
+
+/* Age of a published result, in milliseconds (negative if it is from the future) */
+static int64_t share_age_ms(const struct shared_result *snap)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (int64_t)(now.tv_sec - snap->completed_wall.tv_sec) * 1000 +
+	       (now.tv_nsec - snap->completed_wall.tv_nsec) / 1000000;
+}
+
+/* Complete a check with a result published by another invocation */
+static void share_use(struct check *check, const struct shared_result *snap)
+{
+	debug("Using the result for %s published %lld ms ago\n",
+	      check->path, (long long)share_age_ms(snap));
+
+	check->shared = 1;
+	check->share_waiting = 0;
+	check->timed_out = snap->timed_out;
+	check->skipped = snap->skipped;
+	check->result = snap->result;
+	complete_check(check, snap->result.error);
+
+	/* report the result as it was published */
+	check->elapsed = snap->elapsed;
+	check->completed_wall = snap->completed_wall;
+}
+
+/* Publish the result of a completed check, for the other invocations */
+static void share_publish(struct check *check)
+{
+	struct shared_result *share = check->share;
+	uint32_t seq = __atomic_load_n(&share->seq, __ATOMIC_RELAXED);
+
+	/* an odd sequence number was left behind by a crashed publisher */
+	seq = (seq + 1) | 1;
+	__atomic_store_n(&share->seq, seq, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	share->magic = SHARE_MAGIC;
+	share->plan = check->plan;
+	share->timed_out = check->timed_out;
+	share->skipped = check->skipped;
+	share->elapsed = check->elapsed;
+	share->completed_wall = check->completed_wall;
+	share->result = check->result;
+
+	__atomic_store_n(&share->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Try to take the lock of a result file. Returns 0 on success, or an errno value. */
+static int share_trylock(struct check *check)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+
+	if (fcntl(check->share_fd, F_SETLK, &fl) < 0) {
+		return errno;
+	}
+
+	check->share_locked = 1;
+	return 0;
+}
+
+/*
+ * Completion callback of a check in single-flight mode: publish the result
+ * (if we probed the path ourselves), and close the result file. Closing the
+ * file releases the lock, and wakes up the other invocations.
+ */
+static void share_check_complete(struct check *check)
+{
+	if (check->share_locked) {
+		share_publish(check);
+		check->share_locked = 0;
+	}
+
+	munmap(check->share, sizeof(*check->share));
+	check->share = NULL;
+	close(check->share_fd);
+	check->share_fd = -1;
+}
+
+/*
+ * Close every result file in a check process. A hung check process (which
+ * may well outlive us) must not keep the result files open, otherwise the
+ * waiters would never be woken up if we exit without publishing anything.
+ */
+static void share_detach(void)
+{
+	int i;
+
+	for (i = 0; i < nchecks; i++) {
+		if (checks[i]->share != NULL) {
+			munmap(checks[i]->share, sizeof(*checks[i]->share));
+			close(checks[i]->share_fd);
+		}
+	}
+}
+
+/* Start probing a path ourselves, within whatever remains of the deadline */
+static int share_probe(struct check *check)
+{
+	debug("Took the lock for %s, probing it\n", check->path);
+
+	/* start_check() accounts for the check again */
+	check->share_waiting = 0;
+	check->inflight = 0;
+	ninflight--;
+
+	return start_check(check, check->deadline);
+}
+
+/*
+ * Look for a new result for a waiting check, or take over the lock if the
+ * previous holder gave up without publishing anything.
+ */
+static void share_poll(struct check *check)
+{
+	struct shared_result snap;
+	int ret;
+
+	if (share_snapshot(check, &snap) && snap.seq != check->share_seq) {
+		share_use(check, &snap);
+		return;
+	}
+
+	if (share_trylock(check) == 0) {
+		ret = share_probe(check);
+		if (ret) {
+			/* like a check process which failed to report anything */
+			check->inflight = 1;
+			ninflight++;
+			complete_check(check, EUNKNOWN);
+		}
+	}
+}
+
+/* Event handler: a result file was closed by someone */
+static void handle_share_inotify(struct watcher *w, const uint32_t events)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	ssize_t len;
+	ssize_t off;
+	int i;
+
+	(void)events;
+
+	len = read(w->fd, buf, sizeof(buf));
+	if (len <= 0) {
+		/* spurious wakeup */
+		return;
+	}
+
+	for (off = 0; off < len; off += sizeof(*ev) + ev->len) {
+		ev = (const struct inotify_event *)(buf + off);
+
+		for (i = 0; i < nchecks; i++) {
+			if (checks[i]->share_waiting && checks[i]->share_wd == ev->wd) {
+				share_poll(checks[i]);
+			}
+		}
+	}
+}
+
+/* Open (and map) the result file of a check. Returns 0 on success, or an errno value. */
+static int share_open(struct check *check)
+{
+	char name[PATH_MAX];
+	struct outbuf out = { .buf = name, .size = sizeof(name), };
+	const char *p;
+	struct stat st;
+	void *map;
+	int fd;
+
+	/* the path, with anything other than [A-Za-z0-9._-] escaped */
+	outbuf_printf(&out, "%s/", share_dir);
+	for (p = check->path; *p != '\0'; p++) {
+		if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+		    (*p >= '0' && *p <= '9') || *p == '.' || *p == '_' || *p == '-') {
+			outbuf_printf(&out, "%c", *p);
+		} else {
+			outbuf_printf(&out, "%%%02X", (unsigned char)*p);
+		}
+	}
+
+	if (out.truncated) {
+		return ENAMETOOLONG;
+	}
+
+	fd = open(name, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+	if (fd < 0) {
+		return errno;
+	}
+
+	if (fstat(fd, &st) < 0 ||
+	    (st.st_size < (off_t)sizeof(struct shared_result) &&
+	     ftruncate(fd, sizeof(struct shared_result)) < 0)) {
+		const int errsave = errno;
+		close(fd);
+		return errsave;
+	}
+
+	map = mmap(NULL, sizeof(struct shared_result), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		const int errsave = errno;
+		close(fd);
+		return errsave;
+	}
+
+	/* watch before looking at the lock, so that a release is never missed */
+	check->share_wd = inotify_add_watch(share_inotify.fd, name, IN_CLOSE_WRITE);
+	if (check->share_wd < 0) {
+		const int errsave = errno;
+		munmap(map, sizeof(struct shared_result));
+		close(fd);
+		return errsave;
+	}
+
+	check->share_fd = fd;
+	check->share = map;
+	return 0;
+}
+
+/*
+ * Setup single-flight mode. Returns 0 on success, or an errno value on
+ * failure.
+ */
+static int share_init(void)
+{
+	share_inotify.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (share_inotify.fd < 0) {
+		const int errsave = errno;
+		error("Unable to create inotify instance: %s\n", strerror(errsave));
+		return errsave;
+	}
+
+	share_inotify.handler = handle_share_inotify;
+	return supervisor_watch(&share_inotify, EPOLLIN);
+}
+
+/*
+ * Start a check in single-flight mode: use a recent enough result if there
+ * is one, probe the path if nobody else is probing it, or wait for the
+ * result of whoever is. Falls back to probing the path if the result file
+ * cannot be used. Returns 0 on success, or an errno value on failure.
+ */
+static int share_start_check(struct check *check, const uint64_t deadline)
+{
+	struct shared_result snap;
+	int have;
+	int ret;
+
+	ret = share_open(check);
+	if (ret) {
+		error("Unable to share the result for %s: %s\n", check->path, strerror(ret));
+		return start_check(check, deadline);
+	}
+
+	check->complete = share_check_complete;
+	check->started = nfscheck_now();
+	check->deadline = deadline;
+	check->inflight = 1;
+	ninflight++;
+
+	have = share_snapshot(check, &snap);
+	if (have && share_max_age_ms > 0) {
+		const int64_t age = share_age_ms(&snap);
+
+		if (age >= 0 && age <= share_max_age_ms) {
+			share_use(check, &snap);
+			return 0;
+		}
+	}
+
+	check->share_seq = have ? snap.seq : 0;
+	check->share_waiting = 1;
+
+	ret = share_trylock(check);
+	if (ret == 0) {
+		return share_probe(check);
+	}
+
+	if (ret != EAGAIN && ret != EACCES) {
+		error("Unable to lock the result for %s: %s\n", check->path, strerror(ret));
+		return share_probe(check);
+	}
+
+	debug("%s is being checked by another process, waiting for its result\n", check->path);
+	supervisor_arm_timer();
+
+	/* the lock holder may have published its result in the meantime */
+	share_poll(check);
+	return 0;
+}
+
+/* Start a check, sharing its result with concurrent invocations if requested */
+static int begin_check(struct check *check, const uint64_t deadline)
+{
+	if (share_dir != NULL) {
+		return share_start_check(check, deadline);
+	}
+
+	return start_check(check, deadline);
+}
+
+/*
+ * Buffered line reader for files in /proc, which are read in small chunks
+ * instead of all at once: /proc/self/mountinfo (and friends) can be large on
+ * nodes with many mounts. Lines which do not fit into the buffer are skipped.
+ */
+struct line_reader {
+	int fd;
+	size_t start;
+	size_t len;
+	int skipping;
+	char buf[8192];
+};
+
+static void line_reader_init(struct line_reader *lr, const int fd)
+{
+	lr->fd = fd;
+	lr->start = 0;
+	lr->len = 0;
+	lr->skipping = 0;
+}
+
+/*
+ * Return the next line (without its newline), or NULL at the end of the
+ * file (or on error). The line is only valid until the next call.
+ */
+static char *line_reader_next(struct line_reader *lr)
+{
+	while (1) {
+		char *line = lr->buf + lr->start;
+		char *nl = memchr(line, '\n', lr->len);
+		ssize_t nread;
+
+		if (nl != NULL) {
+			const size_t linelen = nl - line + 1;
+
+			*nl = '\0';
+			lr->start += linelen;
+			lr->len -= linelen;
+
+			/* the tail end of an overlong line */
+			if (lr->skipping) {
+				lr->skipping = 0;
+				continue;
+			}
+
+			return line;
+		}
+
+		/* move the partial line to the start of the buffer */
+		memmove(lr->buf, line, lr->len);
+		lr->start = 0;
+
+		/* the partial line fills the buffer: skip it */
+		if (lr->len == sizeof(lr->buf) - 1) {
+			lr->skipping = 1;
+			lr->len = 0;
+		}
+
+		nread = read(lr->fd, lr->buf + lr->len, sizeof(lr->buf) - 1 - lr->len);
+		if (nread < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (nread <= 0) {
+			/* a final line without a newline */
+			if (lr->len > 0 && !lr->skipping) {
+				lr->buf[lr->len] = '\0';
+				lr->len = 0;
+				return lr->buf;
+			}
+
+			return NULL;
+		}
+
+		lr->len += nread;
+	}
+}
+
+/*
+ * The mount table: the mounts from /proc/self/mountinfo which match the
+ * user's filters (--all-nfs, --fstype, --include and --exclude).
+ *
+ * The table is parsed once at startup. In daemon mode, it is updated
+ * whenever the kernel reports that the mounts have changed, by polling
+ * /proc/self/mountinfo for POLLPRI: mounts which appeared are added to the
+ * checks, and mounts which disappeared are removed from them.
+ */
+struct mount_entry {
+	int mount_id;
+	unsigned int major;
+	unsigned int minor;
+	char *mountpoint;
+	char *fstype;
+	char *source;
+	char *options;
+	int seen;
+};
+
+static struct mount_entry *mounts = NULL;
+static int nmounts = 0;
+static int all_nfs = 0;
+static char *fstype_filter = NULL;
+static char **include_filters = NULL;
+static int ninclude_filters = 0;
+static char **exclude_filters = NULL;
+static int nexclude_filters = 0;
+static struct watcher mountinfo_watch = { .fd = -1, };
+
+static void daemon_add_check(struct check *check);
+
+/*
+ * Parse one line of /proc/self/mountinfo (see nfscheck_parse_mountinfo()).
+ * The fields are modified in place. Returns 0 on success, or -1 if the line
+ * is malformed.
+ */
+static int parse_mountinfo_line(char *line, struct mount_entry *entry)
+{
+	struct nfscheck_mountinfo info;
+
+	memset(entry, 0, sizeof(*entry));
+	if (nfscheck_parse_mountinfo(line, &info) != 0) {
+		return -1;
+	}
+
+	entry->mount_id = info.mount_id;
+	entry->major = info.major;
+	entry->minor = info.minor;
+	entry->mountpoint = info.mountpoint;
+	entry->fstype = info.fstype;
+	entry->source = info.source;
+	entry->options = info.options;
+	return 0;
+}
+
+/* Check whether a comma separated list contains the given item */
+static int list_contains(const char *list, const char *item)
+{
+	const size_t len = strlen(item);
+	const char *p = list;
+
+	while (p != NULL && *p != '\0') {
+		const char *end = strchr(p, ',');
+		const size_t n = end != NULL ? (size_t)(end - p) : strlen(p);
+
+		if (n == len && strncmp(p, item, len) == 0) {
+			return 1;
+		}
+
+		p = end != NULL ? end + 1 : NULL;
+	}
+
+	return 0;
+}
+
+/* Check whether a mount matches the user's filters */
+static int mount_matches(const struct mount_entry *entry)
+{
+	const char *fstypes = fstype_filter != NULL ? fstype_filter : "nfs,nfs4";
+	int i;
+
+	if (!list_contains(fstypes, entry->fstype)) {
+		return 0;
+	}
+
+	for (i = 0; i < nexclude_filters; i++) {
+		if (fnmatch(exclude_filters[i], entry->mountpoint, 0) == 0) {
+			return 0;
+		}
+	}
+
+	/* without any include filters, every mount is included */
+	if (ninclude_filters == 0) {
+		return 1;
+	}
+
+	for (i = 0; i < ninclude_filters; i++) {
+		if (fnmatch(include_filters[i], entry->mountpoint, 0) == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void free_mount_entry(struct mount_entry *entry)
+{
+	free(entry->mountpoint);
+	free(entry->fstype);
+	free(entry->source);
+	free(entry->options);
+}
+
+/* Find a mount in the mount table by its mount id */
+static struct mount_entry *find_mount(const int mount_id)
+{
+	int i;
+
+	for (i = 0; i < nmounts; i++) {
+		if (mounts[i].mount_id == mount_id) {
+			return &mounts[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* Add a copy of a parsed mount to the mount table */
+static int add_mount(const struct mount_entry *entry)
+{
+	struct mount_entry *tmp;
+	struct mount_entry *m;
+
+	tmp = realloc(mounts, (nmounts + 1) * sizeof(*mounts));
+	if (tmp == NULL) {
+		return ENOMEM;
+	}
+
+	mounts = tmp;
+	m = &mounts[nmounts];
+	*m = *entry;
+	m->mountpoint = strdup(entry->mountpoint);
+	m->fstype = strdup(entry->fstype);
+	m->source = strdup(entry->source);
+	m->options = strdup(entry->options);
+	m->seen = 1;
+
+	if (m->mountpoint == NULL || m->fstype == NULL || m->source == NULL || m->options == NULL) {
+		free_mount_entry(m);
+		return ENOMEM;
+	}
+
+	nmounts++;
+	return 0;
+}
+
+/*
+ * Server groups (--group-servers): the discovered mounts are grouped by the
+ * address of their NFS server, and the first mount of every group stands
+ * for the server. When a server dies, every one of its mounts hangs, so
+ * probing all of them would only pile up stuck check processes. Instead,
+ * while the representative of a server times out (or is still hung), its
+ * verdict is fanned out to its siblings without probing them. Any other
+ * result only applies to the mount itself (a stale export, for example), so
+ * the siblings are then probed individually.
+ *
+ * Mounts which share a superblock (the same device number, such as bind
+ * mounts, or several mounts of the same export) are always mounted from
+ * the same server, and end up in the same group. Every one of them is the
+ * twin of the first such mount (their primary), whose most recent verdict
+ * applies to them, whatever it is: only the primary is ever probed.
+ *
+ * In a single shot invocation, the siblings wait for the verdict of their
+ * representative (or twins for that of their primary) before they are
+ * started, each with its own timeout.
+ */
+static int group_servers = 0;
+static struct server_group *server_groups = NULL;
+
+/* Add a check to the group of the server of its mount */
+static void group_add(struct check *check, const struct mount_entry *entry)
+{
+	struct server_group *group;
+	char server[256];
+	int i;
+
+	if (nfscheck_mount_server(entry->source, entry->options, server, sizeof(server))) {
+		return;
+	}
+
+	for (group = server_groups; group != NULL; group = group->next) {
+		if (strcmp(group->server, server) == 0) {
+			break;
+		}
+	}
+
+	if (group == NULL) {
+		group = calloc(1, sizeof(*group));
+		if (group == NULL || (group->server = strdup(server)) == NULL) {
+			/* not fatal: the mount is checked on its own */
+			free(group);
+			return;
+		}
+
+		group->next = server_groups;
+		server_groups = group;
+	}
+
+	/* the first mount of the same superblock in the group, if any */
+	check->major = entry->major;
+	check->minor = entry->minor;
+	for (i = 0; i < nchecks; i++) {
+		struct check *other = checks[i];
+
+		if (other != check && other->group == group && other->twin == NULL && !other->removed &&
+		    other->major == check->major && other->minor == check->minor) {
+			debug("%s is the same filesystem as %s\n", check->path, other->path);
+			check->twin = other;
+			break;
+		}
+	}
+
+	if (group->rep == NULL) {
+		debug("%s represents server %s\n", check->path, server);
+		group->rep = check;
+	}
+
+	check->group = group;
+}
+
+/*
+ * Remove a check from its group: its twins elect a new primary, and the
+ * group a new representative if needed.
+ */
+static void group_remove(struct check *check)
+{
+	struct server_group *group = check->group;
+	struct check *primary = NULL;
+	int i;
+
+	if (group == NULL) {
+		return;
+	}
+
+	for (i = 0; i < nchecks; i++) {
+		if (checks[i] == check || checks[i]->twin != check) {
+			continue;
+		}
+
+		if (primary == NULL) {
+			primary = checks[i];
+			primary->twin = NULL;
+		} else {
+			checks[i]->twin = primary;
+		}
+	}
+
+	if (group->rep != check) {
+		return;
+	}
+
+	group->rep = NULL;
+	group->down = 0;
+	for (i = 0; i < nchecks; i++) {
+		if (checks[i] != check && checks[i]->group == group && !checks[i]->removed &&
+		    checks[i]->twin == NULL) {
+			debug("%s represents server %s\n", checks[i]->path, group->server);
+			group->rep = checks[i];
+			break;
+		}
+	}
+}
+
+/*
+ * The check whose verdict applies to a check (its primary, or the
+ * representative of its server while the server is down), or NULL if the
+ * check must be probed.
+ */
+static struct check *group_verdict(const struct check *check)
+{
+	const struct server_group *group = check->group;
+	const struct check *twin = check->twin;
+
+	if (group == NULL) {
+		return NULL;
+	}
+
+	/* a primary in flight has no result to share yet */
+	if (twin != NULL && !twin->removed && !twin->inflight && twin->completed != 0) {
+		return check->twin;
+	}
+
+	if (group->rep == check || !group->down) {
+		return NULL;
+	}
+
+	return group->rep;
+}
+
+/* The check whose verdict a check waits for in a single shot invocation, if any */
+static const struct check *group_awaits(const struct check *check)
+{
+	if (check->group == NULL) {
+		return NULL;
+	}
+
+	if (check->twin != NULL) {
+		return check->twin;
+	}
+
+	return check->group->rep != check ? check->group->rep : NULL;
+}
+
+/*
+ * Defer a check until the representative of its server (or its primary)
+ * has a verdict. Returns 1 if the check was deferred, or 0 if it must
+ * start now.
+ */
+static int group_defer(struct check *check)
+{
+	if (group_awaits(check) == NULL) {
+		return 0;
+	}
+
+	check->group_deferred = 1;
+	return 1;
+}
+
+/* A check completed: if it represents its server, update the verdict of the server */
+static void group_check_complete(struct check *check)
+{
+	struct server_group *group = check->group;
+	uint64_t now;
+	int i;
+
+	if (group == NULL) {
+		return;
+	}
+
+	if (group->rep == check) {
+		if (group->down != (check->ret == ETIMEDOUT)) {
+			verbose("Server %s is %s, according to %s\n", group->server,
+				check->ret == ETIMEDOUT ? "down" : "up", check->path);
+		}
+
+		group->down = check->ret == ETIMEDOUT;
+	}
+
+	/* start the siblings (or twins) which were waiting for this verdict */
+	now = nfscheck_now();
+	for (i = 0; i < nchecks; i++) {
+		struct check *sibling = checks[i];
+		int ret;
+
+		if (!sibling->group_deferred || group_awaits(sibling) != check) {
+			continue;
+		}
+
+		sibling->group_deferred = 0;
+		ret = begin_check(sibling, check_deadline(sibling, now));
+		if (ret) {
+			error("Unable to start check of %s: %s\n", sibling->path, strerror(ret));
+			sibling->ret = EUNKNOWN;
+
+			/* its own twins are not waiting for anything anymore */
+			group_check_complete(sibling);
+		}
+	}
+}
+
+/*
+ * Read /proc/self/mountinfo and update the mount table (and the checks)
+ * incrementally: only the mounts which appeared or disappeared since the
+ * last update are touched. Returns 0 on success, or an errno value.
+ */
+static int update_mounts(void)
+{
+	struct line_reader lr;
+	char *line;
+	int i;
+	int j;
+
+	if (lseek(mountinfo_watch.fd, 0, SEEK_SET) < 0) {
+		const int errsave = errno;
+		error("Unable to rewind /proc/self/mountinfo: %s\n", strerror(errsave));
+		return errsave;
+	}
+
+	for (i = 0; i < nmounts; i++) {
+		mounts[i].seen = 0;
+	}
+
+	line_reader_init(&lr, mountinfo_watch.fd);
+	while ((line = line_reader_next(&lr)) != NULL) {
+		struct mount_entry entry;
+		struct mount_entry *m;
+
+		if (parse_mountinfo_line(line, &entry) < 0 || !mount_matches(&entry)) {
+			continue;
+		}
+
+		m = find_mount(entry.mount_id);
+		if (m != NULL) {
+			m->seen = 1;
+			continue;
+		}
+
+		if (add_mount(&entry)) {
+			error("Unable to allocate memory for mount table\n");
+			return ENOMEM;
+		}
+
+		/* an explicitly specified path may already be checked */
+		if (find_check(entry.mountpoint) == NULL) {
+			struct check *check = add_check(entry.mountpoint, entry.mount_id);
+			if (check == NULL) {
+				return ENOMEM;
+			}
+
+			verbose("Discovered %s mount %s from %s\n", entry.fstype, entry.mountpoint, entry.source);
+			if (group_servers) {
+				group_add(check, &entry);
+			}
+
+			daemon_add_check(check);
+		}
+	}
+
+	/* the mounts which disappeared */
+	i = 0;
+	while (i < nmounts) {
+		struct mount_entry *m = &mounts[i];
+
+		if (m->seen) {
+			i++;
+			continue;
+		}
+
+		verbose("Mount %s disappeared\n", m->mountpoint);
+		for (j = 0; j < nchecks; j++) {
+			if (checks[j]->mount_id == m->mount_id) {
+				checks[j]->removed = 1;
+			}
+		}
+
+		/* a cached descriptor keeps a lazily unmounted mount alive */
+		if (fd_cache) {
+			fd_cache_generation++;
+			nfscheck_fd_cache_invalidate();
+		}
+
+		free_mount_entry(m);
+		nmounts--;
+		memmove(m, m + 1, (nmounts - i) * sizeof(*mounts));
+	}
+
+	sweep_checks();
+	return 0;
+}
+
+/* Event handler: the kernel reported a change to the mounts */
+static void handle_mountinfo(struct watcher *w, const uint32_t events)
+{
+	(void)w;
+	(void)events;
+
+	debug("mount table changed\n");
+	update_mounts();
+}
+
+/* Open /proc/self/mountinfo, and build the mount table */
+static int init_mounts(void)
+{
+	mountinfo_watch.fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+	if (mountinfo_watch.fd < 0) {
+		const int errsave = errno;
+		error("Unable to open /proc/self/mountinfo: %s\n", strerror(errsave));
+		return errsave;
+	}
+
+	mountinfo_watch.handler = handle_mountinfo;
+	return update_mounts();
+}
+
+/*
+ * Client connections to the daemon's servers (the metrics endpoint, and the
+ * status socket). Each connection sends a single request, which is answered
+ * with a single response, after which the connection is closed.
+ *
+ * The servers run within the supervisor's event loop, using non-blocking
+ * sockets, so a slow client can never block the supervisor.
+ */
+#define MAX_CONNECTIONS 64
+#define REQUEST_MAX 4096
+#define CONNECTION_IDLE_TIMEOUT_NS (10 * NSEC_PER_SEC)
+
+struct conn;
+
+/* A listening socket, and how to handle the requests it receives */
+struct listener {
+	struct watcher w;
+	const char *terminator;
+	void (*request)(struct conn *conn);
+};
+
+struct conn {
+	struct watcher w;
+	struct listener *listener;
+	uint64_t accepted;
+	size_t reqlen;
+	char req[REQUEST_MAX];
+	struct outbuf resp;
+	size_t sent;
+	struct check *waiting;
+};
+
+static struct conn *conns[MAX_CONNECTIONS];
+
+static void conn_close(struct conn *conn)
+{
+	int i;
+
+	for (i = 0; i < MAX_CONNECTIONS; i++) {
+		if (conns[i] == conn) {
+			conns[i] = NULL;
+		}
+	}
+
+	supervisor_unwatch(&conn->w);
+	free(conn->resp.buf);
+	free(conn);
+}
+
+/* Send as much of the response as the socket will take */
+static void conn_send(struct conn *conn)
+{
+	while (conn->sent < conn->resp.len) {
+		const ssize_t ret = send(conn->w.fd, conn->resp.buf + conn->sent,
+					 conn->resp.len - conn->sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				struct epoll_event ev = { .events = EPOLLOUT, .data.ptr = &conn->w, };
+				epoll_ctl(supervisor_epfd, EPOLL_CTL_MOD, conn->w.fd, &ev);
+				return;
+			}
+
+			break;
+		}
+
+		conn->sent += ret;
+	}
+
+	conn_close(conn);
+}
+
+/* Event handler: a connection is readable (or writable) */
+static void handle_conn(struct watcher *w, const uint32_t events)
+{
+	struct conn *conn = container_of(w, struct conn, w);
+	ssize_t ret;
+
+	if (events & EPOLLOUT) {
+		conn_send(conn);
+		return;
+	}
+
+	ret = recv(w->fd, conn->req + conn->reqlen, sizeof(conn->req) - 1 - conn->reqlen, MSG_DONTWAIT);
+	if (ret <= 0) {
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return;
+		}
+
+		/* the client went away (possibly while waiting for a check) */
+		conn_close(conn);
+		return;
+	}
+
+	/* a request is already being answered */
+	if (conn->waiting != NULL || conn->resp.len > 0) {
+		return;
+	}
+
+	conn->reqlen += ret;
+	conn->req[conn->reqlen] = '\0';
+
+	if (strstr(conn->req, conn->listener->terminator) != NULL) {
+		conn->resp.growable = 1;
+		conn->listener->request(conn);
+	} else if (conn->reqlen == sizeof(conn->req) - 1) {
+		/* request too large */
+		conn_close(conn);
+	}
+}
+
+/* Event handler: a new connection to one of the servers */
+static void handle_listener(struct watcher *w, const uint32_t events)
+{
+	struct listener *listener = container_of(w, struct listener, w);
+	const uint64_t now = nfscheck_now();
+	struct conn *conn;
+	int slot = -1;
+	int fd;
+	int i;
+
+	(void)events;
+
+	fd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+
+	/*
+	 * Find a free slot, closing connections which have been idle too
+	 * long. Connections waiting for a check are never idle.
+	 */
+	for (i = 0; i < MAX_CONNECTIONS; i++) {
+		if (conns[i] != NULL && conns[i]->waiting == NULL &&
+		    now - conns[i]->accepted > CONNECTION_IDLE_TIMEOUT_NS) {
+			conn_close(conns[i]);
+		}
+
+		if (conns[i] == NULL && slot < 0) {
+			slot = i;
+		}
+	}
+
+	conn = slot >= 0 ? calloc(1, sizeof(*conn)) : NULL;
+	if (conn == NULL) {
+		debug("too many connections\n");
+		close(fd);
+		return;
+	}
+
+	conn->w.fd = fd;
+	conn->w.handler = handle_conn;
+	conn->listener = listener;
+	conn->accepted = now;
+	if (supervisor_watch(&conn->w, EPOLLIN)) {
+		close(fd);
+		free(conn);
+		return;
+	}
+
+	conns[slot] = conn;
+}
+
+/* Start accepting connections on a bound socket */
+static int listener_init(struct listener *listener, const int fd)
+{
+	if (listen(fd, MAX_CONNECTIONS) < 0) {
+		const int errsave = errno;
+		error("Unable to listen: %s\n", strerror(errsave));
+		close(fd);
+		return errsave;
+	}
+
+	listener->w.fd = fd;
+	listener->w.handler = handle_listener;
+	return supervisor_watch(&listener->w, EPOLLIN);
+}
+
+/*
+ * Metrics exporter (daemon mode): a minimal HTTP server which serves the
+ * counters of every path in the Prometheus text exposition format.
+ *
+ * A scrape only formats the counters which the supervisor has already
+ * aggregated, so it never performs any filesystem I/O, and can never wait
+ * on a hung check.
+ */
+static const char *listen_addr = NULL;
+
+/* Append a string as a Prometheus label value */
+static void outbuf_label_value(struct outbuf *out, const char *str)
+{
+	const char *p;
+
+	outbuf_printf(out, "\"");
+	for (p = str; *p != '\0'; p++) {
+		if (*p == '"' || *p == '\\') {
+			outbuf_printf(out, "\\%c", *p);
+		} else if (*p == '\n') {
+			outbuf_printf(out, "\\n");
+		} else {
+			outbuf_printf(out, "%c", *p);
+		}
+	}
+	outbuf_printf(out, "\"");
+}
+
+/* Format one metric line for a path: name{path="..."[,extra]} value */
+static void metrics_line(struct outbuf *out, const char *name, const struct check *check,
+			 const char *extra, const char *fmt, ...) __attribute__((format(printf, 5, 6)));
+static void metrics_line(struct outbuf *out, const char *name, const struct check *check,
+			 const char *extra, const char *fmt, ...)
+{
+	char value[64];
+	va_list args;
+
+	va_start(args, fmt);
+	vsnprintf(value, sizeof(value), fmt, args);
+	va_end(args);
+
+	outbuf_printf(out, "%s{path=", name);
+	outbuf_label_value(out, check->path);
+	outbuf_printf(out, "%s%s} %s\n", extra != NULL ? "," : "", extra != NULL ? extra : "", value);
+}
+
+/* Format the counters of every path in the Prometheus text format */
+static void format_metrics(struct outbuf *out)
+{
+	unsigned int j;
+	int i;
+
+	outbuf_printf(out, "# HELP nfs_mountpoint_check_latency_seconds Time taken by checks.\n");
+	outbuf_printf(out, "# TYPE nfs_mountpoint_check_latency_seconds histogram\n");
+	for (i = 0; i < nchecks; i++) {
+		const struct check_stats *stats = &checks[i]->stats;
+		const uint64_t count = stats->checks - stats->skipped;
+		uint64_t cumulative = 0;
+		char le[32];
+
+		for (j = 0; j < NUM_LATENCY_BUCKETS; j++) {
+			cumulative += stats->latency_buckets[j];
+			snprintf(le, sizeof(le), "le=\"%g\"", latency_buckets_ms[j] / 1000.0);
+			metrics_line(out, "nfs_mountpoint_check_latency_seconds_bucket", checks[i], le,
+				     "%llu", (unsigned long long)cumulative);
+		}
+
+		metrics_line(out, "nfs_mountpoint_check_latency_seconds_bucket", checks[i], "le=\"+Inf\"",
+			     "%llu", (unsigned long long)count);
+		metrics_line(out, "nfs_mountpoint_check_latency_seconds_sum", checks[i], NULL,
+			     "%.9f", (double)stats->latency_sum_ns / NSEC_PER_SEC);
+		metrics_line(out, "nfs_mountpoint_check_latency_seconds_count", checks[i], NULL,
+			     "%llu", (unsigned long long)count);
+	}
+
+	outbuf_printf(out, "# HELP nfs_mountpoint_check_checks_total Checks completed.\n");
+	outbuf_printf(out, "# TYPE nfs_mountpoint_check_checks_total counter\n");
+	for (i = 0; i < nchecks; i++) {
+		metrics_line(out, "nfs_mountpoint_check_checks_total", checks[i], NULL,
+			     "%llu", (unsigned long long)checks[i]->stats.checks);
+	}
+
+	outbuf_printf(out, "# HELP nfs_mountpoint_check_timeouts_total Checks which timed out (or were skipped because the path is still hung).\n");
+	outbuf_printf(out, "# TYPE nfs_mountpoint_check_timeouts_total counter\n");
+	for (i = 0; i < nchecks; i++) {
+		metrics_line(out, "nfs_mountpoint_check_timeouts_total", checks[i], NULL,
+			     "%llu", (unsigned long long)checks[i]->stats.timeouts);
+	}
+
+	outbuf_printf(out, "# HELP nfs_mountpoint_check_skipped_total Checks skipped because the path is still hung.\n");
+	outbuf_printf(out, "# TYPE nfs_mountpoint_check_skipped_total counter\n");
+	for (i = 0; i < nchecks; i++) {
+		metrics_line(out, "nfs_mountpoint_check_skipped_total", checks[i], NULL,
+			     "%llu", (unsigned long long)checks[i]->stats.skipped);
+	}
+
+	outbuf_printf(out, "# HELP nfs_mountpoint_check_status_total Checks completed, by status code.\n");
+	outbuf_printf(out, "# TYPE nfs_mountpoint_check_status_total counter\n");
+	for (i = 0; i < nchecks; i++) {
+		for (j = 0; j < ERRNO_MAX; j++) {
+			const char *name = status_name(j);
+			char labels[64];
+
+			if (checks[i]->stats.status[j] == 0) {
+				continue;
+			}
+
+			snprintf(labels, sizeof(labels), "status=\"%u\",errno=\"%s\"", j,
+				 j == 0 ? "" : (name != NULL ? name : "?"));
+			metrics_line(out, "nfs_mountpoint_check_status_total", checks[i], labels,
+				     "%llu", (unsigned long long)checks[i]->stats.status[j]);
+		}
+	}
+
+	outbuf_printf(out, "# HELP nfs_mountpoint_check_status Status code of the most recent check.\n");
+	outbuf_printf(out, "# TYPE nfs_mountpoint_check_status gauge\n");
+	for (i = 0; i < nchecks; i++) {
+		if (checks[i]->stats.checks > 0) {
+			metrics_line(out, "nfs_mountpoint_check_status", checks[i], NULL, "%d", checks[i]->ret);
+		}
+	}
+
+	outbuf_printf(out, "# HELP nfs_mountpoint_check_hung Check processes still stuck on the path.\n");
+	outbuf_printf(out, "# TYPE nfs_mountpoint_check_hung gauge\n");
+	for (i = 0; i < nchecks; i++) {
+		metrics_line(out, "nfs_mountpoint_check_hung", checks[i], NULL, "%d", checks[i]->nhung);
+	}
+}
+
+/* Build the response to a complete HTTP request */
+static void metrics_request(struct conn *conn)
+{
+	struct outbuf body = { .growable = 1, };
+	const char *status = "200 OK";
+	char method[8];
+	char target[256];
+
+	if (sscanf(conn->req, "%7s %255s", method, target) != 2 || strcmp(method, "GET") != 0) {
+		status = "405 Method Not Allowed";
+	} else if (strcmp(target, "/metrics") != 0 && strcmp(target, "/") != 0) {
+		status = "404 Not Found";
+	} else {
+		format_metrics(&body);
+	}
+
+	outbuf_printf(&conn->resp, "HTTP/1.0 %s\r\n"
+		      "Content-Type: text/plain; version=0.0.4\r\n"
+		      "Content-Length: %zu\r\n"
+		      "Connection: close\r\n\r\n", status, body.len);
+	if (body.len > 0 && outbuf_grow(&conn->resp, body.len) == 0) {
+		memcpy(conn->resp.buf + conn->resp.len, body.buf, body.len);
+		conn->resp.len += body.len;
+	}
+
+	free(body.buf);
+	conn_send(conn);
+}
+
+static struct listener metrics_listener = {
+	.w = { .fd = -1, },
+	.terminator = "\r\n\r\n",
+	.request = metrics_request,
+};
+
+/*
+ * Start the metrics server, listening on "[host:]port". Returns 0 on
+ * success, or an errno value on failure.
+ */
+static int metrics_init(const char *addr)
+{
+	struct addrinfo hints;
+	struct addrinfo *res;
+	const char *port;
+	char host[256];
+	const int one = 1;
+	int ret;
+	int fd;
+
+	port = strrchr(addr, ':');
+	if (port == NULL) {
+		host[0] = '\0';
+		port = addr;
+	} else {
+		snprintf(host, sizeof(host), "%.*s", (int)(port - addr), addr);
+		port++;
+	}
+
+	/* allow "[::1]:9101" */
+	if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+		memmove(host, host + 1, strlen(host));
+		host[strlen(host) - 1] = '\0';
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	ret = getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints, &res);
+	if (ret) {
+		error("Unable to resolve listen address '%s': %s\n", addr, gai_strerror(ret));
+		return EINVAL;
+	}
+
+	fd = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		const int errsave = errno;
+		error("Unable to create socket: %s\n", strerror(errsave));
+		freeaddrinfo(res);
+		return errsave;
+	}
+
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(fd, res->ai_addr, res->ai_addrlen) < 0) {
+		const int errsave = errno;
+		error("Unable to bind to '%s': %s\n", addr, strerror(errsave));
+		freeaddrinfo(res);
+		close(fd);
+		return errsave;
+	}
+
+	freeaddrinfo(res);
+	return listener_init(&metrics_listener, fd);
+}
+
+/*
+ * Status socket (daemon mode): a Unix domain socket which serves the most
+ * recent result of every path, along with its age, so that local agents do
+ * not need to check the mounts (and load the servers) themselves.
+ *
+ * Each request is a single line containing the path to query, optionally
+ * followed by " max-age=<duration>". When the most recent result is older
+ * than the maximum age (or there is no result yet), a fresh check is
+ * started, and the response is sent once it completes. Concurrent requests
+ * for the same path all share the same check. An empty path ("" or "*")
+ * returns the most recent result of every path, without checking anything.
+ *
+ * Each response is one JSON record per line (see --format=json), with an
+ * additional "age_ms" field.
+ */
+static const char *socket_path = NULL;
+
+/* Append the most recent result of a check to a response */
+static void status_format(struct conn *conn, const struct check *check)
+{
+	format_check_json(&conn->resp, check, (int64_t)(nfscheck_now() - check->completed));
+}
+
+/* Append an error response */
+static void status_error(struct conn *conn, const char *path, const char *msg)
+{
+	outbuf_printf(&conn->resp, "{\"path\":");
+	outbuf_json_string(&conn->resp, path);
+	outbuf_printf(&conn->resp, ",\"error\":");
+	outbuf_json_string(&conn->resp, msg);
+	outbuf_printf(&conn->resp, "}\n");
+}
+
+/* Answer every request which was waiting for this check to complete */
+static void status_notify(struct check *check)
+{
+	int i;
+
+	for (i = 0; i < MAX_CONNECTIONS; i++) {
+		struct conn *conn = conns[i];
+
+		if (conn == NULL || conn->waiting != check) {
+			continue;
+		}
+
+		conn->waiting = NULL;
+		if (check->removed) {
+			status_error(conn, check->path, "mount disappeared");
+		} else {
+			status_format(conn, check);
+		}
+
+		conn_send(conn);
+	}
+}
+
+/* Handle a complete status request */
+static void status_request(struct conn *conn)
+{
+	const uint64_t now = nfscheck_now();
+	char *path = conn->req;
+	uint64_t max_age = UINT64_MAX;
+	struct check *check;
+	char *opt;
+	int ms;
+	int i;
+
+	path[strcspn(path, "\r\n")] = '\0';
+
+	opt = strstr(path, " max-age=");
+	if (opt != NULL) {
+		*opt = '\0';
+		if (nfscheck_parse_duration(opt + strlen(" max-age="), &ms) != 0) {
+			status_error(conn, path, "invalid max-age");
+			conn_send(conn);
+			return;
+		}
+
+		max_age = (uint64_t)ms * NSEC_PER_MSEC;
+	}
+
+	/* every path: cached results only */
+	if (path[0] == '\0' || strcmp(path, "*") == 0) {
+		for (i = 0; i < nchecks; i++) {
+			if (!checks[i]->removed && checks[i]->stats.checks > 0) {
+				status_format(conn, checks[i]);
+			}
+		}
+
+		conn_send(conn);
+		return;
+	}
+
+	check = find_check(path);
+	if (check == NULL || check->removed) {
+		status_error(conn, path, "unknown path");
+		conn_send(conn);
+		return;
+	}
+
+	/* a recent enough result: answer straight away */
+	if (check->stats.checks > 0 && now - check->completed <= max_age) {
+		status_format(conn, check);
+		conn_send(conn);
+		return;
+	}
+
+	/*
+	 * Wait for a fresh result. If the path is being checked right now,
+	 * share that check, otherwise start one. Note that the check may
+	 * complete (and answer this request) before start_check() returns.
+	 */
+	conn->waiting = check;
+	if (!check->inflight) {
+		const uint64_t deadline = check_deadline(check, now);
+
+		debug("Starting check of %s for a status request\n", check->path);
+		if (start_check(check, deadline)) {
+			conn->waiting = NULL;
+			status_error(conn, path, "unable to start check");
+			conn_send(conn);
+		}
+	}
+}
+
+static struct listener status_listener = {
+	.w = { .fd = -1, },
+	.terminator = "\n",
+	.request = status_request,
+};
+
+/* Start the status server. Returns 0 on success, or an errno value. */
+static int status_init(const char *path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	int fd;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		error("Socket path too long: %s\n", path);
+		return ENAMETOOLONG;
+	}
+
+	strcpy(addr.sun_path, path);
+
+	/* remove a stale socket left behind by a previous instance */
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		unlink(path);
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		const int errsave = errno;
+		error("Unable to create socket: %s\n", strerror(errsave));
+		return errsave;
+	}
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		const int errsave = errno;
+		error("Unable to bind to '%s': %s\n", path, strerror(errsave));
+		close(fd);
+		return errsave;
+	}
+
+	return listener_init(&status_listener, fd);
+}
+
+/*
+ * Result board (daemon mode, --board): the most recent state of every path,
+ * published into a small shared memory file (typically under /dev/shm), for
+ * local agents which poll the state of the mounts many times per second.
+ * Once the board is mapped, a reader gets the state of a path with a few
+ * loads: no system call, no round trip through the status socket, and no
+ * way of ever waiting on us.
+ *
+ * The layout is fixed: a header, followed by BOARD_ENTRIES entries of 256
+ * bytes, aligned on cache lines. The fields of an entry fit in its first
+ * cache line, followed by its path (an entry without a path is free). Every
+ * entry is published with a sequence lock of its own, as in single-flight
+ * mode: a reader copies the entry, and retries if the sequence number was
+ * odd, or changed in the meantime. An entry is updated whenever a check of
+ * its path completes, and whenever a check process stuck on it goes away.
+ *
+ * The file is locked by the daemon which publishes it, whose pid is in the
+ * header (0 once it exited). Everything is in native byte order.
+ */
+#define BOARD_MAGIC 0x6e6d6362U
+#define BOARD_VERSION 1
+#define BOARD_ENTRIES 1024
+#define BOARD_PATH_MAX 192
+
+/* Flags of a board entry */
+#define BOARD_TIMED_OUT	0x1
+#define BOARD_SKIPPED	0x2
+
+struct board_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t entry_size;
+	uint32_t nentries;
+	int32_t pid;
+	uint32_t reserved;
+	int64_t started_ns;
+} __attribute__((aligned(64)));
+
+struct board_entry {
+	uint32_t seq;
+	int32_t status;
+	int32_t hung;
+	uint32_t flags;
+	uint64_t latency_ns;
+	int64_t updated_ns;
+	int64_t last_success_ns;
+	uint64_t rounds;
+	char reserved[16];
+	char path[BOARD_PATH_MAX];
+} __attribute__((aligned(64)));
+
+_Static_assert(sizeof(struct board_header) == 64, "board header layout");
+_Static_assert(sizeof(struct board_entry) == 256, "board entry layout");
+
+#define BOARD_SIZE (sizeof(struct board_header) + BOARD_ENTRIES * sizeof(struct board_entry))
+
+static const char *board_path = NULL;
+static const char *read_board_path = NULL;
+static struct board_header *board = NULL;
+static int board_fd = -1;
+
+static struct board_entry *board_entries(const struct board_header *header)
+{
+	return (struct board_entry *)(header + 1);
+}
+
+/* Wall clock time, in nanoseconds since the epoch */
+static int64_t board_timestamp(const struct timespec *ts)
+{
+	return (int64_t)ts->tv_sec * (int64_t)NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static void board_write_begin(struct board_entry *entry)
+{
+	const uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&entry->seq, seq | 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void board_write_end(struct board_entry *entry)
+{
+	const uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&entry->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Free an entry of the board */
+static void board_clear(struct board_entry *entry)
+{
+	board_write_begin(entry);
+	memset((char *)entry + sizeof(entry->seq), 0, sizeof(*entry) - sizeof(entry->seq));
+	board_write_end(entry);
+}
+
+/* Publish the state of a check on the board, if it has an entry there */
+static void board_update(struct check *check)
+{
+	struct board_entry *entry;
+
+	if (board == NULL || check->board_slot < 0) {
+		return;
+	}
+
+	entry = &board_entries(board)[check->board_slot];
+	board_write_begin(entry);
+	entry->hung = check->nhung;
+	if (check->rounds > 0) {
+		entry->status = check->ret;
+		entry->flags = (check->timed_out ? BOARD_TIMED_OUT : 0) |
+			       (check->skipped ? BOARD_SKIPPED : 0);
+		entry->latency_ns = nfscheck_result_latency(&check->result);
+		entry->updated_ns = board_timestamp(&check->completed_wall);
+		entry->rounds = check->rounds;
+		if (check->result.error == 0 && !check->timed_out && !check->skipped) {
+			entry->last_success_ns = entry->updated_ns;
+		}
+	}
+
+	board_write_end(entry);
+}
+
+/* Give a check an entry on the board */
+static void board_attach(struct check *check)
+{
+	struct board_entry *entries;
+	int i;
+
+	if (board == NULL) {
+		return;
+	}
+
+	if (strlen(check->path) >= BOARD_PATH_MAX) {
+		error("Path too long for the result board, not published: %s\n", check->path);
+		return;
+	}
+
+	entries = board_entries(board);
+	for (i = 0; i < BOARD_ENTRIES; i++) {
+		if (entries[i].path[0] == '\0') {
+			break;
+		}
+	}
+
+	if (i == BOARD_ENTRIES) {
+		error("The result board is full, %s is not published\n", check->path);
+		return;
+	}
+
+	board_write_begin(&entries[i]);
+	strcpy(entries[i].path, check->path);
+	board_write_end(&entries[i]);
+
+	check->board_slot = i;
+	board_update(check);
+}
+
+/* Free the entry of a check which is going away */
+static void board_release(struct check *check)
+{
+	if (board == NULL || check->board_slot < 0) {
+		return;
+	}
+
+	board_clear(&board_entries(board)[check->board_slot]);
+	check->board_slot = -1;
+}
+
+/*
+ * Create (or take over) the result board. Returns 0 on success, or an errno
+ * value on failure.
+ */
+static int board_init(const char *path)
+{
+	struct board_entry *entries;
+	struct timespec now;
+	struct flock fl;
+	void *map;
+	int fd;
+	int i;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0644);
+	if (fd < 0) {
+		const int errsave = errno;
+		error("Unable to open result board %s: %s\n", path, strerror(errsave));
+		return errsave;
+	}
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+
+	if (fcntl(fd, F_SETLK, &fl) < 0) {
+		const int errsave = errno;
+		error("Unable to lock result board %s (is another daemon publishing it?): %s\n",
+		      path, strerror(errsave));
+		close(fd);
+		return errsave;
+	}
+
+	/* the file never shrinks, so a reader never faults on its mapping */
+	if (ftruncate(fd, BOARD_SIZE) < 0) {
+		const int errsave = errno;
+		error("Unable to resize result board %s: %s\n", path, strerror(errsave));
+		close(fd);
+		return errsave;
+	}
+
+	map = mmap(NULL, BOARD_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		const int errsave = errno;
+		error("Unable to map result board %s: %s\n", path, strerror(errsave));
+		close(fd);
+		return errsave;
+	}
+
+	/* whatever a previous daemon left behind is gone */
+	board = map;
+	entries = board_entries(board);
+	for (i = 0; i < BOARD_ENTRIES; i++) {
+		board_clear(&entries[i]);
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	board->magic = BOARD_MAGIC;
+	board->version = BOARD_VERSION;
+	board->entry_size = sizeof(struct board_entry);
+	board->nentries = BOARD_ENTRIES;
+	board->started_ns = board_timestamp(&now);
+	__atomic_store_n(&board->pid, (int32_t)getpid(), __ATOMIC_RELEASE);
+
+	board_fd = fd;
+	return 0;
+}
+
+/* Mark the result board as no longer published, and close it */
+static void board_close(void)
+{
+	if (board == NULL) {
+		return;
+	}
+
+	__atomic_store_n(&board->pid, 0, __ATOMIC_RELEASE);
+	munmap(board, BOARD_SIZE);
+	board = NULL;
+	close(board_fd);
+	board_fd = -1;
+}
+
+/*
+ * Take a consistent snapshot of an entry of the board. Returns 1 if the
+ * entry is in use, or 0 otherwise.
+ */
+static int board_snapshot(const struct board_entry *entry, struct board_entry *snap)
+{
+	uint32_t seq;
+	int tries;
+
+	for (tries = 0; tries < 100; tries++) {
+		seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			/* the entry is being published right now */
+			continue;
+		}
+
+		memcpy(snap, entry, sizeof(*snap));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) == seq) {
+			snap->path[BOARD_PATH_MAX - 1] = '\0';
+			if (snap->status < 0 || snap->status >= ERRNO_MAX) {
+				snap->status = EUNKNOWN;
+			}
+
+			return snap->path[0] != '\0';
+		}
+	}
+
+	return 0;
+}
+
+static void board_print_text(const struct board_entry *entry, const int64_t now_ns)
+{
+	if (entry->updated_ns == 0) {
+		printf("%s: not checked yet, %d hung\n", entry->path, entry->hung);
+		return;
+	}
+
+	printf("%s: status %d (%s)%s%s, %d hung, latency %.3f ms, %.3f s ago\n",
+	       entry->path, entry->status, entry->status ? strerror(entry->status) : "ok",
+	       entry->flags & BOARD_TIMED_OUT ? ", timed out" : "",
+	       entry->flags & BOARD_SKIPPED ? ", skipped" : "",
+	       entry->hung, (double)entry->latency_ns / NSEC_PER_MSEC,
+	       (double)(now_ns - entry->updated_ns) / NSEC_PER_SEC);
+}
+
+static void board_print_json(const struct board_entry *entry, const int64_t now_ns)
+{
+	const char *name = status_name(entry->status);
+	char buf[1024];
+	struct outbuf out = { .buf = buf, .size = sizeof(buf), };
+
+	outbuf_printf(&out, "{\"path\":");
+	outbuf_json_string(&out, entry->path);
+	if (entry->updated_ns == 0) {
+		outbuf_printf(&out, ",\"status\":null");
+	} else {
+		outbuf_printf(&out, ",\"time\":%lld.%03lld,\"status\":%d,\"errno\":",
+			      (long long)(entry->updated_ns / NSEC_PER_SEC),
+			      (long long)(entry->updated_ns % NSEC_PER_SEC / NSEC_PER_MSEC), entry->status);
+		if (entry->status != 0 && name != NULL) {
+			outbuf_json_string(&out, name);
+		} else {
+			outbuf_printf(&out, "null");
+		}
+
+		outbuf_printf(&out, ",\"timed_out\":%s,\"skipped\":%s,\"age_ms\":%.3f,\"latency_ms\":%.3f",
+			      entry->flags & BOARD_TIMED_OUT ? "true" : "false",
+			      entry->flags & BOARD_SKIPPED ? "true" : "false",
+			      (double)(now_ns - entry->updated_ns) / NSEC_PER_MSEC,
+			      (double)entry->latency_ns / NSEC_PER_MSEC);
+	}
+
+	if (entry->last_success_ns != 0) {
+		outbuf_printf(&out, ",\"last_success\":%lld.%03lld",
+			      (long long)(entry->last_success_ns / NSEC_PER_SEC),
+			      (long long)(entry->last_success_ns % NSEC_PER_SEC / NSEC_PER_MSEC));
+	} else {
+		outbuf_printf(&out, ",\"last_success\":null");
+	}
+
+	outbuf_printf(&out, ",\"hung\":%d,\"rounds\":%llu}\n",
+		      entry->hung, (unsigned long long)entry->rounds);
+	if (out.truncated) {
+		debug("JSON record for %s truncated, not printed\n", entry->path);
+		return;
+	}
+
+	fflush(stdout);
+	outbuf_write(&out, STDOUT_FILENO);
+}
+
+static void board_print_entry(const struct board_entry *entry, const int64_t now_ns)
+{
+	if (output_format == FORMAT_JSON) {
+		board_print_json(entry, now_ns);
+	} else {
+		board_print_text(entry, now_ns);
+	}
+}
+
+/*
+ * Dump the result board published by a daemon (--read-board), without
+ * checking anything: every path on it, or only the given ones. Returns the
+ * exit status: that of the first given path which is not working, as if it
+ * had been checked, or EUNKNOWN if the daemon is not running.
+ */
+static int read_board(const char *path, char *paths[], const int npaths)
+{
+	const struct board_header *header;
+	const struct board_entry *entries;
+	struct board_entry snap;
+	struct timespec now;
+	struct stat st;
+	int exitcode = 0;
+	int32_t pid;
+	int found;
+	void *map;
+	int fd;
+	int i;
+	int j;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		const int errsave = errno;
+		error("Unable to open result board %s: %s\n", path, strerror(errsave));
+		return errsave;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t)BOARD_SIZE) {
+		error("Not a result board: %s\n", path);
+		close(fd);
+		return EINVAL;
+	}
+
+	map = mmap(NULL, BOARD_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		const int errsave = errno;
+		error("Unable to map result board %s: %s\n", path, strerror(errsave));
+		return errsave;
+	}
+
+	header = map;
+	if (header->magic != BOARD_MAGIC || header->version != BOARD_VERSION ||
+	    header->entry_size != sizeof(struct board_entry) || header->nentries != BOARD_ENTRIES) {
+		error("Not a result board (or from another version): %s\n", path);
+		munmap(map, BOARD_SIZE);
+		return EINVAL;
+	}
+
+	pid = __atomic_load_n(&header->pid, __ATOMIC_ACQUIRE);
+	if (pid == 0 || (kill(pid, 0) < 0 && errno == ESRCH)) {
+		error("The daemon publishing %s is not running, its results are stale\n", path);
+		exitcode = EUNKNOWN;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	entries = board_entries(header);
+	for (i = 0; i < BOARD_ENTRIES && npaths == 0; i++) {
+		if (board_snapshot(&entries[i], &snap)) {
+			board_print_entry(&snap, board_timestamp(&now));
+		}
+	}
+
+	for (j = 0; j < npaths; j++) {
+		found = 0;
+		for (i = 0; i < BOARD_ENTRIES && !found; i++) {
+			found = board_snapshot(&entries[i], &snap) && strcmp(snap.path, paths[j]) == 0;
+		}
+
+		if (!found) {
+			error("%s is not on the result board\n", paths[j]);
+			if (exitcode == 0) {
+				exitcode = ENOENT;
+			}
+			continue;
+		}
+
+		board_print_entry(&snap, board_timestamp(&now));
+		if (exitcode == 0) {
+			exitcode = snap.updated_ns == 0 ? EUNKNOWN : exitcode_map[snap.status];
+		}
+	}
+
+	munmap(map, BOARD_SIZE);
+	return exitcode;
+}
+
+/*
+ * Daemon mode: stay resident and check every path periodically.
+ *
+ * Each path is checked on its own schedule: the next check is due one
+ * interval (plus or minus 10% of random jitter, so that the checks of many
+ * nodes do not synchronize) after the previous one started. Every check
+ * still runs within its own child process, so a check process which hangs
+ * inside the NFS client can never block the scheduler, or the checks of any
+ * other path.
+ */
+static struct watcher schedule_timer = { .fd = -1, };
+static struct watcher shutdown_signal = { .fd = -1, };
+static int daemon_running = 1;
+
+/* Return the interval, plus or minus 10% of random jitter */
+static uint64_t jittered_interval_ns(const int interval_ms)
+{
+	const uint64_t interval = (uint64_t)interval_ms * NSEC_PER_MSEC;
+	const uint64_t jitter = interval / 10;
+
+	if (jitter == 0) {
+		return interval;
+	}
+
+	return interval - jitter + (uint64_t)random() % (2 * jitter);
+}
+
+/* Arm the schedule timer for the earliest check which is due */
+static void schedule_arm_timer(void)
+{
+	uint64_t next_due = 0;
+	int i;
+
+	for (i = 0; i < nchecks; i++) {
+		/* checks in flight are rescheduled when they complete */
+		if (checks[i]->inflight || checks[i]->removed) {
+			continue;
+		}
+
+		if (next_due == 0 || checks[i]->next_due < next_due) {
+			next_due = checks[i]->next_due;
+		}
+	}
+
+	arm_timerfd(schedule_timer.fd, next_due);
+}
+
+/* Completion callback for checks in daemon mode */
+static void daemon_check_complete(struct check *check)
+{
+	const int prev = check->rounds > 0 ? exitcode_map[check->prev] : 0;
+	const int ret = exitcode_map[check->ret];
+	const uint64_t now = nfscheck_now();
+
+	uint64_t interval;
+
+	/* answer the status requests which were waiting for this check */
+	status_notify(check);
+
+	/* the mount of this check disappeared while it was in flight */
+	if (check->removed) {
+		sweep_checks();
+		return;
+	}
+
+	check->rounds++;
+	board_update(check);
+	if (output_format == FORMAT_JSON) {
+		print_check_json(check);
+	} else if (check->fanned && check->twin != NULL && check->verdict_from == check->twin) {
+		verbose("Check of %s skipped: same filesystem as %s, status code %d\n",
+			check->path, check->twin->path, check->ret);
+	} else if (check->fanned) {
+		verbose("Check of %s skipped: its server %s is down\n", check->path, check->group->server);
+	} else if (check->skipped) {
+		verbose("Check of %s skipped: still hung, %d check processes outstanding\n",
+			check->path, check->nhung);
+	} else {
+		verbose("Check of %s completed with status code %d after %.3f ms\n",
+			check->path, check->ret, (double)check->elapsed / NSEC_PER_MSEC);
+		print_check_phases(check);
+	}
+
+	if (output_format == FORMAT_TEXT && (ret != prev || (check->rounds == 1 && ret != 0))) {
+		error("Status of %s changed from %d (%s) to %d (%s)\n",
+		      check->path, prev, strerror(prev), ret, strerror(ret));
+	}
+
+	check->prev = check->ret;
+
+	/*
+	 * Schedule the next check of this path. A hung mountpoint is probed
+	 * again with exponential backoff (doubling the interval each time,
+	 * up to --max-backoff), so that we do not keep piling check
+	 * processes onto a dead server. A check which was not probed,
+	 * because its server is down, costs nothing: it keeps its interval,
+	 * so that it is probed soon after the server comes back.
+	 */
+	interval = jittered_interval_ns(check->interval_ms);
+	if (check->ret == ETIMEDOUT && !check->fanned) {
+		uint64_t max = (uint64_t)max_backoff_ms * NSEC_PER_MSEC;
+
+		/* backing off never probes a hung path more often than a working one */
+		if (max < interval) {
+			max = interval;
+		}
+
+		if (check->backoff < 16) {
+			check->backoff++;
+		}
+
+		/* compared before shifting, which could overflow */
+		if (interval > (max >> check->backoff)) {
+			interval = max;
+		} else {
+			interval <<= check->backoff;
+		}
+
+		debug("Backing off %s for %.3f ms\n", check->path, (double)interval / NSEC_PER_MSEC);
+	} else {
+		check->backoff = 0;
+	}
+
+	check->next_due = check->started + interval;
+	if (check->next_due < now) {
+		check->next_due = now;
+	}
+
+	schedule_arm_timer();
+}
+
+/* Event handler: the schedule timer expired, so some checks are due */
+static void handle_schedule(struct watcher *w, const uint32_t events)
+{
+	const uint64_t now = nfscheck_now();
+	uint64_t expirations;
+	int i;
+
+	(void)events;
+
+	if (read(w->fd, &expirations, sizeof(expirations)) < 0) {
+		/* spurious wakeup */
+		return;
+	}
+
+	for (i = 0; i < nchecks; i++) {
+		struct check *check = checks[i];
+
+		if (check->inflight || check->removed || check->next_due > now) {
+			continue;
+		}
+
+		debug("Starting check of %s (round %lu)\n", check->path, check->rounds + 1);
+		if (start_check(check, check_deadline(check, now))) {
+			/* try again next interval */
+			check->next_due = now + jittered_interval_ns(check->interval_ms);
+		}
+	}
+
+	schedule_arm_timer();
+}
+
+/* Event handler: SIGTERM or SIGINT, so shut down cleanly */
+static void handle_shutdown(struct watcher *w, const uint32_t events)
+{
+	struct signalfd_siginfo info;
+
+	(void)events;
+
+	if (read(w->fd, &info, sizeof(info)) == sizeof(info)) {
+		verbose("Received signal %u, shutting down\n", info.ssi_signo);
+		daemon_running = 0;
+	}
+}
+
+/*
+ * Start checking a path periodically. The first check is spread over the
+ * jitter window, so that the checks of many paths (and nodes) do not
+ * synchronize. Does nothing unless the daemon is running.
+ */
+static void daemon_add_check(struct check *check)
+{
+	if (schedule_timer.fd < 0) {
+		return;
+	}
+
+	check->complete = daemon_check_complete;
+	board_attach(check);
+	check->next_due = nfscheck_now();
+	if (check->interval_ms >= 10) {
+		check->next_due += (uint64_t)random() %
+			((uint64_t)check->interval_ms * NSEC_PER_MSEC / 10);
+	}
+
+	schedule_arm_timer();
+}
+
+/* Run in daemon mode until SIGTERM or SIGINT. Returns the exit status. */
+static int run_daemon(void)
+{
+	const uint64_t now = nfscheck_now();
+	sigset_t mask;
+	int ret;
+	int i;
+
+	srandom((unsigned int)(now ^ getpid()));
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+
+	if (sigprocmask(SIG_BLOCK, &mask, NULL) < 0) {
+		const int errsave = errno;
+		error("Unable to block signals: %s\n", strerror(errsave));
+		return errsave;
+	}
+
+	shutdown_signal.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (shutdown_signal.fd < 0) {
+		const int errsave = errno;
+		error("Unable to create signalfd: %s\n", strerror(errsave));
+		return errsave;
+	}
+
+	shutdown_signal.handler = handle_shutdown;
+	ret = supervisor_watch(&shutdown_signal, EPOLLIN);
+	if (ret) {
+		return ret;
+	}
+
+	schedule_timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (schedule_timer.fd < 0) {
+		const int errsave = errno;
+		error("Unable to create timerfd: %s\n", strerror(errsave));
+		return errsave;
+	}
+
+	schedule_timer.handler = handle_schedule;
+	ret = supervisor_watch(&schedule_timer, EPOLLIN);
+	if (ret) {
+		return ret;
+	}
+
+	if (board_path != NULL) {
+		ret = board_init(board_path);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	for (i = 0; i < nchecks; i++) {
+		daemon_add_check(checks[i]);
+	}
+
+	if (listen_addr != NULL) {
+		ret = metrics_init(listen_addr);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	if (socket_path != NULL) {
+		ret = status_init(socket_path);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	/* watch for mounts appearing and disappearing */
+	if (mountinfo_watch.fd >= 0) {
+		ret = supervisor_watch(&mountinfo_watch, EPOLLPRI);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	while (daemon_running) {
+		supervisor_dispatch(-1);
+	}
+
+	supervisor_kill_all();
+	if (socket_path != NULL) {
+		unlink(socket_path);
+	}
+
+	board_close();
+
+	return 0;
+}
+
+/*
+ * Benchmark mode (--bench): every method of the plan is performed on its own
+ * (without escalation), the given number of times per path, one check at a
+ * time, through the selected engine. The elapsed time of a check includes
+ * the overhead of the supervisor (creating the check process, or waking a
+ * worker), while its latency is the time taken by the method itself.
+ *
+ * Syscalls are counted with the raw_syscalls:sys_enter tracepoint, which
+ * requires tracefs. The counter is inherited by the check processes, but
+ * the counts of a child are only added to ours when it exits: with the pool
+ * and threads engines, whose workers outlive the checks (and predate the
+ * counter), only the syscalls of the supervisor itself are counted.
+ */
+static int bench_runs = 0;
+
+struct bench_stats {
+	int runs;
+	int failed;
+	int skipped;
+	int first_error;
+	int performed;
+	uint64_t *elapsed;
+	uint64_t *latency;
+	int64_t syscalls;
+};
+
+static const char *const engine_names[] = { "fork", "pool", "uring", "threads", "spawn", };
+
+/* Open a counter of the syscalls of this process, and of its future children. Returns -1 if unavailable. */
+static int bench_counter_open(void)
+{
+	static const char *const paths[] = {
+		"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+		"/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id",
+	};
+	struct perf_event_attr attr;
+	unsigned long long id;
+	size_t i;
+	int fd;
+
+	for (i = 0; i < sizeof(paths) / sizeof(paths[0]); i++) {
+		FILE *f = fopen(paths[i], "re");
+		int n;
+
+		if (f == NULL) {
+			continue;
+		}
+
+		n = fscanf(f, "%llu", &id);
+		fclose(f);
+		if (n == 1) {
+			break;
+		}
+	}
+
+	if (i == sizeof(paths) / sizeof(paths[0])) {
+		verbose("The syscall tracepoint is not available (is tracefs mounted?), not counting syscalls\n");
+		return -1;
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_TRACEPOINT;
+	attr.size = sizeof(attr);
+	attr.config = id;
+	attr.inherit = 1;
+
+	fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+	if (fd < 0) {
+		verbose("Unable to count syscalls: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return fd;
+}
+
+static uint64_t bench_counter_read(const int fd)
+{
+	uint64_t count = 0;
+
+	if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+		return 0;
+	}
+
+	return count;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *)a;
+	const uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* The p-th percentile (nearest rank) of sorted samples */
+static double bench_percentile_ms(const uint64_t *sorted, const int n, const int p)
+{
+	const int rank = (p * n + 99) / 100;
+
+	return (double)sorted[rank > 0 ? rank - 1 : 0] / NSEC_PER_MSEC;
+}
+
+/* Perform a single method on a path, bench_runs times */
+static int bench_method(struct check *check, const int method, const int counter, struct bench_stats *stats)
+{
+	uint64_t before = 0;
+	int i;
+
+	memset(&check->plan, 0, sizeof(check->plan));
+	check->plan.nsteps = 1;
+	check->plan.steps[0].method = method;
+	check->check_method = method;
+
+	stats->runs = bench_runs;
+	stats->failed = 0;
+	stats->skipped = 0;
+	stats->first_error = 0;
+	stats->performed = 0;
+	stats->syscalls = -1;
+
+	if (counter >= 0) {
+		before = bench_counter_read(counter);
+	}
+
+	for (i = 0; i < bench_runs; i++) {
+		const int ret = start_check(check, check_deadline(check, nfscheck_now()));
+
+		if (ret) {
+			return ret;
+		}
+
+		while (ninflight > 0) {
+			supervisor_dispatch(-1);
+		}
+
+		if (check->ret && stats->first_error == 0) {
+			stats->first_error = check->ret;
+		}
+
+		/* the path is still hung, so nothing was measured */
+		if (check->skipped) {
+			stats->skipped++;
+			continue;
+		}
+
+		if (check->ret) {
+			stats->failed++;
+		}
+
+		stats->elapsed[stats->performed] = check->elapsed;
+		stats->latency[stats->performed] = nfscheck_result_latency(&check->result);
+		stats->performed++;
+	}
+
+	if (counter >= 0) {
+		stats->syscalls = (int64_t)(bench_counter_read(counter) - before);
+	}
+
+	qsort(stats->elapsed, stats->performed, sizeof(uint64_t), compare_u64);
+	qsort(stats->latency, stats->performed, sizeof(uint64_t), compare_u64);
+	return 0;
+}
+
+static void bench_format_percentiles(struct outbuf *out, const char *name, const uint64_t *sorted, const int n)
+{
+	if (n == 0) {
+		outbuf_printf(out, ",\"%s\":null", name);
+		return;
+	}
+
+	outbuf_printf(out, ",\"%s\":{\"min\":%.3f,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}", name,
+		      (double)sorted[0] / NSEC_PER_MSEC, bench_percentile_ms(sorted, n, 50),
+		      bench_percentile_ms(sorted, n, 90), bench_percentile_ms(sorted, n, 99),
+		      (double)sorted[n - 1] / NSEC_PER_MSEC);
+}
+
+static void bench_print_json(const struct check *check, const int method, const char *engine_name,
+			     const struct bench_stats *stats)
+{
+	char buf[4096];
+	struct outbuf out = { .buf = buf, .size = sizeof(buf), };
+
+	outbuf_printf(&out, "{\"path\":");
+	outbuf_json_string(&out, check->path);
+	outbuf_printf(&out, ",\"method\":");
+	outbuf_json_string(&out, nfscheck_method_name(method));
+	outbuf_printf(&out, ",\"engine\":\"%s\",\"runs\":%d,\"failed\":%d,\"skipped\":%d",
+		      engine_name, stats->runs, stats->failed, stats->skipped);
+	bench_format_percentiles(&out, "elapsed_ms", stats->elapsed, stats->performed);
+	bench_format_percentiles(&out, "latency_ms", stats->latency, stats->performed);
+	if (stats->syscalls >= 0) {
+		outbuf_printf(&out, ",\"syscalls\":%.1f", (double)stats->syscalls / stats->runs);
+	} else {
+		outbuf_printf(&out, ",\"syscalls\":null");
+	}
+
+	outbuf_printf(&out, "}\n");
+	if (out.truncated) {
+		debug("JSON record for %s truncated, not printed\n", check->path);
+		return;
 	}
 
-	/* Child was continued */
-	if (WIFCONTINUED(status)) {
-		debug("child was continued\n");
-		return EUNKNOWN;
+	fflush(stdout);
+	outbuf_write(&out, STDOUT_FILENO);
+}
+
+static void bench_print_percentiles(const char *name, const uint64_t *sorted, const int n)
+{
+	if (n == 0) {
+		return;
 	}
 
-	/* not sure how we'd possibly get here ... */
-	return EUNKNOWN;
+	printf("    %-10s min %.3f ms, p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n", name,
+	       (double)sorted[0] / NSEC_PER_MSEC, bench_percentile_ms(sorted, n, 50),
+	       bench_percentile_ms(sorted, n, 90), bench_percentile_ms(sorted, n, 99),
+	       (double)sorted[n - 1] / NSEC_PER_MSEC);
 }
 
-/*
- * Handler for SIGALRM signal.
- *
- * This is used to implement a hard timeout for the check process (child
- * process).
- *
- * Note that only signal-safe functions may be called here. Please see
- * "man 7 signal" for the list of functions you are allowed to call from
- * this context. (You cannot use printf, for example.)
- */
-static void handle_sigalrm(int signum)
+static void bench_print_text(const struct check *check, const int method, const char *engine_name,
+			     const struct bench_stats *stats)
 {
-	/* dummy assignment, to eliminate gcc warning */
-	signum = signum;
+	printf("Benchmark of %s with method %s (%s engine): %d runs, %d failed, %d skipped\n",
+	       check->path, nfscheck_method_name(method), engine_name,
+	       stats->runs, stats->failed, stats->skipped);
+	bench_print_percentiles("elapsed:", stats->elapsed, stats->performed);
+	bench_print_percentiles("latency:", stats->latency, stats->performed);
+	if (stats->syscalls >= 0) {
+		printf("    %-10s %.1f per check\n", "syscalls:", (double)stats->syscalls / stats->runs);
+	}
+}
 
-	/* no child process, nothing to kill */
-	if (child <= 0) {
-		return;
+/* Run the benchmark of every path. Returns the exit status. */
+static int run_bench(const struct nfscheck_plan *plan)
+{
+	struct bench_stats stats;
+	int exitcode = 0;
+	int counter;
+	int ret = 0;
+	int i;
+	int j;
+
+	memset(&stats, 0, sizeof(stats));
+	stats.elapsed = calloc(bench_runs, sizeof(uint64_t));
+	stats.latency = calloc(bench_runs, sizeof(uint64_t));
+	if (stats.elapsed == NULL || stats.latency == NULL) {
+		error("Unable to allocate memory\n");
+		free(stats.elapsed);
+		free(stats.latency);
+		return ENOMEM;
 	}
 
-	/*
-	 * Attempt to kill the child process. If that fails, exit using the
-	 * signal-safe variant of exit. There isn't anything else we can do.
-	 */
-	if (kill(child, SIGKILL) < 0) {
-		_exit(EUNKNOWN);
+	counter = bench_counter_open();
+
+	for (i = 0; i < nchecks && ret == 0; i++) {
+		for (j = 0; j < plan->nsteps; j++) {
+			const int method = plan->steps[j].method;
+			const char *engine_name;
+
+			verbose("Benchmarking path %s with method %s\n", checks[i]->path, nfscheck_method_name(method));
+			ret = bench_method(checks[i], method, counter, &stats);
+			if (ret) {
+				error("Unable to start check of %s: %s\n", checks[i]->path, strerror(ret));
+				break;
+			}
+
+			/* the io_uring engine falls back to the fork engine for some methods */
+			engine_name = engine_names[engine];
+			if (engine == ENGINE_URING && !uring_supported(&checks[i]->plan)) {
+				engine_name = engine_names[ENGINE_FORK];
+			}
+
+			if (output_format == FORMAT_JSON) {
+				bench_print_json(checks[i], method, engine_name, &stats);
+			} else {
+				bench_print_text(checks[i], method, engine_name, &stats);
+			}
+
+			if (exitcode == 0) {
+				exitcode = exitcode_map[stats.first_error];
+			}
+		}
+	}
+
+	if (counter >= 0) {
+		close(counter);
 	}
+
+	free(stats.elapsed);
+	free(stats.latency);
+	return ret ? ret : exitcode;
 }
 
+/* Long options without a short equivalent */
+enum {
+	OPT_INTERVAL = 256,
+	OPT_ENGINE,
+	OPT_WORKERS,
+	OPT_MAX_HUNG,
+	OPT_MAX_BACKOFF,
+	OPT_WARN_LATENCY,
+	OPT_CRIT_LATENCY,
+	OPT_FORMAT,
+	OPT_ALL_NFS,
+	OPT_FSTYPE,
+	OPT_INCLUDE,
+	OPT_EXCLUDE,
+	OPT_LISTEN,
+	OPT_SOCKET,
+	OPT_SHARE_DIR,
+	OPT_MAX_AGE,
+	OPT_SCRATCH_DIR,
+	OPT_ADAPTIVE,
+	OPT_MIN_TIMEOUT,
+	OPT_STATE_FILE,
+	OPT_GROUP_SERVERS,
+	OPT_BENCH,
+	OPT_FD_CACHE,
+	OPT_PARALLEL_METHODS,
+	OPT_MAX_RETRANS,
+	OPT_MAX_RTT,
+	OPT_BOARD,
+	OPT_READ_BOARD,
+};
+
 /* Help and usage information */
 static void usage(char *argv[])
 {
-	printf("Usage: %s [options] <path>\n", argv[0]);
+	printf("Usage: %s [options] <path> [<path> ...]\n", argv[0]);
 	printf("\n");
-	printf("Check an NFS mount to determine whether it is operating correctly.\n");
+	printf("Check NFS mounts to determine whether they are operating correctly.\n");
+	printf("All paths are checked in parallel, sharing a single timeout.\n");
 	printf("\n");
 	printf("Options:\n");
+	printf("-d, --daemon            stay resident, checking every path periodically\n");
+	printf("    --interval=x        daemon mode check interval (see --timeout, default=10)\n");
+	printf("    --engine=x          check engine (fork, spawn, pool, uring or threads, default=fork)\n");
+	printf("    --workers=x         number of pool workers or threads (default=8)\n");
+	printf("    --max-hung=x        maximum hung checks per path (default=1)\n");
+	printf("    --max-backoff=x     daemon mode maximum re-check interval of a hung path (default=300)\n");
+	printf("    --warn-latency=x    exit with status 253 if a check is slower (see --timeout)\n");
+	printf("    --crit-latency=x    exit with status 254 if a check is slower (see --timeout)\n");
+	printf("    --format=x          result output format (text or json, default=text)\n");
+	printf("    --all-nfs           check every NFS mount in /proc/self/mountinfo\n");
+	printf("    --fstype=x          filesystem types for --all-nfs (comma separated: default=nfs,nfs4)\n");
+	printf("    --include=x         only check mounts matching this pattern (may be repeated)\n");
+	printf("    --exclude=x         never check mounts matching this pattern (may be repeated)\n");
+	printf("    --listen=x          daemon mode metrics endpoint ([host:]port)\n");
+	printf("    --socket=x          daemon mode status socket (path)\n");
+	printf("    --share-dir=x       share results with concurrent invocations (directory)\n");
+	printf("    --max-age=x         maximum age of a shared result (see timeout)\n");
+	printf("    --scratch-dir=x     write method scratch directory (relative to the path, default=.)\n");
+	printf("    --adaptive=x        adaptive timeouts: x times the usual latency of each path\n");
+	printf("    --min-timeout=x     minimum adaptive timeout (see --timeout, default=0.05)\n");
+	printf("    --state-file=x      keep the latency history of --adaptive in this file\n");
+	printf("    --group-servers     probe one mount per NFS server first (with --all-nfs)\n");
+	printf("    --bench=x           benchmark mode: perform each method x times per path\n");
+	printf("    --fd-cache          keep a descriptor open per path between checks (pool or threads)\n");
+	printf("    --parallel-methods  perform the check methods at the same time, until one fails\n");
+	printf("    --max-retrans=x     mountstats method: maximum percentage of retransmissions (default=5)\n");
+	printf("    --max-rtt=x         mountstats method: maximum average RTT (see --timeout, default=1)\n");
+	printf("    --board=x           daemon mode shared memory result board (path, such as in /dev/shm)\n");
+	printf("    --read-board=x      print the result board of a daemon, without checking anything\n");
 	printf("-h, --help              display this help information\n");
 	printf("-i, --ignore-errno=x    ignore specific errno value\n");
-	printf("-m, --method=x          check method (comma separated: default=stat,readdir)\n");
-	printf("-t, --timeout=x         check timeout (seconds, default=2)\n");
+	printf("-m, --method=x          check methods, in order (comma separated: default=stat,readdir)\n");
+	printf("                        available: mountstats, rpc-null, stat, statx, readdir, readdir-raw, write\n");
+	printf("                        method@x: only if the previous methods took at least x\n");
+	printf("-t, --timeout=x         check timeout (seconds, or with a ms/s suffix, default=2)\n");
 	printf("-v, --verbose           increase verbosity (min=0, default=1, max=3)\n");
 	printf("-q, --quiet             decrease verbosity (see above)\n");
 	printf("\n");
 }
 
-/* Parse the user's specified check methods into a bitmask */
-static int parse_check_method(char *s)
+/*
+ * Parse the user's specified check plan: the check methods, in order, with
+ * their escalation thresholds. Exits if the plan is bogus.
+ */
+static void parse_check_plan(const char *s, struct nfscheck_plan *plan)
 {
-	int check_method = 0;
-	char *tok = NULL;
-
-	while ((tok = strtok(s, ",")) != NULL) {
-		/* strtok requires NULL for subsequent calls */
-		s = NULL;
-
-		/* figure out what the user asked for */
-		if (strcasecmp(tok, "stat") == 0) {
-			debug("check_method |= stat\n");
-			check_method |= CHECK_METHOD_STAT;
-		} else if (strcasecmp(tok, "readdir") == 0) {
-			debug("check_method |= readdir\n");
-			check_method |= CHECK_METHOD_READDIR;
-		} else {
-			error("Unknown check method '%s'\n", tok);
-			exit(EINVAL);
-		}
+	int i;
+
+	if (nfscheck_parse_plan(s, plan) != 0) {
+		error("Unable to parse check method '%s'\n", s);
+		exit(EINVAL);
+	}
+
+	for (i = 0; i < plan->nsteps; i++) {
+		debug("check step %d: %s, escalate after %d ms\n", i,
+		      nfscheck_method_name(plan->steps[i].method), plan->steps[i].escalate_ms);
+	}
+}
+
+/* Add a mountpoint pattern to a list of filters, exiting on failure */
+static void add_filter(char ***filters, int *nfilters, char *pattern)
+{
+	char **tmp = realloc(*filters, (*nfilters + 1) * sizeof(**filters));
+
+	if (tmp == NULL) {
+		error("Unable to allocate memory for filter '%s'\n", pattern);
+		exit(ENOMEM);
+	}
+
+	tmp[(*nfilters)++] = pattern;
+	*filters = tmp;
+}
+
+/* Parse the user's specified output format */
+static int parse_format(const char *s)
+{
+	if (strcasecmp(s, "text") == 0) {
+		return FORMAT_TEXT;
+	}
+
+	if (strcasecmp(s, "json") == 0) {
+		return FORMAT_JSON;
+	}
+
+	error("Unknown output format '%s'\n", s);
+	exit(EINVAL);
+}
+
+/* Parse the user's specified check engine */
+static int parse_engine(const char *s)
+{
+	if (strcasecmp(s, "fork") == 0) {
+		return ENGINE_FORK;
+	}
+
+	if (strcasecmp(s, "pool") == 0) {
+		return ENGINE_POOL;
 	}
 
-	return check_method;
+	if (strcasecmp(s, "uring") == 0) {
+		return ENGINE_URING;
+	}
+
+	if (strcasecmp(s, "threads") == 0) {
+		return ENGINE_THREADS;
+	}
+
+	if (strcasecmp(s, "spawn") == 0) {
+		return ENGINE_SPAWN;
+	}
+
+	error("Unknown check engine '%s'\n", s);
+	exit(EINVAL);
 }
 
 /*
@@ -390,16 +5438,44 @@ static int safe_atoi(const char *s)
 	exit(EINVAL);
 }
 
+/* Convert a string to a positive number, exiting if the value is bogus */
+static double safe_atof(const char *s)
+{
+	char *end = NULL;
+	double ret = 0;
+
+	errno = 0;
+	ret = strtod(s, &end);
+	if (s != end && *end == '\0' && errno != ERANGE && ret > 0) {
+		return ret;
+	}
+
+	error("Unable to parse number: %s\n", s);
+	exit(EINVAL);
+}
+
 int main(int argc, char *argv[])
 {
-	int exitcode_map[ERRNO_MAX];
-	struct sigaction action;
-	const char *path = NULL;
+	struct nfscheck_plan check_plan = { .nsteps = 0, };
+	const char *scratch_dir = NULL;
+	char plan_str[256];
+	uint64_t now = 0;
+	int interval_ms = 10000;
+	int daemon_mode = 0;
 	int check_method = 0;
-	int timeout = 2;
+	int exitcode = 0;
+	int timeout_ms = 2000;
+	int ret = 0;
 	int c = 0;
 	int i;
 
+	/* this is a check helper of the spawn engine */
+	if (argc > 1 && strcmp(argv[1], SPAWN_HELPER_ARG) == 0) {
+		return spawn_helper_main(argc, argv);
+	}
+
+	nfscheck_set_log(library_log);
+
 	/*
 	 * Initialize the mapping from child process return code to
 	 * process exit status. By default, this process exits with
@@ -416,6 +5492,35 @@ int main(int argc, char *argv[])
 	/* option parsing: see the GNU getopt manual */
 	while (1) {
 		static struct option long_options[] = {
+			{ "daemon", no_argument, NULL, 'd', },
+			{ "interval", required_argument, NULL, OPT_INTERVAL, },
+			{ "engine", required_argument, NULL, OPT_ENGINE, },
+			{ "workers", required_argument, NULL, OPT_WORKERS, },
+			{ "max-hung", required_argument, NULL, OPT_MAX_HUNG, },
+			{ "max-backoff", required_argument, NULL, OPT_MAX_BACKOFF, },
+			{ "warn-latency", required_argument, NULL, OPT_WARN_LATENCY, },
+			{ "crit-latency", required_argument, NULL, OPT_CRIT_LATENCY, },
+			{ "format", required_argument, NULL, OPT_FORMAT, },
+			{ "all-nfs", no_argument, NULL, OPT_ALL_NFS, },
+			{ "fstype", required_argument, NULL, OPT_FSTYPE, },
+			{ "include", required_argument, NULL, OPT_INCLUDE, },
+			{ "exclude", required_argument, NULL, OPT_EXCLUDE, },
+			{ "listen", required_argument, NULL, OPT_LISTEN, },
+			{ "socket", required_argument, NULL, OPT_SOCKET, },
+			{ "share-dir", required_argument, NULL, OPT_SHARE_DIR, },
+			{ "max-age", required_argument, NULL, OPT_MAX_AGE, },
+			{ "scratch-dir", required_argument, NULL, OPT_SCRATCH_DIR, },
+			{ "adaptive", required_argument, NULL, OPT_ADAPTIVE, },
+			{ "min-timeout", required_argument, NULL, OPT_MIN_TIMEOUT, },
+			{ "state-file", required_argument, NULL, OPT_STATE_FILE, },
+			{ "group-servers", no_argument, NULL, OPT_GROUP_SERVERS, },
+			{ "bench", required_argument, NULL, OPT_BENCH, },
+			{ "fd-cache", no_argument, NULL, OPT_FD_CACHE, },
+			{ "parallel-methods", no_argument, NULL, OPT_PARALLEL_METHODS, },
+			{ "max-retrans", required_argument, NULL, OPT_MAX_RETRANS, },
+			{ "max-rtt", required_argument, NULL, OPT_MAX_RTT, },
+			{ "board", required_argument, NULL, OPT_BOARD, },
+			{ "read-board", required_argument, NULL, OPT_READ_BOARD, },
 			{ "help", no_argument, NULL, 'h', },
 			{ "method", required_argument, NULL, 'm', },
 			{ "timeout", required_argument, NULL, 't', },
@@ -428,12 +5533,119 @@ int main(int argc, char *argv[])
 		int option_index = 0;
 		int tmp = 0;
 
-		c = getopt_long(argc, argv, "hm:t:vqi:", long_options, &option_index);
+		c = getopt_long(argc, argv, "dhm:t:vqi:", long_options, &option_index);
 		if (c == -1) {
 			break;
 		}
 
 		switch (c) {
+		case 'd':
+			daemon_mode = 1;
+			break;
+		case OPT_INTERVAL:
+			interval_ms = parse_duration_ms(optarg);
+			if (interval_ms <= 0) {
+				error("The interval must be greater than zero\n");
+				exit(EINVAL);
+			}
+			break;
+		case OPT_ENGINE:
+			engine = parse_engine(optarg);
+			break;
+		case OPT_WORKERS:
+			pool_size = safe_atoi(optarg);
+			if (pool_size <= 0) {
+				error("The number of workers must be greater than zero\n");
+				exit(EINVAL);
+			}
+			break;
+		case OPT_MAX_HUNG:
+			max_hung = safe_atoi(optarg);
+			if (max_hung <= 0) {
+				error("The maximum number of hung checks must be greater than zero\n");
+				exit(EINVAL);
+			}
+			break;
+		case OPT_MAX_BACKOFF:
+			max_backoff_ms = parse_duration_ms(optarg);
+			if (max_backoff_ms <= 0) {
+				error("The maximum backoff must be greater than zero\n");
+				exit(EINVAL);
+			}
+			break;
+		case OPT_WARN_LATENCY:
+			warn_latency_ms = parse_duration_ms(optarg);
+			break;
+		case OPT_CRIT_LATENCY:
+			crit_latency_ms = parse_duration_ms(optarg);
+			break;
+		case OPT_FORMAT:
+			output_format = parse_format(optarg);
+			break;
+		case OPT_ALL_NFS:
+			all_nfs = 1;
+			break;
+		case OPT_FSTYPE:
+			fstype_filter = optarg;
+			break;
+		case OPT_INCLUDE:
+			add_filter(&include_filters, &ninclude_filters, optarg);
+			break;
+		case OPT_EXCLUDE:
+			add_filter(&exclude_filters, &nexclude_filters, optarg);
+			break;
+		case OPT_LISTEN:
+			listen_addr = optarg;
+			break;
+		case OPT_SOCKET:
+			socket_path = optarg;
+			break;
+		case OPT_SHARE_DIR:
+			share_dir = optarg;
+			break;
+		case OPT_MAX_AGE:
+			share_max_age_ms = parse_duration_ms(optarg);
+			break;
+		case OPT_SCRATCH_DIR:
+			scratch_dir = optarg;
+			break;
+		case OPT_ADAPTIVE:
+			adapt_multiplier = safe_atof(optarg);
+			break;
+		case OPT_MIN_TIMEOUT:
+			adapt_min_timeout_ms = parse_duration_ms(optarg);
+			break;
+		case OPT_STATE_FILE:
+			adapt_state_file = optarg;
+			break;
+		case OPT_GROUP_SERVERS:
+			group_servers = 1;
+			break;
+		case OPT_BENCH:
+			bench_runs = safe_atoi(optarg);
+			if (bench_runs <= 0) {
+				error("The number of benchmark runs must be greater than zero\n");
+				exit(EINVAL);
+			}
+			break;
+		case OPT_FD_CACHE:
+			fd_cache = 1;
+			break;
+		case OPT_PARALLEL_METHODS:
+			parallel_methods = 1;
+			break;
+		case OPT_MAX_RETRANS:
+			max_retrans_pct = safe_atof(optarg);
+			break;
+		case OPT_MAX_RTT:
+			max_rtt_ms = parse_duration_ms(optarg);
+			break;
+		case OPT_BOARD:
+			board_path = optarg;
+			break;
+		case OPT_READ_BOARD:
+			read_board_path = optarg;
+			break;
 		case 'h':
 			usage(argv);
 			exit(0);
@@ -442,10 +5654,10 @@ int main(int argc, char *argv[])
 			exitcode_map[tmp] = 0;
 			break;
 		case 'm':
-			check_method = parse_check_method(optarg);
+			parse_check_plan(optarg, &check_plan);
 			break;
 		case 't':
-			timeout = safe_atoi(optarg);
+			timeout_ms = parse_duration_ms(optarg);
 			break;
 		case 'v':
 			if (verbosity <= 2) {
@@ -468,35 +5680,192 @@ int main(int argc, char *argv[])
 	}
 
 	/* default check method: use all available methods */
-	if (check_method == 0) {
+	if (check_plan.nsteps == 0) {
 		debug("No check method specified, using default: stat,readdir\n");
-		check_method |= CHECK_METHOD_STAT;
-		check_method |= CHECK_METHOD_READDIR;
+		nfscheck_plan_init(&check_plan, NFSCHECK_METHOD_STAT | NFSCHECK_METHOD_READDIR);
+	}
+
+	check_plan.parallel = parallel_methods;
+	check_method = nfscheck_plan_methods(&check_plan);
+	nfscheck_format_plan(&check_plan, plan_str, sizeof(plan_str));
+	debug("Argument check_method = %s\n", plan_str);
+	for (i = 0; i < check_plan.nsteps; i++) {
+		const struct nfscheck_method *info = nfscheck_method_info(check_plan.steps[i].method);
+
+		if (info->round_trip) {
+			break;
+		}
 	}
 
-	debug("Argument check_method = 0x%.8x\n", check_method);
-	debug("Argument timeout = %d\n", timeout);
+	if (i == check_plan.nsteps) {
+		verbose("No check method forces a round trip to the server: results may come from the client's caches\n");
+	}
+	debug("Argument timeout = %d ms\n", timeout_ms);
 	debug("Argument verbosity = %d\n", verbosity);
+	debug("Argument daemon = %d\n", daemon_mode);
+	debug("Argument interval = %d ms\n", interval_ms);
+	debug("Argument engine = %d\n", engine);
+	debug("Argument workers = %d\n", pool_size);
+	debug("Argument max-hung = %d\n", max_hung);
+	debug("Argument max-backoff = %d ms\n", max_backoff_ms);
+	debug("Argument warn-latency = %d ms\n", warn_latency_ms);
+	debug("Argument crit-latency = %d ms\n", crit_latency_ms);
+	debug("Argument all-nfs = %d\n", all_nfs);
+	debug("Argument listen = %s\n", listen_addr != NULL ? listen_addr : "(none)");
+
+	debug("Argument socket = %s\n", socket_path != NULL ? socket_path : "(none)");
+	debug("Argument share-dir = %s\n", share_dir != NULL ? share_dir : "(none)");
+	debug("Argument max-age = %d ms\n", share_max_age_ms);
+	debug("Argument scratch-dir = %s\n", scratch_dir != NULL ? scratch_dir : "(none)");
+	debug("Argument adaptive = %.3f\n", adapt_multiplier);
+	debug("Argument min-timeout = %d ms\n", adapt_min_timeout_ms);
+	debug("Argument state-file = %s\n", adapt_state_file != NULL ? adapt_state_file : "(none)");
+	debug("Argument group-servers = %d\n", group_servers);
+	debug("Argument bench = %d\n", bench_runs);
+	debug("Argument fd-cache = %d\n", fd_cache);
+	debug("Argument parallel-methods = %d\n", parallel_methods);
+	debug("Argument max-retrans = %.2f%%\n", max_retrans_pct);
+	debug("Argument max-rtt = %d ms\n", max_rtt_ms);
+	debug("Argument board = %s\n", board_path != NULL ? board_path : "(none)");
+	debug("Argument read-board = %s\n", read_board_path != NULL ? read_board_path : "(none)");
+
+	if (listen_addr != NULL && !daemon_mode) {
+		error("The metrics endpoint (--listen) requires daemon mode\n");
+		exit(EINVAL);
+	}
+
+	if (socket_path != NULL && !daemon_mode) {
+		error("The status socket (--socket) requires daemon mode\n");
+		exit(EINVAL);
+	}
+
+	if (board_path != NULL && !daemon_mode) {
+		error("The result board (--board) requires daemon mode\n");
+		exit(EINVAL);
+	}
+
+	if (read_board_path != NULL && (daemon_mode || bench_runs > 0 || all_nfs)) {
+		error("Reading a result board (--read-board) cannot be combined with checks\n");
+		exit(EINVAL);
+	}
+
+	if (share_dir != NULL && daemon_mode) {
+		error("Sharing results (--share-dir) is not supported in daemon mode\n");
+		exit(EINVAL);
+	}
+
+	if (share_max_age_ms > 0 && share_dir == NULL) {
+		error("The maximum age of a shared result (--max-age) requires --share-dir\n");
+		exit(EINVAL);
+	}
+
+	if (adapt_multiplier > 0 && timeout_ms == 0) {
+		error("Adaptive timeouts (--adaptive) require a timeout\n");
+		exit(EINVAL);
+	}
+
+	if (adapt_state_file != NULL && adapt_multiplier == 0) {
+		error("The latency history (--state-file) requires --adaptive\n");
+		exit(EINVAL);
+	}
+
+	if (bench_runs > 0 && (daemon_mode || share_dir != NULL)) {
+		error("Benchmark mode (--bench) cannot be combined with daemon mode or --share-dir\n");
+		exit(EINVAL);
+	}
+
+	if (fd_cache && engine != ENGINE_POOL && engine != ENGINE_THREADS) {
+		error("The descriptor cache (--fd-cache) requires the pool or threads engine\n");
+		exit(EINVAL);
+	}
+
+	if (fd_cache && !daemon_mode && bench_runs == 0) {
+		error("The descriptor cache (--fd-cache) requires daemon mode (or --bench)\n");
+		exit(EINVAL);
+	}
+
+	if (parallel_methods && engine == ENGINE_THREADS) {
+		error("Parallel methods (--parallel-methods) are not supported by the threads engine\n");
+		exit(EINVAL);
+	}
+
+	if (parallel_methods && fd_cache) {
+		error("Parallel methods (--parallel-methods) cannot be combined with --fd-cache\n");
+		exit(EINVAL);
+	}
+
+	for (i = 0; i < check_plan.nsteps && parallel_methods; i++) {
+		if (check_plan.steps[i].escalate_ms > 0) {
+			error("Parallel methods (--parallel-methods) cannot be combined with escalation thresholds\n");
+			exit(EINVAL);
+		}
+	}
+
+	for (i = 0; i < check_plan.nsteps; i++) {
+		if (check_plan.steps[i].method == NFSCHECK_METHOD_MOUNTSTATS && check_plan.steps[i].escalate_ms > 0) {
+			error("The mountstats method is always performed first: it cannot have an escalation threshold\n");
+			exit(EINVAL);
+		}
+	}
+
+	if (group_servers && !all_nfs) {
+		error("Grouping mounts by server (--group-servers) requires --all-nfs\n");
+		exit(EINVAL);
+	}
+
 	for (i = 0; i < ERRNO_MAX; i++) {
 		if (exitcode_map[i] != i) {
 			debug("Exit status code %d ignored\n", i);
 		}
 	}
 
+	/* nothing to check: the paths (if any) are looked up on the board */
+	if (read_board_path != NULL) {
+		exit(read_board(read_board_path, &argv[optind], argc - optind));
+	}
+
 	/* the user did not specify any path to check */
-	if ((argc - optind) <= 0) {
+	if ((argc - optind) <= 0 && !all_nfs) {
 		error("No path was specified!\n");
 		exit(EINVAL);
 	}
 
-	/* the user specified too many paths to check */
-	if ((argc - optind) > 1) {
-		error("Too many paths were specified!\n");
-		exit(EINVAL);
+	/* these are the paths the user specified */
+	check_defaults.check_method = check_method;
+	check_defaults.plan = check_plan;
+	nfscheck_set_scratch_dir(scratch_dir);
+	nfscheck_set_fd_cache(fd_cache ? FD_CACHE_SIZE : 0);
+	/* give up on the NULL call before the check itself is abandoned as hung */
+	nfscheck_set_rpc_timeout(timeout_ms - timeout_ms / 10);
+	nfscheck_set_mountstats_limits(max_retrans_pct, max_rtt_ms);
+	spawn_init(argv[0], scratch_dir, timeout_ms - timeout_ms / 10);
+	check_defaults.timeout_ms = timeout_ms;
+	check_defaults.interval_ms = interval_ms;
+	check_defaults.share_fd = -1;
+	check_defaults.share_wd = -1;
+	check_defaults.board_slot = -1;
+
+	/* restored into the checks as they are added */
+	if (adapt_state_file != NULL) {
+		ret = adapt_load(adapt_state_file);
+		if (ret) {
+			exit(ret);
+		}
+	}
+
+	for (i = optind; i < argc; i++) {
+		if (add_check(argv[i], 0) == NULL) {
+			exit(ENOMEM);
+		}
 	}
 
-	/* this is the path the user specified */
-	path = argv[optind];
+	/* and the mounts which match the user's filters */
+	if (all_nfs) {
+		ret = init_mounts();
+		if (ret) {
+			exit(ret);
+		}
+	}
 
 	/* check that this program is being run as root */
 	if (geteuid() > 0) {
@@ -504,63 +5873,118 @@ int main(int argc, char *argv[])
 		exit(EINVAL);
 	}
 
-	/* setup a signal handler for SIGALRM */
-	memset(&action, 0, sizeof(action));
-	action.sa_handler = handle_sigalrm;
-	action.sa_flags = SA_RESTART;
+	/* setup the event loop which supervises the check processes */
+	ret = supervisor_init();
+	if (ret) {
+		exit(ret);
+	}
 
-	if (sigaction(SIGALRM, &action, 0) < 0) {
-		const int errsave = errno;
-		error("Unable to install SIGALRM handler: %s\n", strerror(errsave));
-		exit(errno);
+	/* the fork engine is the fallback of the io_uring engine */
+	if (engine == ENGINE_URING) {
+		ret = uring_init();
+		if (ret) {
+			verbose("io_uring is not available (%s), using the fork engine\n", strerror(ret));
+			engine = ENGINE_FORK;
+		} else if (!uring_supported(&check_plan)) {
+			verbose("io_uring cannot perform this check method, using the fork engine for these checks\n");
+		}
+	}
+
+	if (engine == ENGINE_THREADS) {
+		ret = threads_init();
+		if (ret) {
+			exit(ret);
+		}
 	}
 
-	/* Print an informational message */
-	verbose("About to check path: %s\n", path);
+	if (daemon_mode) {
+		ret = run_daemon();
+		if (adapt_state_file != NULL) {
+			adapt_store(adapt_state_file);
+		}
 
-	/* Make sure all output has been processed */
-	fflush(stdout);
+		free(checks);
+		return ret;
+	}
+
+	if (nchecks == 0) {
+		verbose("No mounts were found to check\n");
+		free(checks);
+		return 0;
+	}
+
+	if (bench_runs > 0) {
+		ret = run_bench(&check_plan);
+		free(checks);
+		return ret;
+	}
+
+	if (share_dir != NULL) {
+		ret = share_init();
+		if (ret) {
+			exit(ret);
+		}
+	}
 
 	/*
-	 * Fork into two processes.
-	 *
-	 * This is used as a safety measure, to make sure that this program
-	 * does not hang forever if the NFS server is not responding to
-	 * requests (it has crashed, etc.) and one of the system calls it makes
-	 * hangs.
-	 *
-	 * The child process handles all of the interaction with the
-	 * filesystem.
-	 *
-	 * The parent process waits for the child to exit. If the child does
-	 * not exit in a timely manner, it is killed with the assumption that
-	 * it is hung within a system call.
+	 * Start one check process per path, all sharing the same deadline
+	 * (unless their timeouts are adaptive).
 	 */
-	child = fork();
-	if (child < 0) {
-		const int errsave = errno;
-		error("Unable to create child process: %s\n", strerror(errsave));
-		exit(errsave);
-	} else if (child == 0) {
-		/* this happens within the child process only */
-		const int ret = check_mountpoint(path, check_method);
-		exit(ret);
-	} else {
-		/* this happens within the parent process only */
-		const int ret = wait_for_child(timeout);
-		debug("wait_for_child(%d) = %d\n", timeout, ret);
-		verbose("Check process exited with status code %d\n", ret);
+	now = nfscheck_now();
+	for (i = 0; i < nchecks; i++) {
+		const uint64_t deadline = check_deadline(checks[i], now);
 
-		/*
-		 * Exit with the return code the check process gave us, while
-		 * also possibly ignoring any return codes that the user
-		 * instructed us to ignore.
-		 */
-		exit(exitcode_map[ret]);
+		/* started once the representative of its server has a verdict */
+		if (group_defer(checks[i])) {
+			verbose("Deferring check of path: %s\n", checks[i]->path);
+			continue;
+		}
+
+		/* Print an informational message */
+		verbose("About to check path: %s\n", checks[i]->path);
+
+		ret = begin_check(checks[i], deadline);
+
+		if (ret) {
+			supervisor_kill_all();
+			exit(ret);
+		}
 	}
 
-	/* this is never reached */
-	return 0;
+	/* wait for every check to complete (or time out) */
+	while (ninflight > 0) {
+		supervisor_dispatch(-1);
+	}
+
+	/*
+	 * Exit with the return code of the first check process which failed,
+	 * while also possibly ignoring any return codes that the user
+	 * instructed us to ignore.
+	 */
+	for (i = 0; i < nchecks; i++) {
+		const int ret = checks[i]->ret;
+
+		debug("check %s = %d\n", checks[i]->path, ret);
+		if (output_format == FORMAT_JSON) {
+			print_check_json(checks[i]);
+		} else {
+			verbose("%s for %s exited with status code %d after %.3f ms\n",
+				checks[i]->shared ? "Shared check" : "Check process",
+				checks[i]->path, ret, (double)checks[i]->elapsed / NSEC_PER_MSEC);
+			print_check_phases(checks[i]);
+		}
+
+		if (exitcode == 0) {
+			exitcode = exitcode_map[ret];
+		}
+	}
+
+	if (adapt_state_file != NULL) {
+		adapt_store(adapt_state_file);
+	}
+
+	free(checks);
+	return exitcode;
 }
 
 /* vim: set ts=8 sts=8 sw=8 noet: */
@@ -0,0 +1,587 @@
+/*
+ * libnfscheck: asynchronous checks, performed by a pool of threads.
+ *
+ * Copyright 2019 Ira W. Snyder <isnyder@lco.global>
+ * Copyright 2019 William Lindstrom <llindstrom@lco.global>
+ * Copyright 2019 Las Cumbres Observatory <https://lco.global/>
+ *
+ * A thread cannot be killed, so a thread which exceeds the deadline of its
+ * check is abandoned instead: the check is completed with ETIMEDOUT, and the
+ * thread is replaced (up to the maximum number of threads). If the check
+ * method ever returns, the late result is delivered, and the thread rejoins
+ * the pool.
+ *
+ * Requests and results are passed through a pair of single-producer,
+ * single-consumer rings per worker, so the context never takes a lock. Each
+ * worker sleeps on its own eventfd until it is sent a request, and wakes the
+ * context through a shared eventfd when it is done. The caller waits on an
+ * epoll instance which combines that eventfd with a timerfd, which is armed
+ * for the earliest deadline.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "nfscheck.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+#define RING_SIZE 4
+#define THREAD_STACK_SIZE (256 * 1024)
+
+/* A request sent to a worker thread */
+struct request {
+	struct nfscheck_plan plan;
+	char path[PATH_MAX];
+};
+
+/* A check which was submitted, but not completed yet */
+struct job {
+	void *cookie;
+	char *path;
+	struct nfscheck_plan plan;
+	uint64_t deadline;
+	uint64_t submitted;
+	struct job *next;
+};
+
+struct worker {
+	pthread_t thread;
+	int wake_fd;
+	int notify_fd;
+	int refs;
+	int stop;
+	struct job *job;
+	struct job *abandoned;
+	struct worker *next;
+
+	/* requests: produced by the context, consumed by the worker */
+	uint32_t req_head __attribute__((aligned(64)));
+	uint32_t req_tail __attribute__((aligned(64)));
+	struct request req[RING_SIZE];
+
+	/* results: produced by the worker, consumed by the context */
+	uint32_t res_head __attribute__((aligned(64)));
+	uint32_t res_tail __attribute__((aligned(64)));
+	struct nfscheck_result res[RING_SIZE];
+};
+
+struct nfscheck_ctx {
+	int epfd;
+	int event_fd;
+	int timer_fd;
+	int workers;
+	int max_threads;
+	int nthreads;
+	int nthreads_total;
+	struct worker *threads;
+	struct job *queue_head;
+	struct job *queue_tail;
+
+	/* completions not yet collected by nfscheck_poll() */
+	struct nfscheck_completion *done;
+	int ndone;
+	int done_size;
+};
+
+/*
+ * Add an element to a single-producer, single-consumer ring. Only the
+ * producer ever writes the tail, and only the consumer ever writes the head.
+ * Returns 0 on success, or -1 if the ring is full.
+ */
+static int spsc_push(uint32_t *tail, const uint32_t *head, void *slots,
+		     const size_t size, const void *elem)
+{
+	const uint32_t t = __atomic_load_n(tail, __ATOMIC_RELAXED);
+
+	if (t - __atomic_load_n(head, __ATOMIC_ACQUIRE) == RING_SIZE) {
+		return -1;
+	}
+
+	memcpy((char *)slots + (t % RING_SIZE) * size, elem, size);
+	__atomic_store_n(tail, t + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Remove an element from a ring. Returns 0 on success, or -1 if the ring is empty. */
+static int spsc_pop(const uint32_t *tail, uint32_t *head, const void *slots,
+		    const size_t size, void *elem)
+{
+	const uint32_t h = __atomic_load_n(head, __ATOMIC_RELAXED);
+
+	if (h == __atomic_load_n(tail, __ATOMIC_ACQUIRE)) {
+		return -1;
+	}
+
+	memcpy(elem, (const char *)slots + (h % RING_SIZE) * size, size);
+	__atomic_store_n(head, h + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* Increment an eventfd, waking whoever waits on it */
+static void eventfd_signal(const int fd)
+{
+	const uint64_t value = 1;
+
+	if (write(fd, &value, sizeof(value)) < 0) {
+		/* the counter cannot overflow */
+	}
+}
+
+/*
+ * Drop a reference to a worker. A worker is referenced by its thread, and
+ * by its context: whichever is the last to let go frees it.
+ */
+static void worker_put(struct worker *w)
+{
+	if (__atomic_sub_fetch(&w->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		close(w->wake_fd);
+		close(w->notify_fd);
+		free(w);
+	}
+}
+
+/* The main loop of a worker thread: check the mountpoints it is sent */
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	struct nfscheck_result result;
+	struct request req;
+	uint64_t value;
+
+	while (!__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE)) {
+		if (read(w->wake_fd, &value, sizeof(value)) < 0 && errno != EINTR) {
+			break;
+		}
+
+		while (spsc_pop(&w->req_tail, &w->req_head, w->req, sizeof(req), &req) == 0) {
+			nfscheck_check_plan(req.path, &req.plan, &result);
+
+			/* cannot fail: a worker is only ever sent one request at a time */
+			if (spsc_push(&w->res_tail, &w->res_head, w->res, sizeof(result), &result) == 0) {
+				eventfd_signal(w->notify_fd);
+			}
+		}
+	}
+
+	nfscheck_fd_cache_flush();
+	worker_put(w);
+	return NULL;
+}
+
+/* Create a new worker thread. Returns the worker, or NULL on failure. */
+static struct worker *worker_spawn(struct nfscheck_ctx *ctx)
+{
+	struct worker *w = NULL;
+	pthread_attr_t attr;
+	sigset_t mask;
+	sigset_t old;
+	int ret;
+
+	if (posix_memalign((void **)&w, 64, sizeof(*w)) != 0) {
+		return NULL;
+	}
+
+	memset(w, 0, sizeof(*w));
+	w->refs = 2;
+	w->wake_fd = eventfd(0, EFD_CLOEXEC);
+	w->notify_fd = fcntl(ctx->event_fd, F_DUPFD_CLOEXEC, 0);
+	if (w->wake_fd < 0 || w->notify_fd < 0) {
+		goto out_close;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
+
+	/* every signal is handled by the threads of the caller */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &old);
+	ret = pthread_create(&w->thread, &attr, worker_main, w);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+
+	if (ret) {
+		errno = ret;
+		goto out_close;
+	}
+
+	w->next = ctx->threads;
+	ctx->threads = w;
+	ctx->nthreads++;
+	ctx->nthreads_total++;
+	return w;
+
+out_close:
+	if (w->wake_fd >= 0) {
+		close(w->wake_fd);
+	}
+
+	if (w->notify_fd >= 0) {
+		close(w->notify_fd);
+	}
+
+	free(w);
+	return NULL;
+}
+
+/* Queue a completion for nfscheck_poll(). Returns 0 on success, or an errno value. */
+static int complete(struct nfscheck_ctx *ctx, const struct job *job, const int error,
+		    const struct nfscheck_result *result, const int timed_out, const int late)
+{
+	struct nfscheck_completion *c;
+
+	if (ctx->ndone == ctx->done_size) {
+		const int size = ctx->done_size ? ctx->done_size * 2 : 16;
+		struct nfscheck_completion *tmp = realloc(ctx->done, size * sizeof(*tmp));
+		if (tmp == NULL) {
+			return ENOMEM;
+		}
+
+		ctx->done = tmp;
+		ctx->done_size = size;
+	}
+
+	c = &ctx->done[ctx->ndone++];
+	memset(c, 0, sizeof(*c));
+	if (result != NULL) {
+		c->result = *result;
+	}
+
+	c->result.error = error;
+	c->cookie = job->cookie;
+	c->timed_out = timed_out;
+	c->late = late;
+	c->elapsed_ns = nfscheck_now() - job->submitted;
+	return 0;
+}
+
+static void job_free(struct job *job)
+{
+	free(job->path);
+	free(job);
+}
+
+/* Send a job to an idle worker. Returns 0 on success, or an errno value. */
+static int worker_send(struct worker *w, struct job *job)
+{
+	struct request req;
+	size_t len;
+
+	len = strlen(job->path);
+	if (len >= sizeof(req.path)) {
+		return ENAMETOOLONG;
+	}
+
+	req.plan = job->plan;
+	memcpy(req.path, job->path, len + 1);
+	if (spsc_push(&w->req_tail, &w->req_head, w->req, sizeof(req), &req) < 0) {
+		return EBUSY;
+	}
+
+	w->job = job;
+	eventfd_signal(w->wake_fd);
+	return 0;
+}
+
+/* Hand the queued jobs to idle workers, creating them as needed */
+static void dispatch(struct nfscheck_ctx *ctx)
+{
+	const uint64_t now = nfscheck_now();
+
+	while (ctx->queue_head != NULL) {
+		struct job *job = ctx->queue_head;
+		struct worker *w;
+
+		/* waited in the queue for so long that it could never start */
+		if (job->deadline != 0 && job->deadline <= now) {
+			ctx->queue_head = job->next;
+			if (complete(ctx, job, NFSCHECK_EUNKNOWN, NULL, 0, 0) == 0) {
+				job_free(job);
+				continue;
+			}
+
+			/* try again on the next poll */
+			ctx->queue_head = job;
+			return;
+		}
+
+		/* find an idle worker */
+		for (w = ctx->threads; w != NULL; w = w->next) {
+			if (w->job == NULL && w->abandoned == NULL) {
+				break;
+			}
+		}
+
+		if (w == NULL) {
+			if (ctx->nthreads >= ctx->workers || ctx->nthreads_total >= ctx->max_threads) {
+				return;
+			}
+
+			w = worker_spawn(ctx);
+			if (w == NULL) {
+				return;
+			}
+		}
+
+		if (worker_send(w, job)) {
+			return;
+		}
+
+		ctx->queue_head = job->next;
+	}
+
+	ctx->queue_tail = NULL;
+}
+
+/* Arm the timerfd for the earliest deadline of any job, whether queued or running */
+static void arm_timer(struct nfscheck_ctx *ctx)
+{
+	struct itimerspec its;
+	uint64_t deadline = 0;
+	const struct worker *w;
+	const struct job *job;
+
+	for (w = ctx->threads; w != NULL; w = w->next) {
+		if (w->job != NULL && w->job->deadline != 0 &&
+		    (deadline == 0 || w->job->deadline < deadline)) {
+			deadline = w->job->deadline;
+		}
+	}
+
+	for (job = ctx->queue_head; job != NULL; job = job->next) {
+		if (job->deadline != 0 && (deadline == 0 || job->deadline < deadline)) {
+			deadline = job->deadline;
+		}
+	}
+
+	/* an all-zero it_value disarms the timer */
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = deadline / NSEC_PER_SEC;
+	its.it_value.tv_nsec = deadline % NSEC_PER_SEC;
+	timerfd_settime(ctx->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+struct nfscheck_ctx *nfscheck_ctx_new(const struct nfscheck_options *options)
+{
+	struct nfscheck_ctx *ctx;
+	struct epoll_event ev;
+	int errsave;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx == NULL) {
+		return NULL;
+	}
+
+	ctx->workers = 8;
+	if (options != NULL && options->workers > 0) {
+		ctx->workers = options->workers;
+	}
+
+	ctx->max_threads = 2 * ctx->workers;
+	if (options != NULL && options->max_threads >= ctx->workers) {
+		ctx->max_threads = options->max_threads;
+	}
+
+	ctx->epfd = epoll_create1(EPOLL_CLOEXEC);
+	ctx->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	ctx->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (ctx->epfd < 0 || ctx->event_fd < 0 || ctx->timer_fd < 0) {
+		goto out_free;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	if (epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, ctx->event_fd, &ev) < 0 ||
+	    epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, ctx->timer_fd, &ev) < 0) {
+		goto out_free;
+	}
+
+	return ctx;
+
+out_free:
+	errsave = errno;
+	nfscheck_ctx_free(ctx);
+	errno = errsave;
+	return NULL;
+}
+
+void nfscheck_ctx_free(struct nfscheck_ctx *ctx)
+{
+	struct worker *w;
+	struct job *job;
+
+	if (ctx == NULL) {
+		return;
+	}
+
+	while (ctx->threads != NULL) {
+		w = ctx->threads;
+		ctx->threads = w->next;
+
+		/* the thread exits as soon as it is idle */
+		if (w->job != NULL) {
+			job_free(w->job);
+		}
+
+		if (w->abandoned != NULL) {
+			job_free(w->abandoned);
+		}
+
+		__atomic_store_n(&w->stop, 1, __ATOMIC_RELEASE);
+		eventfd_signal(w->wake_fd);
+		worker_put(w);
+	}
+
+	while (ctx->queue_head != NULL) {
+		job = ctx->queue_head;
+		ctx->queue_head = job->next;
+		job_free(job);
+	}
+
+	if (ctx->epfd >= 0) {
+		close(ctx->epfd);
+	}
+
+	if (ctx->event_fd >= 0) {
+		close(ctx->event_fd);
+	}
+
+	if (ctx->timer_fd >= 0) {
+		close(ctx->timer_fd);
+	}
+
+	free(ctx->done);
+	free(ctx);
+}
+
+int nfscheck_fd(const struct nfscheck_ctx *ctx)
+{
+	return ctx->epfd;
+}
+
+int nfscheck_submit(struct nfscheck_ctx *ctx, const char *path, const int methods,
+		    const uint64_t deadline, void *cookie)
+{
+	struct nfscheck_plan plan;
+
+	nfscheck_plan_init(&plan, methods);
+	return nfscheck_submit_plan(ctx, path, &plan, deadline, cookie);
+}
+
+int nfscheck_submit_plan(struct nfscheck_ctx *ctx, const char *path,
+			 const struct nfscheck_plan *plan, const uint64_t deadline, void *cookie)
+{
+	struct job *job;
+
+	job = calloc(1, sizeof(*job));
+	if (job == NULL) {
+		return ENOMEM;
+	}
+
+	job->path = strdup(path);
+	if (job->path == NULL) {
+		free(job);
+		return ENOMEM;
+	}
+
+	job->cookie = cookie;
+	job->plan = *plan;
+	job->deadline = deadline;
+	job->submitted = nfscheck_now();
+
+	if (ctx->queue_tail != NULL) {
+		ctx->queue_tail->next = job;
+	} else {
+		ctx->queue_head = job;
+	}
+
+	ctx->queue_tail = job;
+	dispatch(ctx);
+	arm_timer(ctx);
+	return 0;
+}
+
+/* Collect the results sent back by the workers, and enforce the deadlines */
+static void collect(struct nfscheck_ctx *ctx)
+{
+	const uint64_t now = nfscheck_now();
+	struct nfscheck_result result;
+	struct worker *w;
+
+	for (w = ctx->threads; w != NULL; w = w->next) {
+		while (spsc_pop(&w->res_tail, &w->res_head, w->res, sizeof(result), &result) == 0) {
+			struct job *job = w->job;
+
+			/* an abandoned thread finally returned: it rejoins the pool */
+			if (job == NULL) {
+				job = w->abandoned;
+				w->abandoned = NULL;
+				ctx->nthreads++;
+				if (job == NULL) {
+					continue;
+				}
+
+				complete(ctx, job, result.error, &result, 0, 1);
+				job_free(job);
+				continue;
+			}
+
+			w->job = NULL;
+			complete(ctx, job, result.error, &result, 0, 0);
+			job_free(job);
+		}
+
+		/* abandon the thread: it cannot be killed */
+		if (w->job != NULL && w->job->deadline != 0 && w->job->deadline <= now) {
+			complete(ctx, w->job, ETIMEDOUT, NULL, 1, 0);
+			w->abandoned = w->job;
+			w->job = NULL;
+			ctx->nthreads--;
+		}
+	}
+}
+
+int nfscheck_poll(struct nfscheck_ctx *ctx, struct nfscheck_completion *completions, const int max)
+{
+	uint64_t value;
+	int n;
+
+	/* these are only wakeups: the state is in the rings and deadlines */
+	if (read(ctx->event_fd, &value, sizeof(value)) < 0) {
+		/* nothing to read */
+	}
+
+	if (read(ctx->timer_fd, &value, sizeof(value)) < 0) {
+		/* nothing to read */
+	}
+
+	collect(ctx);
+	dispatch(ctx);
+	arm_timer(ctx);
+
+	n = ctx->ndone < max ? ctx->ndone : max;
+	memcpy(completions, ctx->done, n * sizeof(*completions));
+	ctx->ndone -= n;
+	memmove(ctx->done, ctx->done + n, ctx->ndone * sizeof(*completions));
+
+	/* stay readable until every completion has been collected */
+	if (ctx->ndone > 0) {
+		eventfd_signal(ctx->event_fd);
+	}
+
+	return n;
+}
+
+/* vim: set ts=8 sts=8 sw=8 noet: */
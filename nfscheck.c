@@ -0,0 +1,2125 @@
+/*
+ * libnfscheck: the check methods, and synchronous checks.
+ *
+ * Copyright 2019 Ira W. Snyder <isnyder@lco.global>
+ * Copyright 2019 William Lindstrom <llindstrom@lco.global>
+ * Copyright 2019 Las Cumbres Observatory <https://lco.global/>
+ *
+ * This code heavily inspired by:
+ * https://github.com/acdha/mountstatus/blob/master/legacy-c-version/main.c
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <limits.h>
+#include <math.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "nfscheck.h"
+#include "probes.h"
+
+#define NSEC_PER_SEC 1000000000ULL
+
+/* Stack size of the threads of a parallel check (see check_parallel()) */
+#define PARALLEL_STACK_SIZE (256 * 1024)
+
+/* Returned by fd_cache_get() when descriptors are not cached (never an errno value) */
+#define FD_CACHE_NONE (-1)
+
+static const char *const phase_names[NFSCHECK_PHASE_MAX] = {
+	[NFSCHECK_PHASE_STATX_STATX]		= "statx.statx",
+	[NFSCHECK_PHASE_STAT_OPEN]		= "stat.open",
+	[NFSCHECK_PHASE_STAT_FSTAT]		= "stat.fstat",
+	[NFSCHECK_PHASE_STAT_CLOSE]		= "stat.close",
+	[NFSCHECK_PHASE_READDIR_OPENDIR]	= "readdir.opendir",
+	[NFSCHECK_PHASE_READDIR_READDIR]	= "readdir.readdir",
+	[NFSCHECK_PHASE_READDIR_CLOSEDIR]	= "readdir.closedir",
+	[NFSCHECK_PHASE_READDIR_RAW_OPEN]	= "readdir-raw.open",
+	[NFSCHECK_PHASE_READDIR_RAW_GETDENTS]	= "readdir-raw.getdents64",
+	[NFSCHECK_PHASE_READDIR_RAW_CLOSE]	= "readdir-raw.close",
+	[NFSCHECK_PHASE_WRITE_OPEN]		= "write.open",
+	[NFSCHECK_PHASE_WRITE_PWRITE]		= "write.pwrite",
+	[NFSCHECK_PHASE_WRITE_FDATASYNC]	= "write.fdatasync",
+	[NFSCHECK_PHASE_WRITE_CLOSE]		= "write.close",
+	[NFSCHECK_PHASE_WRITE_UNLINK]		= "write.unlink",
+	[NFSCHECK_PHASE_RPC_NULL_CONNECT]	= "rpc-null.connect",
+	[NFSCHECK_PHASE_RPC_NULL_CALL]		= "rpc-null.call",
+	[NFSCHECK_PHASE_MOUNTSTATS_READ]	= "mountstats.read",
+	[NFSCHECK_PHASE_USER]			= "user",
+};
+
+static void (*log_fn)(const char *fmt, va_list args) = NULL;
+
+void nfscheck_set_log(void (*fn)(const char *fmt, va_list args))
+{
+	log_fn = fn;
+}
+
+static void nfscheck_debug(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void nfscheck_debug(const char *fmt, ...)
+{
+	va_list args;
+
+	if (log_fn == NULL) {
+		return;
+	}
+
+	va_start(args, fmt);
+	log_fn(fmt, args);
+	va_end(args);
+}
+
+uint64_t nfscheck_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+void nfscheck_phase_done(struct nfscheck_result *result, const enum nfscheck_phase phase, uint64_t *t)
+{
+	/* the errno value of the phase is read after it has been recorded */
+	const int errsave = errno;
+	const uint64_t now = nfscheck_now();
+
+	result->phase_ns[phase] = now - *t;
+	PROBE3(phase__done, phase, phase_names[phase], now - *t);
+	*t = now;
+	errno = errsave;
+}
+
+const char *nfscheck_phase_name(const enum nfscheck_phase phase)
+{
+	if ((int)phase < 0 || phase >= NFSCHECK_PHASE_MAX) {
+		return NULL;
+	}
+
+	return phase_names[phase];
+}
+
+uint64_t nfscheck_result_latency(const struct nfscheck_result *result)
+{
+	uint64_t total = 0;
+	int i;
+
+	for (i = 0; i < NFSCHECK_PHASE_MAX; i++) {
+		total += result->phase_ns[i];
+	}
+
+	return total;
+}
+
+/*
+ * Cache of directory file descriptors, one per checked path (see
+ * nfscheck_set_fd_cache()). Every thread has its own cache, so that a
+ * thread which hangs never holds up the checks of the others, and a thread
+ * which is abandoned only ever takes its own descriptors down with it.
+ *
+ * Invalidation is lazy: nfscheck_fd_cache_invalidate() bumps a generation
+ * number, and every thread closes its descriptors at its next check.
+ */
+struct fd_cache_entry {
+	char *path;
+	int fd;
+};
+
+static int fd_cache_max = 0;
+static unsigned int fd_cache_generation = 0;
+static __thread struct fd_cache_entry *fd_cache = NULL;
+static __thread int fd_cache_len = 0;
+static __thread unsigned int fd_cache_seen = 0;
+
+void nfscheck_set_fd_cache(const int max)
+{
+	fd_cache_max = max > 0 ? max : 0;
+}
+
+void nfscheck_fd_cache_invalidate(void)
+{
+	__atomic_add_fetch(&fd_cache_generation, 1, __ATOMIC_RELEASE);
+}
+
+void nfscheck_fd_cache_flush(void)
+{
+	int i;
+
+	for (i = 0; i < fd_cache_len; i++) {
+		close(fd_cache[i].fd);
+		free(fd_cache[i].path);
+	}
+
+	free(fd_cache);
+	fd_cache = NULL;
+	fd_cache_len = 0;
+}
+
+/* Close the cached descriptor of a path, if there is one */
+static void fd_cache_drop(const char *path)
+{
+	int i;
+
+	for (i = 0; i < fd_cache_len; i++) {
+		if (strcmp(fd_cache[i].path, path) == 0) {
+			close(fd_cache[i].fd);
+			free(fd_cache[i].path);
+			fd_cache_len--;
+			memmove(&fd_cache[i], &fd_cache[i + 1], (fd_cache_len - i) * sizeof(*fd_cache));
+			return;
+		}
+	}
+}
+
+/*
+ * The cached directory descriptor of a path, opening it (timed as the given
+ * phase) unless it is already open. Returns zero on success, FD_CACHE_NONE
+ * if descriptors are not cached (the caller then checks the path instead), or
+ * an errno value (such as that of the failed open), the result of the check.
+ */
+static int fd_cache_get(const char *path, int *fd, struct nfscheck_result *result,
+			const enum nfscheck_phase phase, uint64_t *t)
+{
+	const unsigned int generation = __atomic_load_n(&fd_cache_generation, __ATOMIC_ACQUIRE);
+	char *copy;
+	int i;
+
+	if (fd_cache_max == 0) {
+		return FD_CACHE_NONE;
+	}
+
+	if (fd_cache_seen != generation) {
+		nfscheck_fd_cache_flush();
+		fd_cache_seen = generation;
+	}
+
+	for (i = 0; i < fd_cache_len; i++) {
+		if (strcmp(fd_cache[i].path, path) == 0) {
+			*fd = fd_cache[i].fd;
+			return 0;
+		}
+	}
+
+	if (fd_cache == NULL) {
+		fd_cache = calloc(fd_cache_max, sizeof(*fd_cache));
+		if (fd_cache == NULL) {
+			return ENOMEM;
+		}
+	}
+
+	copy = strdup(path);
+	if (copy == NULL) {
+		return ENOMEM;
+	}
+
+	*fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	nfscheck_phase_done(result, phase, t);
+	if (*fd < 0) {
+		const int errsave = errno;
+		nfscheck_debug("open failed: %s\n", strerror(errsave));
+		free(copy);
+		return errsave;
+	}
+
+	/* make room by closing the oldest descriptor */
+	if (fd_cache_len == fd_cache_max) {
+		fd_cache_drop(fd_cache[0].path);
+	}
+
+	fd_cache[fd_cache_len].path = copy;
+	fd_cache[fd_cache_len].fd = *fd;
+	fd_cache_len++;
+	return 0;
+}
+
+/*
+ * A probe through a cached descriptor failed: close it, so that the next
+ * check opens the path again. A stale file handle (ESTALE) is reported like
+ * any other failure: the mount was stale for as long as it was held open.
+ */
+static int fd_cache_failed(const char *path, const char *what, const int err)
+{
+	nfscheck_debug("%s failed on cached descriptor: %s\n", what, strerror(err));
+	fd_cache_drop(path);
+	return err;
+}
+
+/* Read the first directory entries of a cached descriptor, from the start */
+static int fd_cache_getdents(const char *path, const int fd)
+{
+	char buf[512] __attribute__((aligned(8)));
+	long nread;
+
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		return fd_cache_failed(path, "lseek", errno);
+	}
+
+	nread = syscall(__NR_getdents64, fd, buf, sizeof(buf));
+	if (nread < 0) {
+		return fd_cache_failed(path, "getdents64", errno);
+	}
+
+	/* even an empty directory has "." and ".." */
+	if (nread == 0) {
+		nfscheck_debug("getdents64 returned no entries\n");
+		fd_cache_drop(path);
+		return NFSCHECK_EUNKNOWN;
+	}
+
+	return 0;
+}
+
+/*
+ * Check an NFS mountpoint using the readdir method.
+ *
+ * - Open the mountpoint as a directory
+ * - Attempt to read the first directory entry
+ * - Close the directory
+ *
+ * This method has the side effect of performing some read only I/O on the
+ * NFS server, but also has a good chance of detecting problems very quickly.
+ *
+ * Reading a single directory entry is sufficient to check if the server is
+ * alive: the current directory (".") is always present, and is also always
+ * the first entry returned by readdir().
+ *
+ * The CentOS 5 NFS client will successfully open and read the contents of
+ * a mount point for up to several minutes after the server has crashed. Newer
+ * versions behave sensibly (they hang immediately when the server has crashed).
+ */
+static int check_mountpoint_readdir(const char *path, struct nfscheck_result *result, void *arg)
+{
+	uint64_t t = nfscheck_now();
+	struct dirent *dirent;
+	DIR *dirp;
+	int ret;
+	int fd;
+
+	(void)arg;
+
+	/* rewind the cached descriptor, if any, instead of opening the directory */
+	ret = fd_cache_get(path, &fd, result, NFSCHECK_PHASE_READDIR_OPENDIR, &t);
+	if (ret != FD_CACHE_NONE) {
+		if (ret == 0) {
+			ret = fd_cache_getdents(path, fd);
+			nfscheck_phase_done(result, NFSCHECK_PHASE_READDIR_READDIR, &t);
+		}
+
+		return ret;
+	}
+
+	dirp = opendir(path);
+	nfscheck_phase_done(result, NFSCHECK_PHASE_READDIR_OPENDIR, &t);
+	if (dirp == NULL) {
+		const int errsave = errno;
+		nfscheck_debug("opendir failed: %s\n", strerror(errsave));
+		return errsave;
+	}
+
+	dirent = readdir(dirp);
+	nfscheck_phase_done(result, NFSCHECK_PHASE_READDIR_READDIR, &t);
+	if (dirent == NULL) {
+		const int errsave = errno;
+		nfscheck_debug("readdir failed: %s\n", strerror(errsave));
+		closedir(dirp);
+		return errsave;
+	}
+
+	if (closedir(dirp) < 0) {
+		const int errsave = errno;
+		nfscheck_phase_done(result, NFSCHECK_PHASE_READDIR_CLOSEDIR, &t);
+		nfscheck_debug("closedir failed: %s\n", strerror(errsave));
+		return errsave;
+	}
+
+	nfscheck_phase_done(result, NFSCHECK_PHASE_READDIR_CLOSEDIR, &t);
+
+	/* success */
+	return 0;
+}
+
+/*
+ * Check an NFS mountpoint using the raw readdir method.
+ *
+ * - Open the mountpoint as a directory (without following symlinks)
+ * - Read the first directory entries with a single getdents64() call
+ * - Close the directory
+ *
+ * This is equivalent to the readdir method, but without the library
+ * overhead: opendir() allocates a 32 KiB buffer, which readdir() then asks
+ * the NFS client to fill (possibly with a large READDIRPLUS request to the
+ * server). Here, the buffer is small enough to live on the stack, so only
+ * the first few entries are ever requested from the server.
+ */
+static int check_mountpoint_readdir_raw(const char *path, struct nfscheck_result *result, void *arg)
+{
+	char buf[512] __attribute__((aligned(8)));
+	uint64_t t = nfscheck_now();
+	long nread;
+	int ret;
+	int fd;
+
+	(void)arg;
+
+	/* rewind the cached descriptor, if any, instead of opening the directory */
+	ret = fd_cache_get(path, &fd, result, NFSCHECK_PHASE_READDIR_RAW_OPEN, &t);
+	if (ret != FD_CACHE_NONE) {
+		if (ret == 0) {
+			ret = fd_cache_getdents(path, fd);
+			nfscheck_phase_done(result, NFSCHECK_PHASE_READDIR_RAW_GETDENTS, &t);
+		}
+
+		return ret;
+	}
+
+	/* open the directory */
+	fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	nfscheck_phase_done(result, NFSCHECK_PHASE_READDIR_RAW_OPEN, &t);
+	if (fd < 0) {
+		const int errsave = errno;
+		nfscheck_debug("open failed: %s\n", strerror(errsave));
+		return errsave;
+	}
+
+	/* read the first directory entries */
+	nread = syscall(__NR_getdents64, fd, buf, sizeof(buf));
+	nfscheck_phase_done(result, NFSCHECK_PHASE_READDIR_RAW_GETDENTS, &t);
+	if (nread < 0) {
+		const int errsave = errno;
+		nfscheck_debug("getdents64 failed: %s\n", strerror(errsave));
+		close(fd);
+		return errsave;
+	}
+
+	/* even an empty directory has "." and ".." */
+	if (nread == 0) {
+		nfscheck_debug("getdents64 returned no entries\n");
+		close(fd);
+		return NFSCHECK_EUNKNOWN;
+	}
+
+	/* close the directory */
+	if (close(fd) < 0) {
+		const int errsave = errno;
+		nfscheck_phase_done(result, NFSCHECK_PHASE_READDIR_RAW_CLOSE, &t);
+		nfscheck_debug("close failed: %s\n", strerror(errsave));
+		return errsave;
+	}
+
+	nfscheck_phase_done(result, NFSCHECK_PHASE_READDIR_RAW_CLOSE, &t);
+
+	/* success */
+	return 0;
+}
+
+/*
+ * Check an NFS mountpoint using the stat method.
+ *
+ * - Open the mountpoint as a directory
+ * - Call fstat to get information about the directory
+ * - Close the directory
+ *
+ * This method performs a minimal amount of read I/O on the NFS server, and
+ * has a decent chance of detecting problems quickly. This method is
+ * method is more reliable on newer systems.
+ *
+ * The CentOS 5 NFS client will successfully open the directory and retrieve
+ * the status information for up to several minutes after the server has
+ * crashed (or the mount has been made stale), with no indication of failure.
+ * Newer versions behave better, though there can still be a small delay
+ * between the server side problems and being able to detect them on the
+ * client side.
+ */
+static int check_mountpoint_stat(const char *path, struct nfscheck_result *result, void *arg)
+{
+	uint64_t t = nfscheck_now();
+	struct stat buf;
+	int ret;
+	int fd;
+
+	(void)arg;
+
+	/* stat the cached descriptor, if any, instead of opening the directory */
+	ret = fd_cache_get(path, &fd, result, NFSCHECK_PHASE_STAT_OPEN, &t);
+	if (ret != FD_CACHE_NONE) {
+		if (ret == 0) {
+			ret = fstatat(fd, "", &buf, AT_EMPTY_PATH) < 0 ? errno : 0;
+			nfscheck_phase_done(result, NFSCHECK_PHASE_STAT_FSTAT, &t);
+			if (ret) {
+				return fd_cache_failed(path, "fstatat", ret);
+			}
+		}
+
+		return ret;
+	}
+
+	/* open the directory */
+	fd = open(path, O_RDONLY | O_SYNC);
+	nfscheck_phase_done(result, NFSCHECK_PHASE_STAT_OPEN, &t);
+	if (fd < 0) {
+		const int errsave = errno;
+		nfscheck_debug("open failed: %s\n", strerror(errsave));
+		return errsave;
+	}
+
+	/* call fstat on the directory */
+	if (fstat(fd, &buf) < 0) {
+		const int errsave = errno;
+		nfscheck_phase_done(result, NFSCHECK_PHASE_STAT_FSTAT, &t);
+		nfscheck_debug("fstat failed: %s\n", strerror(errsave));
+		close(fd);
+		return errsave;
+	}
+
+	nfscheck_phase_done(result, NFSCHECK_PHASE_STAT_FSTAT, &t);
+
+	/* close the directory */
+	if (close(fd) < 0) {
+		const int errsave = errno;
+		nfscheck_phase_done(result, NFSCHECK_PHASE_STAT_CLOSE, &t);
+		nfscheck_debug("close failed: %s\n", strerror(errsave));
+		return errsave;
+	}
+
+	nfscheck_phase_done(result, NFSCHECK_PHASE_STAT_CLOSE, &t);
+
+	/* success */
+	return 0;
+}
+
+/*
+ * Check an NFS mountpoint using the statx method.
+ *
+ * - Call statx with AT_STATX_FORCE_SYNC on the mountpoint
+ *
+ * AT_STATX_FORCE_SYNC makes the NFS client revalidate the attributes with
+ * the server (a GETATTR round trip), instead of answering from its
+ * attribute cache. Only the file mode is requested: it is enough to force
+ * the revalidation, and is cheap for the server to provide.
+ *
+ * Unlike the stat method, this does not open (and close) the mountpoint, so
+ * there is no OPEN/CLOSE traffic and no file descriptor held during the
+ * check. It requires Linux 4.11 or newer.
+ */
+static int check_mountpoint_statx(const char *path, struct nfscheck_result *result, void *arg)
+{
+	uint64_t t = nfscheck_now();
+	struct statx buf;
+	int ret;
+	int fd;
+
+	(void)arg;
+
+	/* revalidate the cached descriptor, if any, instead of walking the path */
+	ret = fd_cache_get(path, &fd, result, NFSCHECK_PHASE_STATX_STATX, &t);
+	if (ret != FD_CACHE_NONE) {
+		if (ret == 0) {
+			ret = statx(fd, "", AT_EMPTY_PATH | AT_STATX_FORCE_SYNC, STATX_TYPE | STATX_MODE, &buf) < 0 ? errno : 0;
+			nfscheck_phase_done(result, NFSCHECK_PHASE_STATX_STATX, &t);
+			if (ret) {
+				return fd_cache_failed(path, "statx", ret);
+			}
+		}
+
+		return ret;
+	}
+
+	ret = statx(AT_FDCWD, path, AT_STATX_FORCE_SYNC | AT_NO_AUTOMOUNT, STATX_TYPE | STATX_MODE, &buf);
+	nfscheck_phase_done(result, NFSCHECK_PHASE_STATX_STATX, &t);
+	if (ret < 0) {
+		const int errsave = errno;
+		nfscheck_debug("statx failed: %s\n", strerror(errsave));
+		return errsave;
+	}
+
+	/* success */
+	return 0;
+}
+
+static const char *scratch_dir = NULL;
+
+void nfscheck_set_scratch_dir(const char *dir)
+{
+	scratch_dir = dir;
+}
+
+/*
+ * Check an NFS mountpoint using the write method.
+ *
+ * - Create a probe file in the scratch directory
+ * - Write a few bytes to it, with O_DIRECT where supported
+ * - Flush them to stable storage on the server with fdatasync()
+ * - Close and remove the file
+ *
+ * The read only methods can be answered from the caches of the NFS client
+ * while writes hang (a full or read only export, a stuck COMMIT on the
+ * server). This method exercises the data path instead: the open and unlink
+ * phases measure metadata operations, while the pwrite and fdatasync phases
+ * measure the WRITE and COMMIT latency of the server.
+ *
+ * The probe file is named after the process and thread, so that concurrent
+ * checks never collide (and a file left behind by a killed check is simply
+ * reused).
+ */
+static int check_mountpoint_write(const char *path, struct nfscheck_result *result, void *arg)
+{
+	static const char data[] = "nfscheck\n";
+	char name[PATH_MAX];
+	uint64_t t;
+	int errsave;
+	int fd;
+	int ret;
+
+	(void)arg;
+
+	if (scratch_dir == NULL) {
+		ret = snprintf(name, sizeof(name), "%s", path);
+	} else if (scratch_dir[0] == '/') {
+		ret = snprintf(name, sizeof(name), "%s", scratch_dir);
+	} else {
+		ret = snprintf(name, sizeof(name), "%s/%s", path, scratch_dir);
+	}
+
+	if (ret >= 0 && (size_t)ret < sizeof(name)) {
+		ret += snprintf(name + ret, sizeof(name) - ret, "/.nfscheck-%ld-%ld",
+				(long)getpid(), (long)syscall(__NR_gettid));
+	}
+
+	if (ret < 0 || (size_t)ret >= sizeof(name)) {
+		return ENAMETOOLONG;
+	}
+
+	/* create the probe file (some filesystems refuse O_DIRECT) */
+	t = nfscheck_now();
+	fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC | O_DIRECT, 0600);
+	if (fd < 0 && errno == EINVAL) {
+		fd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+	}
+
+	nfscheck_phase_done(result, NFSCHECK_PHASE_WRITE_OPEN, &t);
+	if (fd < 0) {
+		errsave = errno;
+		nfscheck_debug("open failed: %s\n", strerror(errsave));
+		return errsave;
+	}
+
+	/* the NFS client allows unaligned direct I/O, local filesystems do not */
+	ret = pwrite(fd, data, sizeof(data) - 1, 0);
+	if (ret < 0 && errno == EINVAL) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+		ret = pwrite(fd, data, sizeof(data) - 1, 0);
+	}
+
+	nfscheck_phase_done(result, NFSCHECK_PHASE_WRITE_PWRITE, &t);
+	if (ret < 0) {
+		errsave = errno;
+		nfscheck_debug("pwrite failed: %s\n", strerror(errsave));
+		goto out_close;
+	}
+
+	if (fdatasync(fd) < 0) {
+		errsave = errno;
+		nfscheck_phase_done(result, NFSCHECK_PHASE_WRITE_FDATASYNC, &t);
+		nfscheck_debug("fdatasync failed: %s\n", strerror(errsave));
+		goto out_close;
+	}
+
+	nfscheck_phase_done(result, NFSCHECK_PHASE_WRITE_FDATASYNC, &t);
+
+	if (close(fd) < 0) {
+		errsave = errno;
+		nfscheck_phase_done(result, NFSCHECK_PHASE_WRITE_CLOSE, &t);
+		nfscheck_debug("close failed: %s\n", strerror(errsave));
+		unlink(name);
+		return errsave;
+	}
+
+	nfscheck_phase_done(result, NFSCHECK_PHASE_WRITE_CLOSE, &t);
+
+	if (unlink(name) < 0) {
+		errsave = errno;
+		nfscheck_phase_done(result, NFSCHECK_PHASE_WRITE_UNLINK, &t);
+		nfscheck_debug("unlink failed: %s\n", strerror(errsave));
+		return errsave;
+	}
+
+	nfscheck_phase_done(result, NFSCHECK_PHASE_WRITE_UNLINK, &t);
+
+	/* success */
+	return 0;
+
+out_close:
+	close(fd);
+	unlink(name);
+	return errsave;
+}
+
+/*
+ * The rpc-null method: an NFS NULL call (procedure 0, which does nothing),
+ * sent straight to the server of the mount, over a socket of our own.
+ *
+ * Every other method goes through the NFS client of the kernel: it may be
+ * answered from the caches of the client, and when the server is dead, it
+ * leaves the checking process (or thread) stuck in uninterruptible sleep.
+ * This method bypasses the VFS entirely: the server, port, protocol and NFS
+ * version are taken from the mount options in /proc/self/mountinfo (without
+ * touching the path itself), the socket is non-blocking, and the call is
+ * abandoned cleanly at its own deadline (see nfscheck_set_rpc_timeout()).
+ *
+ * It only tells whether the NFS service of the server answers, not whether
+ * the export is usable, so it is meant as a cheap first step before the
+ * other methods. Over UDP, the call is retransmitted with an exponential
+ * backoff until the deadline.
+ */
+#define RPC_CALL		0
+#define RPC_REPLY		1
+#define RPC_VERSION		2
+#define RPC_MSG_ACCEPTED	0
+#define RPC_SUCCESS		0
+#define RPC_PROG_UNAVAIL	1
+#define RPC_PROG_MISMATCH	2
+#define RPC_PROG_NFS		100003
+#define RPC_LAST_FRAGMENT	0x80000000U
+
+static int rpc_timeout_ms = 1000;
+
+void nfscheck_set_rpc_timeout(const int ms)
+{
+	rpc_timeout_ms = ms;
+}
+
+/* Copy the value of a mount option ("name=value"). Returns 1 if it was found. */
+static int mount_option(const char *options, const char *name, char *buf, const size_t size)
+{
+	const size_t namelen = strlen(name);
+	const char *p = options;
+	const char *end;
+	size_t len;
+
+	while (p != NULL && *p != '\0') {
+		end = strchr(p, ',');
+		len = end != NULL ? (size_t)(end - p) : strlen(p);
+		if (len > namelen + 1 && strncmp(p, name, namelen) == 0 && p[namelen] == '=' &&
+		    len - namelen - 1 < size) {
+			memcpy(buf, p + namelen + 1, len - namelen - 1);
+			buf[len - namelen - 1] = '\0';
+			return 1;
+		}
+
+		p = end != NULL ? end + 1 : NULL;
+	}
+
+	return 0;
+}
+
+int nfscheck_mount_server(const char *source, const char *options, char *buf, const size_t size)
+{
+	const char *end;
+	const char *p;
+	size_t len;
+
+	/* already resolved by the kernel */
+	if (mount_option(options, "addr", buf, size)) {
+		return 0;
+	}
+
+	end = strstr(source, ":/");
+	if (end == NULL || end == source || (size_t)(end - source) >= size) {
+		return ENOENT;
+	}
+
+	/* an IPv6 address is enclosed in brackets */
+	p = source;
+	len = end - p;
+	if (p[0] == '[' && p[len - 1] == ']' && len > 2) {
+		p++;
+		len -= 2;
+	}
+
+	memcpy(buf, p, len);
+	buf[len] = '\0';
+	return 0;
+}
+
+/* Undo the octal escapes (such as "\040" for space) used in mountinfo */
+static void unescape_mountinfo(char *s)
+{
+	char *out = s;
+
+	while (*s != '\0') {
+		if (s[0] == '\\' && s[1] >= '0' && s[1] <= '3' &&
+		    s[2] >= '0' && s[2] <= '7' && s[3] >= '0' && s[3] <= '7') {
+			*out++ = (char)(((s[1] - '0') << 6) | ((s[2] - '0') << 3) | (s[3] - '0'));
+			s += 4;
+		} else {
+			*out++ = *s++;
+		}
+	}
+
+	*out = '\0';
+}
+
+/*
+ * 36 35 98:0 /mnt1 /mnt/parent rw,noatime master:1 - ext3 /dev/root rw,errors=continue
+ * (1)(2)(3)   (4)   (5)      (6)      (7)   (8) (9)   (10)         (11)
+ */
+int nfscheck_parse_mountinfo(char *line, struct nfscheck_mountinfo *entry)
+{
+	char *fields[5];
+	char *saveptr = NULL;
+	char *tok;
+	int n = 0;
+
+	memset(entry, 0, sizeof(*entry));
+	line[strcspn(line, "\n")] = '\0';
+
+	/* fields (1) to (5) */
+	while (n < 5 && (tok = strtok_r(n == 0 ? line : NULL, " ", &saveptr)) != NULL) {
+		fields[n++] = tok;
+	}
+
+	if (n < 5 || sscanf(fields[0], "%d", &entry->mount_id) != 1 ||
+	    sscanf(fields[2], "%u:%u", &entry->major, &entry->minor) != 2) {
+		return EINVAL;
+	}
+
+	entry->mountpoint = fields[4];
+
+	/* skip the mount options, and the optional fields, up to the separator */
+	while ((tok = strtok_r(NULL, " ", &saveptr)) != NULL) {
+		if (strcmp(tok, "-") == 0) {
+			break;
+		}
+	}
+
+	entry->fstype = strtok_r(NULL, " ", &saveptr);
+	entry->source = strtok_r(NULL, " ", &saveptr);
+	entry->options = strtok_r(NULL, " ", &saveptr);
+	if (entry->fstype == NULL || entry->source == NULL) {
+		return EINVAL;
+	}
+
+	if (entry->options == NULL) {
+		entry->options = "";
+	}
+
+	unescape_mountinfo(entry->mountpoint);
+	unescape_mountinfo(entry->source);
+	return 0;
+}
+
+/* Where to send the NULL call */
+struct rpc_target {
+	int nfs;
+	char server[256];
+	char port[16];
+	int version;
+	int tcp;
+};
+
+/*
+ * The absolute form of a path, for comparison with mount points: "//", "."
+ * and ".." are collapsed lexically, and trailing slashes stripped. The path
+ * itself is never looked up (nor are symbolic links resolved), since that
+ * could hang. Returns 0 on success, or an errno value.
+ */
+static int absolute_path(const char *path, char *buf, const size_t size)
+{
+	char cwd[PATH_MAX];
+	size_t in = 0;
+	size_t len = 0;
+	int ret;
+
+	if (path[0] == '/') {
+		ret = snprintf(buf, size, "%s", path);
+	} else if (getcwd(cwd, sizeof(cwd)) != NULL) {
+		ret = snprintf(buf, size, "%s/%s", cwd, path);
+	} else {
+		return errno;
+	}
+
+	if (ret < 0 || (size_t)ret >= size) {
+		return ENAMETOOLONG;
+	}
+
+	/* the result is never longer than the path, so it is built in place */
+	while (buf[in] != '\0') {
+		const char *name;
+		size_t namelen;
+
+		while (buf[in] == '/') {
+			in++;
+		}
+
+		name = buf + in;
+		namelen = strcspn(name, "/");
+		in += namelen;
+
+		if (namelen == 0 || (namelen == 1 && name[0] == '.')) {
+			continue;
+		}
+
+		if (namelen == 2 && name[0] == '.' && name[1] == '.') {
+			while (len > 0 && buf[--len] != '/') {
+			}
+
+			continue;
+		}
+
+		buf[len++] = '/';
+		memmove(buf + len, name, namelen);
+		len += namelen;
+	}
+
+	if (len == 0) {
+		buf[len++] = '/';
+	}
+
+	buf[len] = '\0';
+	return 0;
+}
+
+/*
+ * Find the mount of a path: the longest mount point in /proc/self/mountinfo
+ * which contains it (the last one, if several are stacked). The path itself
+ * is never looked up, since that could hang. Returns 0 on success, or an
+ * errno value.
+ */
+static int rpc_find_target(const char *path, struct rpc_target *target)
+{
+	char abspath[PATH_MAX];
+	char option[16];
+	char *line = NULL;
+	size_t linesize = 0;
+	size_t best = 0;
+	int found = 0;
+	size_t len;
+	FILE *f;
+	int ret;
+
+	ret = absolute_path(path, abspath, sizeof(abspath));
+	if (ret) {
+		return ret;
+	}
+
+	f = fopen("/proc/self/mountinfo", "re");
+	if (f == NULL) {
+		return errno;
+	}
+
+	/* 36 35 98:0 /mnt1 /mnt/parent rw,noatime master:1 - nfs4 filer1:/mnt1 rw,vers=4.2,addr=10.0.0.1 */
+	while (getline(&line, &linesize, f) >= 0) {
+		struct nfscheck_mountinfo entry;
+
+		if (nfscheck_parse_mountinfo(line, &entry) != 0) {
+			continue;
+		}
+
+		/* the mount point must contain the path, at a component boundary */
+		len = strlen(entry.mountpoint);
+		if (len < best || strncmp(abspath, entry.mountpoint, len) != 0 ||
+		    (len > 1 && abspath[len] != '\0' && abspath[len] != '/')) {
+			continue;
+		}
+
+		best = len;
+		found = 1;
+		memset(target, 0, sizeof(*target));
+		target->nfs = strcmp(entry.fstype, "nfs") == 0 || strcmp(entry.fstype, "nfs4") == 0;
+		if (!target->nfs) {
+			continue;
+		}
+
+		if (nfscheck_mount_server(entry.source, entry.options, target->server, sizeof(target->server))) {
+			target->nfs = 0;
+			continue;
+		}
+
+		/* the NFS service is always on port 2049, unless told otherwise */
+		if (!mount_option(entry.options, "port", target->port, sizeof(target->port)) ||
+		    strcmp(target->port, "0") == 0) {
+			strcpy(target->port, "2049");
+		}
+
+		/* such as vers=4.2: the minor version does not matter to the NULL procedure */
+		if (mount_option(entry.options, "vers", option, sizeof(option))) {
+			target->version = atoi(option);
+		} else {
+			target->version = strcmp(entry.fstype, "nfs4") == 0 ? 4 : 3;
+		}
+
+		target->tcp = !mount_option(entry.options, "proto", option, sizeof(option)) ||
+			      strncmp(option, "udp", 3) != 0;
+	}
+
+	free(line);
+	fclose(f);
+
+	if (!found || !target->nfs) {
+		nfscheck_debug("%s is not on an NFS mount\n", abspath);
+		return NFSCHECK_EUNKNOWN;
+	}
+
+	return 0;
+}
+
+/* Wait for a socket to become ready, until the deadline. Returns 0, or an errno value. */
+static int rpc_wait(const int fd, const short events, const uint64_t deadline)
+{
+	struct pollfd pfd = { .fd = fd, .events = events, };
+	uint64_t now;
+	int ret;
+
+	while ((now = nfscheck_now()) < deadline) {
+		ret = poll(&pfd, 1, (int)((deadline - now + 999999) / 1000000));
+		if (ret > 0) {
+			return 0;
+		}
+
+		if (ret < 0 && errno != EINTR) {
+			return errno;
+		}
+	}
+
+	return ETIMEDOUT;
+}
+
+/*
+ * Check the reply to a NULL call. Returns 0 if the call succeeded, -1 if this
+ * is not a reply to the call, or an errno value.
+ */
+static int rpc_check_reply(const uint32_t *reply, const size_t len, const uint32_t xid)
+{
+	uint32_t verflen;
+	size_t stat;
+
+	if (len < 3 * 4 || ntohl(reply[0]) != xid || ntohl(reply[1]) != RPC_REPLY) {
+		return -1;
+	}
+
+	if (ntohl(reply[2]) != RPC_MSG_ACCEPTED) {
+		nfscheck_debug("NULL call denied by the server\n");
+		return EACCES;
+	}
+
+	/* skip the verifier (flavor, length and body) */
+	verflen = len >= 5 * 4 ? ntohl(reply[4]) : UINT32_MAX;
+	stat = 5 + (verflen / 4) + (verflen % 4 != 0);
+	if (verflen > 400 || len < (stat + 1) * 4) {
+		return EPROTO;
+	}
+
+	switch (ntohl(reply[stat])) {
+	case RPC_SUCCESS:
+		return 0;
+	case RPC_PROG_UNAVAIL:
+	case RPC_PROG_MISMATCH:
+		nfscheck_debug("NFS version not supported by the server\n");
+		return EPROTONOSUPPORT;
+	default:
+		return EPROTO;
+	}
+}
+
+/* Perform the call over TCP, with a record mark */
+static int rpc_call_tcp(const int fd, const uint32_t *call, const uint32_t xid, const uint64_t deadline)
+{
+	uint32_t reply[128];
+	size_t need = 4;
+	size_t got = 0;
+	ssize_t n;
+	int ret;
+
+	n = send(fd, call, 11 * 4, MSG_NOSIGNAL);
+	if (n < 0) {
+		return errno;
+	}
+
+	if (n != 11 * 4) {
+		return EPROTO;
+	}
+
+	while (got < need) {
+		ret = rpc_wait(fd, POLLIN, deadline);
+		if (ret) {
+			return ret;
+		}
+
+		n = recv(fd, (char *)reply + got, need - got, 0);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				continue;
+			}
+
+			return errno;
+		}
+
+		if (n == 0) {
+			return ECONNRESET;
+		}
+
+		got += n;
+		if (got == 4) {
+			/* a reply to a NULL call is always a single, small fragment */
+			need += ntohl(reply[0]) & ~RPC_LAST_FRAGMENT;
+			if (!(ntohl(reply[0]) & RPC_LAST_FRAGMENT) || need > sizeof(reply)) {
+				return EPROTO;
+			}
+		}
+	}
+
+	ret = rpc_check_reply(reply + 1, need - 4, xid);
+	return ret < 0 ? EPROTO : ret;
+}
+
+/* Perform the call over UDP, retransmitting it until the deadline */
+static int rpc_call_udp(const int fd, const uint32_t *call, const uint32_t xid, const uint64_t deadline)
+{
+	uint64_t interval = 100 * 1000000ULL;
+	uint64_t resend = 0;
+	uint32_t reply[128];
+	ssize_t n;
+	int ret;
+
+	for (;;) {
+		const uint64_t now = nfscheck_now();
+
+		if (now >= resend) {
+			if (send(fd, call + 1, 10 * 4, 0) < 0 && errno != EAGAIN) {
+				return errno;
+			}
+
+			resend = now + interval;
+			interval *= 2;
+		}
+
+		ret = rpc_wait(fd, POLLIN, resend < deadline ? resend : deadline);
+		if (ret == ETIMEDOUT && resend < deadline) {
+			continue;
+		}
+
+		if (ret) {
+			return ret;
+		}
+
+		/* refused, if an ICMP port unreachable came back */
+		n = recv(fd, reply, sizeof(reply), 0);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EINTR) {
+				continue;
+			}
+
+			return errno;
+		}
+
+		/* ignore the replies to earlier transmissions of other checks */
+		ret = rpc_check_reply(reply, n, xid);
+		if (ret >= 0) {
+			return ret;
+		}
+	}
+}
+
+static int check_mountpoint_rpc_null(const char *path, struct nfscheck_result *result, void *arg)
+{
+	const uint64_t deadline = nfscheck_now() + (uint64_t)rpc_timeout_ms * 1000000;
+	struct rpc_target target;
+	struct addrinfo hints;
+	struct addrinfo *ai = NULL;
+	uint32_t call[11];
+	socklen_t len;
+	uint32_t xid;
+	uint64_t t;
+	int fd = -1;
+	int ret;
+
+	(void)arg;
+
+	t = nfscheck_now();
+	ret = rpc_find_target(path, &target);
+	if (ret) {
+		nfscheck_phase_done(result, NFSCHECK_PHASE_RPC_NULL_CONNECT, &t);
+		return ret;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = target.tcp ? SOCK_STREAM : SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	ret = getaddrinfo(target.server, target.port, &hints, &ai);
+	if (ret) {
+		nfscheck_phase_done(result, NFSCHECK_PHASE_RPC_NULL_CONNECT, &t);
+		nfscheck_debug("unable to resolve %s: %s\n", target.server, gai_strerror(ret));
+		return NFSCHECK_EUNKNOWN;
+	}
+
+	fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		ret = errno;
+		nfscheck_phase_done(result, NFSCHECK_PHASE_RPC_NULL_CONNECT, &t);
+		nfscheck_debug("socket failed: %s\n", strerror(ret));
+		goto out;
+	}
+
+	/* a connected UDP socket reports ICMP errors too */
+	if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+		ret = errno == EINPROGRESS ? rpc_wait(fd, POLLOUT, deadline) : errno;
+		len = sizeof(ret);
+		if (ret == 0 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &ret, &len) < 0) {
+			ret = errno;
+		}
+	}
+
+	nfscheck_phase_done(result, NFSCHECK_PHASE_RPC_NULL_CONNECT, &t);
+	if (ret) {
+		nfscheck_debug("connect to %s port %s failed: %s\n", target.server, target.port, strerror(ret));
+		goto out;
+	}
+
+	xid = (uint32_t)t ^ ((uint32_t)syscall(__NR_gettid) << 16);
+	call[0] = htonl(RPC_LAST_FRAGMENT | (10 * 4));
+	call[1] = htonl(xid);
+	call[2] = htonl(RPC_CALL);
+	call[3] = htonl(RPC_VERSION);
+	call[4] = htonl(RPC_PROG_NFS);
+	call[5] = htonl(target.version);
+	call[6] = htonl(0);
+	/* AUTH_NONE credentials and verifier */
+	call[7] = call[8] = call[9] = call[10] = 0;
+
+	if (target.tcp) {
+		ret = rpc_call_tcp(fd, call, xid, deadline);
+	} else {
+		ret = rpc_call_udp(fd, call, xid, deadline);
+	}
+
+	nfscheck_phase_done(result, NFSCHECK_PHASE_RPC_NULL_CALL, &t);
+	if (ret) {
+		nfscheck_debug("NULL call to %s port %s failed: %s\n", target.server, target.port, strerror(ret));
+	}
+
+out:
+	if (fd >= 0) {
+		close(fd);
+	}
+
+	freeaddrinfo(ai);
+	return ret;
+}
+
+/*
+ * Check an NFS mountpoint using the mountstats method.
+ *
+ * - Find the mount of the path in /proc/self/mountstats
+ * - Compare its RPC statistics with those of the previous check of the path
+ *
+ * This method is passive: the NFS client already counts, for every mount,
+ * the RPC transmissions of each operation and the time taken to answer them,
+ * so this costs no NFS traffic at all, and it cannot hang. The check fails
+ * with ETIMEDOUT when too many transmissions since the previous check of the
+ * path were retransmissions (after an RPC timeout), or with ETIME when the
+ * server took too long to answer them on average (see
+ * nfscheck_set_mountstats_limits()). With no previous check in this
+ * process, the statistics since the mount are used instead.
+ *
+ * The operations are counted once they complete, so a server which stopped
+ * answering altogether leaves the statistics unchanged: this detects a
+ * degraded server, but an active method is needed to detect a hung one.
+ *
+ * The file is read in a single pass, a line at a time: it may be several
+ * megabytes on a node with many mounts.
+ */
+struct mountstats_sample {
+	uint64_t ops;
+	uint64_t trans;
+	uint64_t timeouts;
+	uint64_t rtt_ms;
+	uint64_t sends;
+	uint64_t backlog;
+};
+
+/* The last sample of every path checked by this process */
+struct mountstats_history {
+	char *path;
+	struct mountstats_sample sample;
+};
+
+static double mountstats_max_retrans = 5.0;
+static int mountstats_max_rtt_ms = 1000;
+static pthread_mutex_t mountstats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct mountstats_history *mountstats_history = NULL;
+static int mountstats_nhistory = 0;
+
+void nfscheck_set_mountstats_limits(const double retrans_pct, const int rtt_ms)
+{
+	mountstats_max_retrans = retrans_pct;
+	mountstats_max_rtt_ms = rtt_ms;
+}
+
+/*
+ * Add up the statistics of a transport:
+ * xprt: tcp <port> <bind> <connect> <connect time> <idle> <sends> <recvs> <bad xids> <req> <backlog> ...
+ * xprt: udp <port> <bind> <sends> <recvs> <bad xids> <req> <backlog> ...
+ */
+static void mountstats_parse_xprt(char *line, struct mountstats_sample *sample)
+{
+	unsigned long long v[10];
+	char proto[16];
+	int sends;
+	int n;
+
+	n = sscanf(line, " xprt: %15s %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu", proto,
+		   &v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7], &v[8], &v[9]);
+	if (n < 1) {
+		return;
+	}
+
+	/* the protocol, and every value up to the backlog */
+	sends = strcmp(proto, "udp") == 0 ? 2 : 5;
+	if (n < sends + 6) {
+		return;
+	}
+
+	sample->sends += v[sends];
+	sample->backlog += v[sends + 4];
+}
+
+/* Add up the statistics of an operation: <name>: <ops> <trans> <timeouts> <sent> <recv> <queue> <rtt> <execute> ... */
+static void mountstats_parse_op(char *line, struct mountstats_sample *sample)
+{
+	unsigned long long ops, trans, timeouts, sent, recv, queue, rtt;
+	char *colon = strchr(line, ':');
+
+	if (colon == NULL || sscanf(colon + 1, "%llu %llu %llu %llu %llu %llu %llu",
+				    &ops, &trans, &timeouts, &sent, &recv, &queue, &rtt) != 7) {
+		return;
+	}
+
+	sample->ops += ops;
+	sample->trans += trans;
+	sample->timeouts += timeouts;
+	sample->rtt_ms += rtt;
+}
+
+/*
+ * Read the statistics of the mount of a path (the longest mount point which
+ * contains it, and the last one if several are stacked). The path itself is
+ * never looked up. Returns 0 on success, or an errno value.
+ */
+static int mountstats_read(const char *path, struct mountstats_sample *sample)
+{
+	struct mountstats_sample current;
+	char *line = NULL;
+	size_t linesize = 0;
+	size_t best = 0;
+	int found = 0;
+	int nfs = 0;
+	int in_mount = 0;
+	int in_ops = 0;
+	FILE *f;
+
+	f = fopen("/proc/self/mountstats", "re");
+	if (f == NULL) {
+		return errno;
+	}
+
+	memset(&current, 0, sizeof(current));
+
+	/* device filer1:/export mounted on /mnt/data with fstype nfs4 statvers=1.1 */
+	while (getline(&line, &linesize, f) >= 0) {
+		char *mountpoint;
+		char *fstype;
+		size_t len;
+
+		if (strncmp(line, "device ", 7) != 0) {
+			if (!in_mount) {
+				continue;
+			}
+
+			if (strstr(line, "xprt:") != NULL) {
+				mountstats_parse_xprt(line, &current);
+			} else if (strstr(line, "per-op statistics") != NULL) {
+				in_ops = 1;
+			} else if (in_ops) {
+				mountstats_parse_op(line, &current);
+			}
+
+			continue;
+		}
+
+		/* the end of the mount which was being read, if any */
+		if (in_mount) {
+			*sample = current;
+			in_mount = 0;
+		}
+
+		in_ops = 0;
+		mountpoint = strstr(line, " mounted on ");
+		fstype = strstr(line, " with fstype ");
+		if (mountpoint == NULL || fstype == NULL || fstype < mountpoint) {
+			continue;
+		}
+
+		mountpoint += strlen(" mounted on ");
+		*fstype = '\0';
+		fstype += strlen(" with fstype ");
+
+		/* the mount point must contain the path, at a component boundary */
+		unescape_mountinfo(mountpoint);
+		len = strlen(mountpoint);
+		if (len < best || strncmp(path, mountpoint, len) != 0 ||
+		    (len > 1 && path[len] != '\0' && path[len] != '/')) {
+			continue;
+		}
+
+		best = len;
+		found = 1;
+		nfs = (strncmp(fstype, "nfs ", 4) == 0 || strncmp(fstype, "nfs4 ", 5) == 0) &&
+		      strstr(fstype, "statvers=") != NULL;
+		if (nfs) {
+			memset(&current, 0, sizeof(current));
+			in_mount = 1;
+		}
+	}
+
+	if (in_mount) {
+		*sample = current;
+	}
+
+	free(line);
+	fclose(f);
+
+	if (!found || !nfs) {
+		nfscheck_debug("%s is not on an NFS mount\n", path);
+		return NFSCHECK_EUNKNOWN;
+	}
+
+	return 0;
+}
+
+/*
+ * Remember the sample of a path, and return the previous one (all zeroes if
+ * there is none, or if the counters went backwards, when the path was
+ * mounted again).
+ */
+static void mountstats_exchange(const char *path, const struct mountstats_sample *sample,
+				struct mountstats_sample *prev)
+{
+	struct mountstats_history *tmp;
+	int i;
+
+	memset(prev, 0, sizeof(*prev));
+
+	pthread_mutex_lock(&mountstats_lock);
+	for (i = 0; i < mountstats_nhistory; i++) {
+		if (strcmp(mountstats_history[i].path, path) == 0) {
+			break;
+		}
+	}
+
+	if (i < mountstats_nhistory) {
+		if (mountstats_history[i].sample.ops <= sample->ops &&
+		    mountstats_history[i].sample.trans <= sample->trans) {
+			*prev = mountstats_history[i].sample;
+		}
+
+		mountstats_history[i].sample = *sample;
+	} else {
+		tmp = realloc(mountstats_history, (mountstats_nhistory + 1) * sizeof(*tmp));
+		if (tmp != NULL) {
+			mountstats_history = tmp;
+			tmp[mountstats_nhistory].path = strdup(path);
+			tmp[mountstats_nhistory].sample = *sample;
+			if (tmp[mountstats_nhistory].path != NULL) {
+				mountstats_nhistory++;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&mountstats_lock);
+}
+
+static int check_mountpoint_mountstats(const char *path, struct nfscheck_result *result, void *arg)
+{
+	struct mountstats_sample sample;
+	struct mountstats_sample prev;
+	uint64_t t = nfscheck_now();
+	char abspath[PATH_MAX];
+	uint64_t ops;
+	double retrans;
+	double rtt_ms;
+	int ret;
+
+	(void)arg;
+
+	ret = absolute_path(path, abspath, sizeof(abspath));
+	if (ret == 0) {
+		ret = mountstats_read(abspath, &sample);
+	}
+
+	nfscheck_phase_done(result, NFSCHECK_PHASE_MOUNTSTATS_READ, &t);
+	if (ret) {
+		return ret;
+	}
+
+	mountstats_exchange(abspath, &sample, &prev);
+
+	/* no operation completed since the previous check: nothing to judge */
+	ops = sample.ops - prev.ops;
+	if (ops == 0) {
+		nfscheck_debug("mountstats of %s: no operations\n", abspath);
+		return 0;
+	}
+
+	retrans = sample.trans - prev.trans > ops ?
+		  100.0 * (double)(sample.trans - prev.trans - ops) / ops : 0.0;
+	rtt_ms = (double)(sample.rtt_ms - prev.rtt_ms) / ops;
+	nfscheck_debug("mountstats of %s: %llu operations, %.2f%% retransmitted, %llu major timeouts, "
+		       "%.3f ms average RTT, %.2f average backlog\n", abspath, (unsigned long long)ops,
+		       retrans, (unsigned long long)(sample.timeouts - prev.timeouts), rtt_ms,
+		       sample.sends > prev.sends ?
+		       (double)(sample.backlog - prev.backlog) / (sample.sends - prev.sends) : 0.0);
+
+	if (mountstats_max_retrans > 0 && retrans >= mountstats_max_retrans) {
+		return ETIMEDOUT;
+	}
+
+	if (mountstats_max_rtt_ms > 0 && rtt_ms >= mountstats_max_rtt_ms) {
+		return ETIME;
+	}
+
+	return 0;
+}
+
+/*
+ * The registered check methods: the built in methods come first, followed by
+ * the user registered ones. User methods are timed as a whole.
+ *
+ * Only statx (AT_STATX_FORCE_SYNC), write (fdatasync) and rpc-null (which
+ * bypasses the client entirely) force a round trip to the server: the others
+ * may be answered from the attribute and page caches of the client (see
+ * above), at least for a while. The rpc-null method comes first, so that it
+ * is performed before statx (the other cheap method) by default.
+ */
+struct method_entry {
+	struct nfscheck_method info;
+	int method;
+	int user;
+};
+
+static struct method_entry methods[NFSCHECK_METHOD_MAX] = {
+	{
+		{ "mountstats", check_mountpoint_mountstats, NULL, NFSCHECK_COST_CHEAP, 0, },
+		NFSCHECK_METHOD_MOUNTSTATS, 0,
+	},
+	{
+		{ "rpc-null", check_mountpoint_rpc_null, NULL, NFSCHECK_COST_CHEAP, 1, },
+		NFSCHECK_METHOD_RPC_NULL, 0,
+	},
+	{
+		{ "statx", check_mountpoint_statx, NULL, NFSCHECK_COST_CHEAP, 1, },
+		NFSCHECK_METHOD_STATX, 0,
+	},
+	{
+		{ "stat", check_mountpoint_stat, NULL, NFSCHECK_COST_MODERATE, 0, },
+		NFSCHECK_METHOD_STAT, 0,
+	},
+	{
+		{ "readdir", check_mountpoint_readdir, NULL, NFSCHECK_COST_EXPENSIVE, 0, },
+		NFSCHECK_METHOD_READDIR, 0,
+	},
+	{
+		{ "readdir-raw", check_mountpoint_readdir_raw, NULL, NFSCHECK_COST_MODERATE, 0, },
+		NFSCHECK_METHOD_READDIR_RAW, 0,
+	},
+	{
+		{ "write", check_mountpoint_write, NULL, NFSCHECK_COST_EXPENSIVE, 1, },
+		NFSCHECK_METHOD_WRITE, 0,
+	},
+};
+
+static int nmethods = 7;
+
+static const struct method_entry *method_entry(const int method)
+{
+	int i;
+
+	for (i = 0; i < nmethods; i++) {
+		if (methods[i].method == method) {
+			return &methods[i];
+		}
+	}
+
+	return NULL;
+}
+
+int nfscheck_register_method(const struct nfscheck_method *method)
+{
+	int used = 0;
+	int bit;
+	int i;
+
+	if (method == NULL || method->name == NULL || method->check == NULL ||
+	    (int)method->cost < NFSCHECK_COST_CHEAP || method->cost > NFSCHECK_COST_EXPENSIVE) {
+		return -EINVAL;
+	}
+
+	if (nfscheck_method_lookup(method->name) != 0) {
+		return -EEXIST;
+	}
+
+	if (nmethods == NFSCHECK_METHOD_MAX) {
+		return -ENOSPC;
+	}
+
+	for (i = 0; i < nmethods; i++) {
+		used |= methods[i].method;
+	}
+
+	/* the lowest unused bit */
+	for (bit = 1; used & bit; bit <<= 1) {
+		;
+	}
+
+	methods[nmethods].info = *method;
+	methods[nmethods].method = bit;
+	methods[nmethods].user = 1;
+	nmethods++;
+	return bit;
+}
+
+int nfscheck_method_lookup(const char *name)
+{
+	int i;
+
+	for (i = 0; i < nmethods; i++) {
+		if (strcasecmp(methods[i].info.name, name) == 0) {
+			return methods[i].method;
+		}
+	}
+
+	return 0;
+}
+
+const char *nfscheck_method_name(const int method)
+{
+	const struct method_entry *entry = method_entry(method);
+
+	return entry != NULL ? entry->info.name : NULL;
+}
+
+const struct nfscheck_method *nfscheck_method_info(const int method)
+{
+	const struct method_entry *entry = method_entry(method);
+
+	return entry != NULL ? &entry->info : NULL;
+}
+
+int nfscheck_format_methods(const int method, char *buf, const size_t size)
+{
+	const char *sep = "";
+	size_t len = 0;
+	int i;
+
+	if (size > 0) {
+		buf[0] = '\0';
+	}
+
+	for (i = 0; i < nmethods; i++) {
+		if (method & methods[i].method) {
+			const int ret = snprintf(buf + len, len < size ? size - len : 0, "%s%s",
+						 sep, methods[i].info.name);
+			if (ret < 0) {
+				return ret;
+			}
+
+			len += ret;
+			sep = ",";
+		}
+	}
+
+	return len;
+}
+
+int nfscheck_parse_methods(const char *s, int *result)
+{
+	char *copy = strdup(s);
+	char *save = NULL;
+	char *tok;
+	int ret = 0;
+
+	if (copy == NULL) {
+		return ENOMEM;
+	}
+
+	*result = 0;
+	for (tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+		const int method = nfscheck_method_lookup(tok);
+
+		if (method == 0) {
+			ret = EINVAL;
+			break;
+		}
+
+		*result |= method;
+	}
+
+	free(copy);
+	return ret;
+}
+
+void nfscheck_plan_init(struct nfscheck_plan *plan, const int method)
+{
+	int cost;
+	int i;
+
+	memset(plan, 0, sizeof(*plan));
+
+	/* stable: methods of the same cost are in the order of registration */
+	for (cost = NFSCHECK_COST_CHEAP; cost <= NFSCHECK_COST_EXPENSIVE; cost++) {
+		for (i = 0; i < nmethods; i++) {
+			if ((method & methods[i].method) && (int)methods[i].info.cost == cost) {
+				plan->steps[plan->nsteps++].method = methods[i].method;
+			}
+		}
+	}
+}
+
+int nfscheck_plan_methods(const struct nfscheck_plan *plan)
+{
+	int method = 0;
+	int i;
+
+	for (i = 0; i < plan->nsteps; i++) {
+		method |= plan->steps[i].method;
+	}
+
+	return method;
+}
+
+int nfscheck_parse_plan(const char *s, struct nfscheck_plan *plan)
+{
+	char *copy = strdup(s);
+	char *save = NULL;
+	char *tok;
+	int ret = 0;
+
+	if (copy == NULL) {
+		return ENOMEM;
+	}
+
+	memset(plan, 0, sizeof(*plan));
+	for (tok = strtok_r(copy, ",", &save); tok != NULL; tok = strtok_r(NULL, ",", &save)) {
+		struct nfscheck_step *step = &plan->steps[plan->nsteps];
+		char *escalate = strchr(tok, '@');
+
+		if (plan->nsteps == NFSCHECK_METHOD_MAX) {
+			ret = EINVAL;
+			break;
+		}
+
+		/* there is nothing to escalate from in the first step */
+		if (escalate != NULL) {
+			*escalate++ = '\0';
+			if (plan->nsteps == 0 || nfscheck_parse_duration(escalate, &step->escalate_ms) != 0) {
+				ret = EINVAL;
+				break;
+			}
+		}
+
+		step->method = nfscheck_method_lookup(tok);
+		if (step->method == 0 || (nfscheck_plan_methods(plan) & step->method)) {
+			ret = EINVAL;
+			break;
+		}
+
+		plan->nsteps++;
+	}
+
+	free(copy);
+	return ret;
+}
+
+int nfscheck_format_performed(const struct nfscheck_plan *plan, const int methods, char *buf, const size_t size)
+{
+	const char *sep = "";
+	size_t len = 0;
+	int i;
+
+	if (size > 0) {
+		buf[0] = '\0';
+	}
+
+	for (i = 0; i < plan->nsteps; i++) {
+		const int method = plan->steps[i].method;
+		int ret;
+
+		if (!(methods & method)) {
+			continue;
+		}
+
+		ret = snprintf(buf + len, len < size ? size - len : 0, "%s%s", sep, nfscheck_method_name(method));
+		if (ret < 0) {
+			return ret;
+		}
+
+		len += ret;
+		sep = ",";
+	}
+
+	return len;
+}
+
+int nfscheck_format_plan(const struct nfscheck_plan *plan, char *buf, const size_t size)
+{
+	size_t len = 0;
+	int i;
+
+	if (size > 0) {
+		buf[0] = '\0';
+	}
+
+	for (i = 0; i < plan->nsteps; i++) {
+		const struct nfscheck_step *step = &plan->steps[i];
+		const char *name = nfscheck_method_name(step->method);
+		int ret;
+
+		if (step->escalate_ms > 0) {
+			ret = snprintf(buf + len, len < size ? size - len : 0, "%s%s@%dms",
+				       i ? "," : "", name, step->escalate_ms);
+		} else {
+			ret = snprintf(buf + len, len < size ? size - len : 0, "%s%s",
+				       i ? "," : "", name);
+		}
+
+		if (ret < 0) {
+			return ret;
+		}
+
+		len += ret;
+	}
+
+	return len;
+}
+
+/* Record the verdict of a method which completed */
+static void method_done(struct nfscheck_result *result, const struct method_entry *entry,
+			const int ret, const uint64_t elapsed)
+{
+	const int index = __builtin_ctz(entry->method);
+
+	result->completed |= entry->method;
+	result->method_error[index] = ret;
+	result->method_ns[index] = elapsed;
+}
+
+/*
+ * A parallel check, shared by the caller and the threads of its methods:
+ * whichever is the last to let go frees it.
+ */
+struct parallel_check {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int refs;
+	int running;
+	int error;
+	char *path;
+	struct nfscheck_result result;
+};
+
+/* A method of a parallel check, performed by its own thread */
+struct parallel_method {
+	struct parallel_check *pc;
+	const struct method_entry *entry;
+};
+
+/* Drop a reference to a parallel check (with its lock held), unlocking it */
+static void parallel_put(struct parallel_check *pc)
+{
+	const int refs = --pc->refs;
+
+	pthread_mutex_unlock(&pc->lock);
+	if (refs == 0) {
+		pthread_cond_destroy(&pc->cond);
+		pthread_mutex_destroy(&pc->lock);
+		free(pc->path);
+		free(pc);
+	}
+}
+
+/* Perform a method of a parallel check, and merge its result into the check */
+static void parallel_perform(struct parallel_check *pc, const struct method_entry *entry)
+{
+	struct nfscheck_result result;
+	uint64_t t = nfscheck_now();
+	int ret;
+	int i;
+
+	memset(&result, 0, sizeof(result));
+
+	nfscheck_debug("before check_mountpoint %s\n", entry->info.name);
+	PROBE2(method__start, pc->path, entry->info.name);
+	ret = entry->info.check(pc->path, &result, entry->info.arg);
+	nfscheck_debug("check_mountpoint %s: ret=%d\n", entry->info.name, ret);
+	t = nfscheck_now() - t;
+	PROBE4(method__done, pc->path, entry->info.name, ret, t);
+
+	if (entry->user) {
+		result.phase_ns[NFSCHECK_PHASE_USER] += t;
+	}
+
+	pthread_mutex_lock(&pc->lock);
+	for (i = 0; i < NFSCHECK_PHASE_MAX; i++) {
+		pc->result.phase_ns[i] += result.phase_ns[i];
+	}
+
+	method_done(&pc->result, entry, ret, t);
+	if (ret && pc->error == 0) {
+		nfscheck_debug("check method %s failed: %d\n", entry->info.name, ret);
+		pc->error = ret;
+	}
+
+	pc->running--;
+	pthread_cond_signal(&pc->cond);
+}
+
+/* The main function of the thread of a method of a parallel check */
+static void *parallel_main(void *arg)
+{
+	struct parallel_method *pm = arg;
+	struct parallel_check *pc = pm->pc;
+
+	parallel_perform(pc, pm->entry);
+	parallel_put(pc);
+	nfscheck_fd_cache_flush();
+	free(pm);
+	return NULL;
+}
+
+/* Start a thread for a method of a parallel check. Returns 0 on success, else errno. */
+static int parallel_start(struct parallel_check *pc, const struct method_entry *entry)
+{
+	struct parallel_method *pm;
+	pthread_attr_t attr;
+	pthread_t thread;
+	sigset_t mask;
+	sigset_t old;
+	int ret;
+
+	pm = malloc(sizeof(*pm));
+	if (pm == NULL) {
+		return ENOMEM;
+	}
+
+	pm->pc = pc;
+	pm->entry = entry;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, PARALLEL_STACK_SIZE);
+
+	/* every signal is handled by the thread of the caller */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &old);
+	ret = pthread_create(&thread, &attr, parallel_main, pm);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	pthread_attr_destroy(&attr);
+
+	if (ret) {
+		free(pm);
+	}
+
+	return ret;
+}
+
+/* Perform the methods of a parallel plan (see nfscheck_check_plan()) */
+static int check_parallel(const char *path, const struct nfscheck_plan *plan,
+			  struct nfscheck_result *result)
+{
+	struct parallel_check *pc;
+	int ret;
+	int i;
+
+	pc = calloc(1, sizeof(*pc));
+	if (pc == NULL) {
+		return ENOMEM;
+	}
+
+	pc->path = strdup(path);
+	if (pc->path == NULL) {
+		free(pc);
+		return ENOMEM;
+	}
+
+	pthread_mutex_init(&pc->lock, NULL);
+	pthread_cond_init(&pc->cond, NULL);
+	pc->refs = 1;
+
+	pthread_mutex_lock(&pc->lock);
+	for (i = 0; i < plan->nsteps && pc->error == 0; i++) {
+		const struct method_entry *entry = method_entry(plan->steps[i].method);
+
+		if (entry == NULL) {
+			pc->error = EINVAL;
+			break;
+		}
+
+		pc->result.methods |= entry->method;
+		pc->running++;
+		pc->refs++;
+		if (parallel_start(pc, entry) == 0) {
+			continue;
+		}
+
+		/* no thread for this method: perform it in the calling thread */
+		pc->refs--;
+		pthread_mutex_unlock(&pc->lock);
+		parallel_perform(pc, entry);
+	}
+
+	/* until a method fails, or all of them succeed */
+	while (pc->running > 0 && pc->error == 0) {
+		pthread_cond_wait(&pc->cond, &pc->lock);
+	}
+
+	if (pc->running > 0) {
+		nfscheck_debug("%d check methods still running\n", pc->running);
+	}
+
+	*result = pc->result;
+	ret = pc->error;
+	parallel_put(pc);
+	return ret;
+}
+
+/*
+ * Check a NFS mount point to see if it is working, stale, or hung.
+ *
+ * We attempt to avoid hangs or stalls in this process, but that is not always
+ * possible. We also attempt to detect server-side failures quickly, however
+ * the Linux Kernel NFS client has several attribute caches which cannot be
+ * bypassed. It may take several minutes for the Linux Kernel NFS client to
+ * notice that the server has hung, or that the mount point has become stale.
+ *
+ * This behavior varies widely across Linux Kernel versions. Older Kernel
+ * versions are especially bad (they take up to minutes to notice that the
+ * server has crashed).
+ *
+ * Please read "man 5 nfs" very carefully, especially the section
+ * titled "DATA AND METADATA COHERENCE".
+ */
+int nfscheck_check_plan(const char *path, const struct nfscheck_plan *plan,
+			struct nfscheck_result *result)
+{
+	int ret = 0;
+	int i;
+
+	memset(result, 0, sizeof(*result));
+
+	if (plan->parallel) {
+		ret = check_parallel(path, plan, result);
+		result->error = ret;
+		return ret;
+	}
+
+	for (i = 0; i < plan->nsteps && ret == 0; i++) {
+		const struct nfscheck_step *step = &plan->steps[i];
+		const struct method_entry *entry = method_entry(step->method);
+		uint64_t t;
+
+		if (entry == NULL) {
+			ret = EINVAL;
+			break;
+		}
+
+		/* the previous steps were quick enough: no need to escalate */
+		if (step->escalate_ms > 0 &&
+		    nfscheck_result_latency(result) < (uint64_t)step->escalate_ms * 1000000) {
+			nfscheck_debug("check method %s not needed\n", entry->info.name);
+			continue;
+		}
+
+		nfscheck_debug("before check_mountpoint %s\n", entry->info.name);
+		PROBE2(method__start, path, entry->info.name);
+		t = nfscheck_now();
+		ret = entry->info.check(path, result, entry->info.arg);
+		nfscheck_debug("check_mountpoint %s: ret=%d\n", entry->info.name, ret);
+		result->methods |= entry->method;
+		t = nfscheck_now() - t;
+		PROBE4(method__done, path, entry->info.name, ret, t);
+		method_done(result, entry, ret, t);
+
+		if (entry->user) {
+			result->phase_ns[NFSCHECK_PHASE_USER] += t;
+		}
+
+		if (ret) {
+			nfscheck_debug("check method %s failed: %d\n", entry->info.name, ret);
+		}
+	}
+
+	result->error = ret;
+	return ret;
+}
+
+int nfscheck_check(const char *path, const int check_method, struct nfscheck_result *result)
+{
+	struct nfscheck_plan plan;
+
+	nfscheck_plan_init(&plan, check_method);
+	return nfscheck_check_plan(path, &plan, result);
+}
+
+/*
+ * Parse a duration into milliseconds. A plain number is in seconds (possibly
+ * fractional, such as "0.25"), or the unit may be given as a suffix, such as
+ * "250ms" or "2s". Returns 0 on success, or EINVAL if the value is bogus.
+ */
+int nfscheck_parse_duration(const char *s, int *ms)
+{
+	char *end = NULL;
+	double ret = 0;
+
+	errno = 0;
+	ret = strtod(s, &end);
+	if (s == end || errno == ERANGE || !isfinite(ret) || ret < 0) {
+		return EINVAL;
+	}
+
+	if (strcmp(end, "ms") == 0) {
+		/* already in milliseconds */
+	} else if (strcmp(end, "s") == 0 || *end == '\0') {
+		ret *= 1000;
+	} else {
+		return EINVAL;
+	}
+
+	if (ret > INT_MAX) {
+		return EINVAL;
+	}
+
+	/* zero means "disabled": a positive duration is at least 1 ms */
+	*ms = (int)(ret + 0.5);
+	if (*ms == 0 && ret > 0) {
+		*ms = 1;
+	}
+
+	return 0;
+}
+
+/* vim: set ts=8 sts=8 sw=8 noet: */
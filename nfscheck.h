@@ -0,0 +1,378 @@
+/*
+ * libnfscheck: check NFS mounts to make sure they are working correctly
+ * (neither hung, nor stale), from within any program.
+ *
+ * Copyright 2019 Ira W. Snyder <isnyder@lco.global>
+ * Copyright 2019 William Lindstrom <llindstrom@lco.global>
+ * Copyright 2019 Las Cumbres Observatory <https://lco.global/>
+ *
+ * There are two ways to use this library:
+ *
+ * - nfscheck_check() checks a mount synchronously, in the calling thread.
+ *   It may hang forever if the mount is hung, so it is meant to be called
+ *   from a process (or thread) which can be abandoned, such as a child
+ *   process with a deadline.
+ *
+ * - A context (struct nfscheck_ctx) checks mounts asynchronously on a pool
+ *   of threads, with a deadline per check. It never forks, never blocks the
+ *   caller, and never calls exit(). It is driven by the caller's own event
+ *   loop: wait for nfscheck_fd() to become readable, then collect the
+ *   completed checks with nfscheck_poll().
+ *
+ * Every function returns an errno value (or sets errno) on failure.
+ */
+
+#ifndef NFSCHECK_H
+#define NFSCHECK_H
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Status code which means "we were unable to determine the status of the
+ * mountpoint." There is no errno code for this situation.
+ */
+#define NFSCHECK_EUNKNOWN 255
+
+/* The built in check methods, which may be combined */
+#define NFSCHECK_METHOD_STAT		0x1
+#define NFSCHECK_METHOD_READDIR		0x2
+#define NFSCHECK_METHOD_READDIR_RAW	0x4
+#define NFSCHECK_METHOD_STATX		0x8
+#define NFSCHECK_METHOD_WRITE		0x10
+#define NFSCHECK_METHOD_RPC_NULL	0x20
+#define NFSCHECK_METHOD_MOUNTSTATS	0x40
+
+/* Maximum number of check methods, including those registered by the user */
+#define NFSCHECK_METHOD_MAX 16
+
+/*
+ * Phases of the built in check methods, which are timed individually. A
+ * user registered method is timed as a whole, in NFSCHECK_PHASE_USER.
+ */
+enum nfscheck_phase {
+	NFSCHECK_PHASE_STATX_STATX,
+	NFSCHECK_PHASE_STAT_OPEN,
+	NFSCHECK_PHASE_STAT_FSTAT,
+	NFSCHECK_PHASE_STAT_CLOSE,
+	NFSCHECK_PHASE_READDIR_OPENDIR,
+	NFSCHECK_PHASE_READDIR_READDIR,
+	NFSCHECK_PHASE_READDIR_CLOSEDIR,
+	NFSCHECK_PHASE_READDIR_RAW_OPEN,
+	NFSCHECK_PHASE_READDIR_RAW_GETDENTS,
+	NFSCHECK_PHASE_READDIR_RAW_CLOSE,
+	NFSCHECK_PHASE_WRITE_OPEN,
+	NFSCHECK_PHASE_WRITE_PWRITE,
+	NFSCHECK_PHASE_WRITE_FDATASYNC,
+	NFSCHECK_PHASE_WRITE_CLOSE,
+	NFSCHECK_PHASE_WRITE_UNLINK,
+	NFSCHECK_PHASE_RPC_NULL_CONNECT,
+	NFSCHECK_PHASE_RPC_NULL_CALL,
+	NFSCHECK_PHASE_MOUNTSTATS_READ,
+	NFSCHECK_PHASE_USER,
+	NFSCHECK_PHASE_MAX,
+};
+
+/*
+ * The result of a check: the errno value (zero on success), the methods which
+ * were actually performed, and the time taken by every phase which was
+ * reached (in nanoseconds, zero for phases which were never reached).
+ *
+ * Every method also has its own verdict: the methods which completed, and the
+ * errno value and time taken by each of them, at the index of its bit (method
+ * 1 << i is at index i). A method which was performed but did not complete
+ * was still running when a parallel check returned.
+ */
+struct nfscheck_result {
+	int error;
+	int methods;
+	int completed;
+	int method_error[NFSCHECK_METHOD_MAX];
+	uint64_t method_ns[NFSCHECK_METHOD_MAX];
+	uint64_t phase_ns[NFSCHECK_PHASE_MAX];
+};
+
+/*
+ * How expensive a check method is (for the server, as well as the client).
+ * When no order is given, the cheapest methods are performed first.
+ */
+enum nfscheck_cost {
+	NFSCHECK_COST_CHEAP,
+	NFSCHECK_COST_MODERATE,
+	NFSCHECK_COST_EXPENSIVE,
+};
+
+/*
+ * A check method. The check function returns zero on success, or an errno
+ * value. It may record its own phase timings. A method which forces a round
+ * trip to the server cannot be answered from the caches of the NFS client.
+ */
+struct nfscheck_method {
+	const char *name;
+	int (*check)(const char *path, struct nfscheck_result *result, void *arg);
+	void *arg;
+	enum nfscheck_cost cost;
+	int round_trip;
+};
+
+/*
+ * A check plan: the methods to perform, in order, until one of them fails.
+ * A step with an escalation threshold is only performed if the previous
+ * steps took at least that long in total, so that an expensive method only
+ * runs when a cheap one hints at a problem.
+ *
+ * The methods of a parallel plan are all performed at the same time, each in
+ * its own thread, until one of them fails or all of them succeed (there is
+ * no escalation). The check then returns at once, leaving the methods which
+ * are still running behind: their threads exit whenever they return.
+ */
+struct nfscheck_step {
+	int method;
+	int escalate_ms;
+};
+
+struct nfscheck_plan {
+	int nsteps;
+	struct nfscheck_step steps[NFSCHECK_METHOD_MAX];
+	int parallel;
+};
+
+/* Current time from the monotonic clock, in nanoseconds */
+uint64_t nfscheck_now(void);
+
+/*
+ * Record the time taken by a phase which started at *t, and start the next
+ * phase now. errno is preserved.
+ */
+void nfscheck_phase_done(struct nfscheck_result *result, enum nfscheck_phase phase, uint64_t *t);
+
+/* Name of a phase, such as "stat.open" */
+const char *nfscheck_phase_name(enum nfscheck_phase phase);
+
+/* Total time taken by all of the phases of a check */
+uint64_t nfscheck_result_latency(const struct nfscheck_result *result);
+
+/*
+ * Register a check method. This must be done before any check is started
+ * (and before any child process is created to perform checks). Returns the
+ * method (a bit to combine with the other methods), or a negative errno
+ * value.
+ */
+int nfscheck_register_method(const struct nfscheck_method *method);
+
+/* The method with the given name (case insensitive), or zero if there is none */
+int nfscheck_method_lookup(const char *name);
+
+/* Name of a single method, or NULL if there is no such method */
+const char *nfscheck_method_name(int method);
+
+/* Description of a single method, or NULL if there is no such method */
+const struct nfscheck_method *nfscheck_method_info(int method);
+
+/*
+ * Format methods as a comma separated list of names, in the order of the
+ * registry (that of nfscheck_plan_init()). Returns the length of the list,
+ * like snprintf().
+ */
+int nfscheck_format_methods(int methods, char *buf, size_t size);
+
+/*
+ * Parse a comma separated list of method names. Returns zero on success, or
+ * EINVAL if any of the names is unknown.
+ */
+int nfscheck_parse_methods(const char *s, int *methods);
+
+/* Build a plan which performs the given methods, cheapest first */
+void nfscheck_plan_init(struct nfscheck_plan *plan, int methods);
+
+/* All of the methods of a plan */
+int nfscheck_plan_methods(const struct nfscheck_plan *plan);
+
+/*
+ * Parse a plan: a comma separated list of method names, in the order in
+ * which they are performed. A method may be followed by an escalation
+ * threshold, a duration such as "readdir@50ms" (except for the first one).
+ * Returns zero on success, or EINVAL if any of the names is unknown (or
+ * repeated).
+ */
+int nfscheck_parse_plan(const char *s, struct nfscheck_plan *plan);
+
+/* Format a plan in the syntax of nfscheck_parse_plan(). Returns the length, like snprintf(). */
+int nfscheck_format_plan(const struct nfscheck_plan *plan, char *buf, size_t size);
+
+/*
+ * Format the methods of a plan which were performed (those in methods, such
+ * as the methods of a result), as a comma separated list of names, in the
+ * order of the plan. Returns the length of the list, like snprintf().
+ */
+int nfscheck_format_performed(const struct nfscheck_plan *plan, int methods, char *buf, size_t size);
+
+/*
+ * Parse a duration into milliseconds. A plain number is in seconds (possibly
+ * fractional, such as "0.25"), or the unit may be given as a suffix, such as
+ * "250ms" or "2s". A positive duration is rounded to at least 1 ms. Returns
+ * zero on success, or EINVAL (including for NaN or infinity).
+ */
+int nfscheck_parse_duration(const char *s, int *ms);
+
+/*
+ * Set the scratch directory of the write method, in which it creates (and
+ * removes) its probe file. A relative directory is relative to the checked
+ * path, so that every mount has its own. The default is the checked path
+ * itself. This must be done before any check is started.
+ */
+void nfscheck_set_scratch_dir(const char *dir);
+
+/*
+ * Set the timeout of the rpc-null method, in milliseconds (default: 1000).
+ * This must be done before any check is started.
+ */
+void nfscheck_set_rpc_timeout(int ms);
+
+/*
+ * Set the limits of the mountstats method: the percentage of the RPC
+ * transmissions since the previous check of a path which may be
+ * retransmissions (default: 5), and the average round trip time of the RPC
+ * calls (default: 1000 ms). Zero disables a limit. This must be done before
+ * any check is started.
+ */
+void nfscheck_set_mountstats_limits(double retrans_pct, int rtt_ms);
+
+/*
+ * Keep up to max directory descriptors open per thread, one per checked
+ * path, between checks (default: zero, which disables the cache). The stat,
+ * statx, readdir and readdir-raw methods then probe through the descriptor
+ * (fstatat(), statx() or a rewound getdents64()) instead of walking and
+ * opening the path every time. A probe which fails on a cached descriptor
+ * (such as ESTALE) closes it, and the next check opens the path again.
+ *
+ * A cached descriptor keeps its mount busy: it cannot be unmounted (other
+ * than lazily), and autofs cannot expire it. Without the revalidation of
+ * open(), the stat and readdir methods may also be answered from the
+ * client's caches for longer. This must be done before any check is started.
+ */
+void nfscheck_set_fd_cache(int max);
+
+/*
+ * Close every cached descriptor, such as when mounts have disappeared. This
+ * is lazy: every thread closes its own descriptors at its next check.
+ */
+void nfscheck_fd_cache_invalidate(void);
+
+/* Close the descriptors cached by the calling thread, now */
+void nfscheck_fd_cache_flush(void);
+
+/*
+ * The NFS server of a mount, given its source and its (superblock) options
+ * from /proc/self/mountinfo: the addr= option, or else the host part of the
+ * source, such as "filer1" in "filer1:/export". Returns zero on success, or
+ * ENOENT if the mount has no server.
+ */
+int nfscheck_mount_server(const char *source, const char *options, char *buf, size_t size);
+
+/* A line of /proc/self/mountinfo, see nfscheck_parse_mountinfo() */
+struct nfscheck_mountinfo {
+	int mount_id;
+	unsigned int major;
+	unsigned int minor;
+	char *mountpoint;
+	char *fstype;
+	char *source;
+	char *options;
+};
+
+/*
+ * Parse one line of /proc/self/mountinfo, in place: the fields point into
+ * the line, with their octal escapes (such as "\040" for space) undone.
+ * Returns zero on success, or EINVAL if the line is malformed.
+ */
+int nfscheck_parse_mountinfo(char *line, struct nfscheck_mountinfo *entry);
+
+/*
+ * Set the function which receives the debug messages of the library (by
+ * default, they are discarded). It may be called from any thread.
+ */
+void nfscheck_set_log(void (*fn)(const char *fmt, va_list args));
+
+/*
+ * Check a mount with the given methods, in the calling thread. Returns the
+ * status of the mount (zero if it works), which is also stored in the
+ * result.
+ */
+int nfscheck_check(const char *path, int methods, struct nfscheck_result *result);
+
+/* Equivalent to nfscheck_check(), following a plan */
+int nfscheck_check_plan(const char *path, const struct nfscheck_plan *plan,
+			struct nfscheck_result *result);
+
+/* Asynchronous checks */
+struct nfscheck_ctx;
+
+struct nfscheck_options {
+	/* number of threads which perform checks (default: 8) */
+	int workers;
+	/* maximum number of threads, including abandoned ones (default: twice the workers) */
+	int max_threads;
+};
+
+/*
+ * A completed check.
+ *
+ * When a check reaches its deadline, it is completed with ETIMEDOUT (and
+ * timed_out set), and the thread performing it is abandoned. If that thread
+ * ever returns, a second completion is delivered for the same check, with
+ * late set and the actual result. A check which could not even be started
+ * by its deadline (because every thread was busy) is completed with
+ * NFSCHECK_EUNKNOWN, and has no late completion.
+ */
+struct nfscheck_completion {
+	void *cookie;
+	int timed_out;
+	int late;
+	uint64_t elapsed_ns;
+	struct nfscheck_result result;
+};
+
+/* Create a context. Returns NULL (and sets errno) on failure. */
+struct nfscheck_ctx *nfscheck_ctx_new(const struct nfscheck_options *options);
+
+/*
+ * Free a context. Checks in flight are abandoned: their threads exit (and
+ * free their own resources) whenever they return.
+ */
+void nfscheck_ctx_free(struct nfscheck_ctx *ctx);
+
+/*
+ * A file descriptor which becomes readable when nfscheck_poll() has work to
+ * do: a check completed, or a deadline was reached.
+ */
+int nfscheck_fd(const struct nfscheck_ctx *ctx);
+
+/*
+ * Start checking a path, with the given methods. The deadline is an
+ * absolute time from nfscheck_now() (zero for no deadline). The cookie is
+ * returned in the completion. Returns zero on success, or an errno value.
+ */
+int nfscheck_submit(struct nfscheck_ctx *ctx, const char *path, int methods,
+		    uint64_t deadline, void *cookie);
+
+/* Equivalent to nfscheck_submit(), following a plan */
+int nfscheck_submit_plan(struct nfscheck_ctx *ctx, const char *path,
+			 const struct nfscheck_plan *plan, uint64_t deadline, void *cookie);
+
+/*
+ * Collect up to max completed checks, without blocking. Returns the number
+ * of completions stored. A context must only be used by a single thread.
+ */
+int nfscheck_poll(struct nfscheck_ctx *ctx, struct nfscheck_completion *completions, int max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* NFSCHECK_H */
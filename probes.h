@@ -0,0 +1,55 @@
+/*
+ * Static tracepoints (USDT probes) of nfs-mountpoint-check and libnfscheck,
+ * for tracing slow checks in production, such as with bpftrace:
+ *
+ *   bpftrace -e 'usdt:/usr/bin/nfs-mountpoint-check:nfscheck:phase__done {
+ *       printf("%s %d us\n", str(arg1), arg2 / 1000); }'
+ *
+ * A probe is a single NOP until a tracer attaches to it, and its arguments
+ * are only ever computed into registers. Without <sys/sdt.h> (systemtap-sdt-
+ * devel, or systemtap-sdt-dev), there are no probes at all.
+ *
+ * Copyright 2019 Ira W. Snyder <isnyder@lco.global>
+ * Copyright 2019 William Lindstrom <llindstrom@lco.global>
+ * Copyright 2019 Las Cumbres Observatory <https://lco.global/>
+ *
+ * The probes of the provider "nfscheck", and their arguments:
+ *
+ * libnfscheck, in the thread performing the check:
+ *   method__start(path, method name)
+ *   phase__done(phase, phase name, nanoseconds)
+ *   method__done(path, method name, errno value, nanoseconds)
+ *
+ * nfs-mountpoint-check, in the supervisor:
+ *   check__start(path, engine)
+ *   child__create(path, pid, nanoseconds spent creating it)
+ *   child__reap(path, pid, wait status)
+ *   child__kill(path, pid)
+ *   check__done(path, status, elapsed nanoseconds)
+ *
+ * The path of child__reap and child__kill is NULL for a pool worker without
+ * a check, or for a check process which was abandoned.
+ */
+
+#ifndef NFSCHECK_PROBES_H
+#define NFSCHECK_PROBES_H
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>) && !defined(NFSCHECK_NO_PROBES)
+#include <sys/sdt.h>
+#define NFSCHECK_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef NFSCHECK_HAVE_PROBES
+#define PROBE2(name, a, b)		STAP_PROBE2(nfscheck, name, a, b)
+#define PROBE3(name, a, b, c)		STAP_PROBE3(nfscheck, name, a, b, c)
+#define PROBE4(name, a, b, c, d)	STAP_PROBE4(nfscheck, name, a, b, c, d)
+#else
+/* never evaluated, but the arguments still count as used */
+#define PROBE2(name, a, b)		do { if (0) { (void)(a); (void)(b); } } while (0)
+#define PROBE3(name, a, b, c)		do { if (0) { (void)(a); (void)(b); (void)(c); } } while (0)
+#define PROBE4(name, a, b, c, d)	do { if (0) { (void)(a); (void)(b); (void)(c); (void)(d); } } while (0)
+#endif
+
+#endif /* NFSCHECK_PROBES_H */
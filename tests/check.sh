@@ -0,0 +1,449 @@
+#!/bin/sh
+#
+# Test harness for nfs-mountpoint-check (make check): run the checker with
+# every engine and check method against simulated failure modes, served by
+# faultfs (healthy, slow, hung and stale mounts), and check its results:
+#
+# - a healthy or slow mount is reported as working
+# - a stale mount is reported as ESTALE
+# - a hung (or too slow) mount is reported as ETIMEDOUT within the timeout
+#   plus $slack_ms milliseconds, wall clock time
+# - no check process is left behind once the checker has exited
+# - the methods performed are reported in the order of the plan
+# - with --parallel-methods, a method which fails is reported at once, even
+#   while another one hangs
+# - the mountstats method flags a mount from the RPC statistics of a fake
+#   /proc/self/mountstats (in a mount namespace of its own)
+# - with --fd-cache, a mount which goes stale under a cached descriptor is
+#   reported as ESTALE, and its descriptor is reopened once it recovers
+# - the result board of a daemon (--board) can be read with --read-board
+# - with --share-dir, concurrent invocations probe a hung path only once,
+#   waiters give up on their own deadline (or take over from a dead lock
+#   holder), and a result younger than --max-age is used without a probe
+# - with --adaptive, the timeout settles at a multiple of the latency (never
+#   below --min-timeout), and the latency history survives in --state-file
+# - with --group-servers, a bind mount gets the verdict of the mount of the
+#   same superblock, without being probed (tmpfs mounts in a mount namespace)
+#
+# With BENCH=N in the environment, the engines are also benchmarked on the
+# healthy mount (see --bench), as a reference for supervisor changes.
+#
+# Usage: tests/check.sh [<path to nfs-mountpoint-check>]
+
+set -u
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+checker=${1:-$top/nfs-mountpoint-check}
+checker=$(cd "$(dirname "$checker")" && pwd)/$(basename "$checker")
+faultfs=$top/tests/faultfs
+
+engines="fork spawn pool threads uring"
+methods="statx stat readdir readdir-raw write"
+timeout_ms=200
+slack_ms=50
+delay_ms=100
+
+if [ "$(id -u)" != 0 ] || [ ! -c /dev/fuse ]; then
+	echo "SKIP: the tests must be run as root, with /dev/fuse"
+	exit 0
+fi
+
+dir=$(mktemp -d "${TMPDIR:-/tmp}/nfscheck-test.XXXXXX") || exit 1
+pids=""
+mounts=""
+tests=0
+failures=0
+
+cleanup() {
+	for pid in $pids; do
+		kill "$pid" 2>/dev/null
+	done
+
+	wait
+	for mnt in $mounts; do
+		umount -l "$mnt" 2>/dev/null
+	done
+
+	rm -rf "$dir"
+}
+
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+now_ms() {
+	echo $(($(date +%s%N) / 1000000))
+}
+
+# Mount a faultfs: start_faultfs <name> <mode> [<delay ms>]
+start_faultfs() {
+	mkdir "$dir/$1" || exit 1
+	"$faultfs" "$dir/$1" "$2" ${3:-} &
+	pids="$pids $!"
+	mounts="$mounts $dir/$1"
+
+	for i in $(seq 50); do
+		if grep -q " $dir/$1 " /proc/self/mountinfo; then
+			return
+		fi
+
+		sleep 0.1
+	done
+
+	echo "Unable to mount faultfs on $dir/$1"
+	exit 1
+}
+
+# A field of the JSON record of a check (strings keep their quotes)
+field() {
+	sed -n "s/.*\"$1\":\([^,}]*\).*/\1/p" "$dir/out"
+}
+
+fail() {
+	echo "FAIL - $desc: $*"
+	failures=$((failures + 1))
+}
+
+# Wait a little for the check processes of the last invocation to go away
+orphans() {
+	for i in $(seq 10); do
+		if ! pgrep -f "^$checker .*$dir/" > /dev/null; then
+			return 1
+		fi
+
+		sleep 0.1
+	done
+
+	return 0
+}
+
+# expect <description> <errno> <max ms> <checker arguments...>
+#
+# Run the checker on a single path, and check the errno of the result (null
+# on success), and the wall clock time it took.
+expect() {
+	desc=$1
+	errno=$2
+	max_ms=$3
+	shift 3
+
+	tests=$((tests + 1))
+	start=$(now_ms)
+	"$checker" -q --format=json "$@" > "$dir/out" 2> "$dir/err"
+	elapsed=$(($(now_ms) - start))
+
+	got=$(field errno)
+	if [ "$got" != "$errno" ]; then
+		fail "expected $errno, got ${got:-no result} $(cat "$dir/err")"
+	elif [ "$elapsed" -gt "$max_ms" ]; then
+		fail "took $elapsed ms, expected at most $max_ms ms"
+	elif orphans; then
+		fail "check processes left behind"
+		pkill -9 -f "^$checker .*$dir/"
+	else
+		echo "ok - $desc ($elapsed ms)"
+	fi
+}
+
+start_faultfs ok ok
+start_faultfs slow delay $delay_ms
+start_faultfs hung hang
+start_faultfs stale estale
+start_faultfs split split
+start_faultfs flip ok
+flip_pid=$!
+
+for engine in $engines; do
+	for method in $methods; do
+		args="--engine=$engine --method=$method"
+
+		expect "$engine $method: healthy" null 1000 $args --timeout=1s "$dir/ok"
+		expect "$engine $method: stale" '"ESTALE"' 1000 $args --timeout=1s "$dir/stale"
+		expect "$engine $method: hung" '"ETIMEDOUT"' $((timeout_ms + slack_ms)) \
+			$args --timeout=${timeout_ms}ms "$dir/hung"
+
+		# every request takes $delay_ms, whether it fits in the timeout or not
+		expect "$engine $method: slow" null 2000 $args --timeout=2s "$dir/slow"
+		latency=$(field latency_ms)
+		case "$latency" in
+		"" | *[!0-9.]*)
+			fail "latency of '$latency' ms, expected a number"
+			;;
+		*)
+			if [ "${latency%.*}" -lt $delay_ms ]; then
+				fail "latency of $latency ms, expected at least $delay_ms ms"
+			fi
+			;;
+		esac
+
+		expect "$engine $method: too slow" '"ETIMEDOUT"' $((delay_ms / 2 + slack_ms)) \
+			$args --timeout=$((delay_ms / 2))ms "$dir/slow"
+	done
+done
+
+# a path which is still hung is not checked again (see --max-hung)
+for engine in $engines; do
+	desc="$engine: hung path skipped"
+	tests=$((tests + 1))
+	"$checker" -q --format=json --engine=$engine --method=stat --timeout=${timeout_ms}ms \
+		--bench=3 "$dir/hung" > "$dir/out" 2> "$dir/err"
+	if [ "$(field skipped)" != 2 ]; then
+		fail "expected 2 skipped checks, got $(field skipped)"
+	elif orphans; then
+		fail "check processes left behind"
+		pkill -9 -f "^$checker .*$dir/"
+	else
+		echo "ok - $desc"
+	fi
+done
+
+# readdir hangs, but statx fails at once: the verdict must not wait for readdir
+for engine in fork spawn pool uring; do
+	expect "$engine parallel methods: one fails, one hangs" '"ESTALE"' $slack_ms \
+		--engine=$engine --method=readdir,statx --parallel-methods --timeout=1s "$dir/split"
+	if ! grep -q '"verdicts":{"readdir":{"completed":false},"statx":{"completed":true,' "$dir/out"; then
+		fail "unexpected verdicts: $(sed 's/.*"verdicts"://' "$dir/out")"
+	fi
+done
+
+# the methods performed are reported in the order of the plan
+for engine in $engines; do
+	expect "$engine: performed in order" null 1000 \
+		--engine=$engine --method=readdir,stat --timeout=1s "$dir/ok"
+	if ! grep -q '"performed":"readdir,stat",' "$dir/out"; then
+		fail "unexpected methods performed: $(sed 's/.*"performed":\("[^"]*"\).*/\1/' "$dir/out")"
+	fi
+done
+
+# the daemon probes through a cached descriptor, until the mount goes stale
+for engine in pool threads; do
+	desc="$engine: cached descriptor goes stale"
+	tests=$((tests + 1))
+	"$checker" -q --format=json --daemon --interval=100ms --engine=$engine --fd-cache \
+		--method=stat "$dir/flip" > "$dir/out" 2> "$dir/err" &
+	daemon=$!
+	sleep 0.5
+	kill -USR1 $flip_pid
+	sleep 0.5
+	kill -USR2 $flip_pid
+	sleep 0.5
+	kill -INT $daemon
+	wait $daemon
+
+	# open once, stat the descriptor, get ESTALE from it, and open again
+	phases=$(sed -n 's/.*"errno":\([^,]*\),.*"phases_ms":{\([^}]*\)}.*/\1 \2/p' "$dir/out" |
+		sed 's/"stat.\([a-z]*\)":[0-9.]*/\1/g' | uniq | tr '\n' ' ')
+	case "$phases" in
+	"null open,fstat null fstat \"ESTALE\" fstat "*"null open,fstat null fstat ")
+		echo "ok - $desc"
+		;;
+	*)
+		fail "unexpected sequence of checks: $phases"
+		;;
+	esac
+done
+
+# mountstats <ops> <transmissions> <rtt ms>: the statistics of a fake NFS mount
+mountstats() {
+	printf 'device filer1:/export mounted on %s with fstype nfs4 statvers=1.1\n' "$dir/nfs"
+	printf '\txprt:\ttcp 927 0 1 0 19 %s %s 0 %s 0 0 0 0\n' "$2" "$2" "$2"
+	printf '\tper-op statistics\n'
+	printf '\t     GETATTR: %s %s 0 1000 2000 5 %s %s 0\n' "$1" "$2" "$3" "$3"
+}
+
+# the daemon judges the statistics since its previous round of checks, in
+# the supervisor itself, whatever the engine and the other methods, and
+# whatever the spelling of the path (relative to $dir)
+if command -v unshare > /dev/null; then
+	mkdir "$dir/nfs"
+	mountstats 100 100 100 > "$dir/round1"
+	mountstats 200 300 200 > "$dir/round2"
+	mountstats 300 400 100200 > "$dir/round3"
+	for args in "--method=mountstats $dir/nfs" "--engine=fork --method=mountstats,stat $dir//nfs/" \
+			"--engine=pool --method=mountstats,stat $dir/./nfs/../nfs" "--method=mountstats ./nfs"; do
+		desc="mountstats ($args): retransmissions, then slow calls"
+		tests=$((tests + 1))
+		unshare -m --propagation private sh -c '
+			mount -t tmpfs none /proc && mkdir /proc/self || exit 1
+			cp "$2/round1" /proc/self/mountstats
+			cd "$2" && "$1" -q --format=json --daemon --interval=100ms $3 &
+			sleep 0.3
+			cp "$2/round2" /proc/self/new && mv /proc/self/new /proc/self/mountstats
+			sleep 0.3
+			cp "$2/round3" /proc/self/new && mv /proc/self/new /proc/self/mountstats
+			sleep 0.3
+			kill -INT $!
+			wait' sh "$checker" "$dir" "$args" > "$dir/out" 2> "$dir/err"
+
+		# a round without any new operation has nothing to judge
+		errnos=$(sed -n 's/.*"errno":\([^,]*\),.*/\1/p' "$dir/out" | uniq | tr '\n' ' ')
+		case "$errnos" in
+		"null \"ETIMEDOUT\" "*"\"ETIME\" null ")
+			echo "ok - $desc"
+			;;
+		*)
+			fail "unexpected sequence of checks: $errnos $(cat "$dir/err")"
+			;;
+		esac
+	done
+fi
+
+# a bind mount of an export is the same filesystem: it is not probed again
+if command -v unshare > /dev/null; then
+	desc="group servers: bind mount gets the verdict of its primary"
+	tests=$((tests + 1))
+	mkdir "$dir/export" "$dir/bind"
+	unshare -m --propagation private sh -c '
+		mount -t tmpfs filer1:/export "$2/export" && mount --bind "$2/export" "$2/bind" || exit 1
+		"$1" -q --format=json --all-nfs --fstype=tmpfs --include="$2/*" --group-servers' \
+		sh "$checker" "$dir" > "$dir/out" 2> "$dir/err"
+	if ! grep -q "\"path\":\"$dir/bind\".*\"skipped\":true.*\"verdict_from\":\"$dir/export\"" "$dir/out"; then
+		fail "unexpected results: $(cat "$dir/out" "$dir/err")"
+	else
+		echo "ok - $desc"
+	fi
+fi
+
+# the daemon publishes every path on its board, which is read without checking
+desc="result board: published by the daemon"
+tests=$((tests + 1))
+"$checker" -q --daemon --interval=100ms --board="$dir/board" "$dir/ok" "$dir/stale" 2> "$dir/err" &
+daemon=$!
+sleep 0.5
+"$checker" -q --format=json --read-board="$dir/board" "$dir/stale" > "$dir/out" 2>> "$dir/err"
+status=$?
+kill -INT $daemon
+wait $daemon
+
+# once the daemon exited, its results are stale
+"$checker" -q --read-board="$dir/board" "$dir/ok" > /dev/null
+stale=$?
+if [ "$status" != 116 ] || [ "$(field errno)" != '"ESTALE"' ]; then
+	fail "expected ESTALE (116), got $(field errno) ($status) $(cat "$dir/err")"
+elif [ "$stale" != 255 ]; then
+	fail "expected EUNKNOWN (255) once the daemon exited, got $stale"
+else
+	echo "ok - $desc"
+fi
+
+# with --share-dir, concurrent invocations probe a hung path only once: the
+# others wait for its result (the spawn engine names its check processes)
+mkdir "$dir/share"
+share="--engine=spawn --method=stat --share-dir=$dir/share"
+desc="share: concurrent invocations probe once"
+tests=$((tests + 1))
+"$checker" -q --format=json $share --timeout=1s "$dir/hung" > "$dir/out.0" 2>&1 &
+waiters=$!
+sleep 0.1
+for i in 1 2 3; do
+	"$checker" -q --format=json $share --timeout=1s "$dir/hung" > "$dir/out.$i" 2>&1 &
+	waiters="$waiters $!"
+done
+sleep 0.4
+probes=$(pgrep -f -- "--check-helper .*$dir/hung\$" | wc -l)
+wait $waiters
+cat "$dir/out.0" "$dir/out.1" "$dir/out.2" "$dir/out.3" > "$dir/out"
+if [ "$probes" != 1 ]; then
+	fail "$probes check processes, expected 1"
+elif [ "$(grep -c '"errno":"ETIMEDOUT"' "$dir/out")" != 4 ] ||
+     [ "$(grep -c '"shared":true' "$dir/out")" != 3 ]; then
+	fail "expected 3 shared ETIMEDOUT results out of 4: $(cat "$dir/out")"
+else
+	echo "ok - $desc"
+fi
+
+# a waiter gives up on its own deadline, not on that of the lock holder
+desc="share: waiter times out on its own deadline"
+tests=$((tests + 1))
+"$checker" -q --format=json $share --timeout=1s "$dir/hung" > /dev/null 2>&1 &
+holder=$!
+sleep 0.1
+start=$(now_ms)
+"$checker" -q --format=json $share --timeout=${timeout_ms}ms "$dir/hung" > "$dir/out" 2> "$dir/err"
+elapsed=$(($(now_ms) - start))
+wait $holder
+if [ "$(field errno)" != '"ETIMEDOUT"' ] || grep -q '"shared":true' "$dir/out"; then
+	fail "expected ETIMEDOUT of its own, got $(cat "$dir/out" "$dir/err")"
+elif [ "$elapsed" -gt $((timeout_ms + slack_ms)) ]; then
+	fail "took $elapsed ms, expected at most $((timeout_ms + slack_ms)) ms"
+else
+	echo "ok - $desc ($elapsed ms)"
+fi
+
+# when the lock holder dies without publishing anything, a waiter takes over
+# (pool workers are forked, so they are told apart by their command line)
+desc="share: waiter takes over from a dead lock holder"
+tests=$((tests + 1))
+pool="--engine=pool --method=stat --share-dir=$dir/share"
+"$checker" -q --format=json $pool --timeout=2s "$dir/hung" > /dev/null 2>&1 &
+holder=$!
+sleep 0.1
+"$checker" -q --format=json $pool --timeout=1s "$dir/hung" > "$dir/out" 2> "$dir/err" &
+waiter=$!
+sleep 0.2
+before=$(pgrep -f -- "--timeout=1s $dir/hung\$" | wc -l)
+kill -9 $holder
+wait $holder 2> /dev/null
+sleep 0.2
+after=$(pgrep -f -- "--timeout=1s $dir/hung\$" | wc -l)
+wait $waiter
+if [ "$before" != 1 ] || [ "$after" != 2 ]; then
+	fail "expected the waiter to start probing, got $before then $after processes"
+elif [ "$(field errno)" != '"ETIMEDOUT"' ] || grep -q '"shared":true' "$dir/out"; then
+	fail "expected ETIMEDOUT of its own, got $(cat "$dir/out" "$dir/err")"
+else
+	echo "ok - $desc"
+fi
+
+# a result younger than --max-age is used without probing the (slow) path
+expect "share: result published" null 2000 $share --timeout=2s "$dir/slow"
+expect "share: recent result used" null $((delay_ms / 2)) $share --max-age=10s --timeout=2s "$dir/slow"
+if ! grep -q '"shared":true' "$dir/out" || [ -z "$(field age_ms)" ]; then
+	fail "expected a shared result, with its age: $(cat "$dir/out")"
+fi
+
+# adaptive_ok <checks to skip>: whether the timeout of every (other) check in
+# $dir/out is about twice its latency, as the faultfs delay is constant
+adaptive_ok() {
+	sed -n 's/.*"timeout_ms":\([0-9]*\),"elapsed_ms":\([0-9.]*\),.*/\1 \2/p' "$dir/out" |
+		awk -v skip="$1" 'NR > skip { n++; r = $1 / $2; if (r < 1.8 || r > 2.8) bad = 1 }
+			END { exit bad || n == 0 }'
+}
+
+# adaptive timeouts settle at a multiple of the latency of the (slow) path,
+# once warmed up, and the latency history survives a restart in a state file
+adaptive="--method=stat --timeout=2s --adaptive=2 --state-file=$dir/state"
+desc="adaptive: timeout settles at twice the latency"
+tests=$((tests + 1))
+"$checker" -q --format=json --daemon --interval=10ms $adaptive "$dir/slow" > "$dir/out" 2> "$dir/err" &
+daemon=$!
+sleep 3
+kill -INT $daemon
+wait $daemon
+if [ "$(sed -n 8p "$dir/out" | sed -n 's/.*"timeout_ms":\([0-9]*\),.*/\1/p')" != 2000 ]; then
+	fail "expected the full timeout while warming up: $(sed -n 8p "$dir/out")"
+elif ! adaptive_ok 8; then
+	fail "unexpected timeouts: $(sed 's/.*\("timeout_ms":[0-9]*,"elapsed_ms":[0-9.]*\).*/\1/' "$dir/out")"
+elif [ ! -s "$dir/state" ]; then
+	fail "no state file written"
+else
+	echo "ok - $desc"
+fi
+
+expect "adaptive: history restored from the state file" null 2000 $adaptive "$dir/slow"
+if ! adaptive_ok 0; then
+	fail "unexpected timeout: $(field timeout_ms) ms, for $(field elapsed_ms) ms"
+fi
+
+expect "adaptive: never below --min-timeout" null 2000 $adaptive --min-timeout=1s "$dir/slow"
+if [ "$(field timeout_ms)" != 1000 ]; then
+	fail "timeout of $(field timeout_ms) ms, expected 1000 ms"
+fi
+
+if [ -n "${BENCH:-}" ]; then
+	for engine in $engines; do
+		"$checker" -q --engine=$engine --method=statx,stat,readdir --bench="$BENCH" "$dir/ok"
+	done
+fi
+
+echo "$((tests - failures))/$tests tests passed"
+[ "$failures" -eq 0 ]
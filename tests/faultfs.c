@@ -0,0 +1,486 @@
+/*
+ * faultfs: a tiny FUSE filesystem which simulates a misbehaving NFS server,
+ * for the test harness (see check.sh).
+ *
+ * Copyright 2019 Ira W. Snyder <isnyder@lco.global>
+ * Copyright 2019 William Lindstrom <llindstrom@lco.global>
+ * Copyright 2019 Las Cumbres Observatory <https://lco.global/>
+ *
+ * Usage: faultfs <mountpoint> <mode> [<delay ms>]
+ *
+ * The filesystem is an empty directory, in which files may be created,
+ * written and removed (enough for every check method). Depending on the
+ * mode, every request is:
+ *
+ * - ok:     answered immediately
+ * - delay:  answered after the given delay (see below)
+ * - hang:   never answered, like a dead server (see below)
+ * - estale: answered with ESTALE, like a server which lost the export
+ * - split:  never answered when reading the directory, and answered with
+ *           ESTALE otherwise (one method hangs while another one fails)
+ *
+ * Whatever the mode, SIGUSR1 makes every later request fail with ESTALE
+ * (the export is lost while mounted), and SIGUSR2 undoes that.
+ *
+ * It speaks the FUSE protocol directly on /dev/fuse, so it needs neither
+ * libfuse nor fusermount, but it must be run as root. Attributes are never
+ * cached by the kernel, so every check reaches faultfs.
+ *
+ * Once faultfs has read a request, the kernel waits for its answer without
+ * even letting the calling process be killed. A hard NFS mount, on the
+ * other hand, lets a process waiting for a dead server be killed (the RPC
+ * waits are TASK_KILLABLE since Linux 2.6.25). So a delayed (or hung)
+ * request is answered with EINTR as soon as the kernel reports that its
+ * process got a signal.
+ *
+ * faultfs runs until the filesystem is unmounted, or it is killed: the
+ * requests which were never answered then fail with ENOTCONN.
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/fuse.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#define ROOT_INO 1
+#define FILE_INO 2
+
+enum mode {
+	MODE_OK,
+	MODE_DELAY,
+	MODE_HANG,
+	MODE_ESTALE,
+	MODE_SPLIT,
+};
+
+static enum mode mode = MODE_OK;
+static volatile sig_atomic_t stale = 0;
+static int delay_ms = 0;
+static int fuse_fd = -1;
+
+/* The only file which may exist (the probe file of the write method) */
+static char file_name[256];
+static uint64_t file_size = 0;
+
+/* Requests are at most max_write bytes of data, plus the headers */
+static char request[1 << 20];
+
+/*
+ * The requests which are delayed (or hung, forever), in order of arrival:
+ * they all have the same delay, so they are also due in order.
+ */
+struct pending {
+	uint64_t due;
+	struct pending *next;
+	char request[];
+};
+
+static struct pending *pending = NULL;
+static struct pending **pending_tail = &pending;
+
+static int reply(const struct fuse_in_header *in, const int error, const void *data, const size_t size)
+{
+	struct fuse_out_header out = {
+		.len = sizeof(out) + (error ? 0 : size),
+		.error = -error,
+		.unique = in->unique,
+	};
+	struct iovec iov[2] = {
+		{ .iov_base = &out, .iov_len = sizeof(out), },
+		{ .iov_base = (void *)data, .iov_len = error ? 0 : size, },
+	};
+
+	if (writev(fuse_fd, iov, 2) < 0 && errno != ENOENT) {
+		/* ENOENT: the request was interrupted in the meantime */
+		perror("faultfs: writev");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void fill_attr(struct fuse_attr *attr, const uint64_t ino)
+{
+	memset(attr, 0, sizeof(*attr));
+	attr->ino = ino;
+	attr->uid = 0;
+	attr->gid = 0;
+	attr->blksize = 4096;
+	if (ino == ROOT_INO) {
+		attr->mode = S_IFDIR | 0755;
+		attr->nlink = 2;
+	} else {
+		attr->mode = S_IFREG | 0600;
+		attr->nlink = 1;
+		attr->size = file_size;
+	}
+}
+
+static void fill_entry(struct fuse_entry_out *entry, const uint64_t ino)
+{
+	memset(entry, 0, sizeof(*entry));
+	entry->nodeid = ino;
+	entry->generation = 1;
+	fill_attr(&entry->attr, ino);
+}
+
+/* Append a directory entry to a READDIR reply. Returns the new length, or 0 if it does not fit. */
+static size_t add_dirent(char *buf, const size_t len, const size_t size, const uint64_t ino,
+			 const uint64_t off, const char *name, const uint32_t type)
+{
+	const size_t namelen = strlen(name);
+	const size_t entlen = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + namelen);
+	struct fuse_dirent *dirent = (struct fuse_dirent *)(buf + len);
+
+	if (len + entlen > size) {
+		return 0;
+	}
+
+	memset(dirent, 0, entlen);
+	dirent->ino = ino;
+	dirent->off = off;
+	dirent->namelen = namelen;
+	dirent->type = type;
+	memcpy(dirent->name, name, namelen);
+	return len + entlen;
+}
+
+static void do_readdir(const struct fuse_in_header *in, const struct fuse_read_in *arg)
+{
+	char buf[4096];
+	const size_t size = arg->size < sizeof(buf) ? arg->size : sizeof(buf);
+	size_t len = 0;
+	size_t next;
+	uint64_t off;
+
+	for (off = arg->offset; off < 3; off++) {
+		if (off == 0) {
+			next = add_dirent(buf, len, size, ROOT_INO, 1, ".", S_IFDIR >> 12);
+		} else if (off == 1) {
+			next = add_dirent(buf, len, size, ROOT_INO, 2, "..", S_IFDIR >> 12);
+		} else if (file_name[0] != '\0') {
+			next = add_dirent(buf, len, size, FILE_INO, 3, file_name, S_IFREG >> 12);
+		} else {
+			break;
+		}
+
+		if (next == 0) {
+			break;
+		}
+
+		len = next;
+	}
+
+	reply(in, 0, buf, len);
+}
+
+/* Answer a request (after its delay) */
+static void answer(const struct fuse_in_header *in, const void *arg)
+{
+	if (mode == MODE_ESTALE || mode == MODE_SPLIT || stale) {
+		reply(in, ESTALE, NULL, 0);
+		return;
+	}
+
+	switch (in->opcode) {
+	case FUSE_LOOKUP:
+		if (in->nodeid == ROOT_INO && file_name[0] != '\0' && strcmp(arg, file_name) == 0) {
+			struct fuse_entry_out out;
+
+			fill_entry(&out, FILE_INO);
+			reply(in, 0, &out, sizeof(out));
+		} else {
+			reply(in, ENOENT, NULL, 0);
+		}
+		break;
+	case FUSE_GETATTR:
+	case FUSE_SETATTR: {
+		struct fuse_attr_out out;
+
+		memset(&out, 0, sizeof(out));
+		fill_attr(&out.attr, in->nodeid);
+		reply(in, 0, &out, sizeof(out));
+		break;
+	}
+	case FUSE_CREATE: {
+		const struct fuse_create_in *create = arg;
+		const char *name = (const char *)(create + 1);
+		struct {
+			struct fuse_entry_out entry;
+			struct fuse_open_out open;
+		} out;
+
+		if (in->nodeid != ROOT_INO || strlen(name) >= sizeof(file_name) ||
+		    (file_name[0] != '\0' && strcmp(name, file_name) != 0)) {
+			reply(in, ENOSPC, NULL, 0);
+			break;
+		}
+
+		strcpy(file_name, name);
+		file_size = 0;
+		memset(&out, 0, sizeof(out));
+		fill_entry(&out.entry, FILE_INO);
+		out.open.fh = FILE_INO;
+		reply(in, 0, &out, sizeof(out));
+		break;
+	}
+	case FUSE_OPEN:
+	case FUSE_OPENDIR: {
+		struct fuse_open_out out;
+
+		memset(&out, 0, sizeof(out));
+		out.fh = in->nodeid;
+		reply(in, 0, &out, sizeof(out));
+		break;
+	}
+	case FUSE_READDIR:
+		do_readdir(in, arg);
+		break;
+	case FUSE_WRITE: {
+		const struct fuse_write_in *write = arg;
+		struct fuse_write_out out;
+
+		memset(&out, 0, sizeof(out));
+		out.size = write->size;
+		if (write->offset + write->size > file_size) {
+			file_size = write->offset + write->size;
+		}
+
+		reply(in, 0, &out, sizeof(out));
+		break;
+	}
+	case FUSE_UNLINK:
+		if (strcmp(arg, file_name) == 0) {
+			file_name[0] = '\0';
+			reply(in, 0, NULL, 0);
+		} else {
+			reply(in, ENOENT, NULL, 0);
+		}
+		break;
+	case FUSE_STATFS: {
+		struct fuse_statfs_out out;
+
+		memset(&out, 0, sizeof(out));
+		out.st.bsize = 4096;
+		out.st.namelen = 255;
+		reply(in, 0, &out, sizeof(out));
+		break;
+	}
+	case FUSE_RELEASE:
+	case FUSE_RELEASEDIR:
+	case FUSE_FLUSH:
+	case FUSE_FSYNC:
+	case FUSE_FSYNCDIR:
+	case FUSE_ACCESS:
+		reply(in, 0, NULL, 0);
+		break;
+	default:
+		reply(in, ENOSYS, NULL, 0);
+		break;
+	}
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Queue a request until it is due (or forever, in the hang mode) */
+static void queue(const char *req, const size_t len)
+{
+	struct pending *p = malloc(sizeof(*p) + len);
+
+	if (p == NULL) {
+		perror("faultfs: malloc");
+		exit(ENOMEM);
+	}
+
+	p->due = mode == MODE_DELAY ? now_ms() + delay_ms : 0;
+	p->next = NULL;
+	memcpy(p->request, req, len);
+	*pending_tail = p;
+	pending_tail = &p->next;
+}
+
+/* Remove a queued request */
+static void dequeue(struct pending **pp)
+{
+	struct pending *p = *pp;
+
+	*pp = p->next;
+	if (*pp == NULL) {
+		pending_tail = pp;
+	}
+
+	free(p);
+}
+
+/* The process of a request got a signal: a queued request fails with EINTR */
+static void interrupt(const uint64_t unique)
+{
+	struct pending **pp;
+
+	for (pp = &pending; *pp != NULL; pp = &(*pp)->next) {
+		const struct fuse_in_header *in = (const struct fuse_in_header *)(*pp)->request;
+
+		if (in->unique == unique) {
+			reply(in, EINTR, NULL, 0);
+			dequeue(pp);
+			return;
+		}
+	}
+}
+
+static void dispatch(const char *req, const size_t len)
+{
+	const struct fuse_in_header *in = (const struct fuse_in_header *)req;
+	const void *arg = req + sizeof(*in);
+
+	switch (in->opcode) {
+	case FUSE_INIT: {
+		const struct fuse_init_in *init = arg;
+		struct fuse_init_out out;
+
+		memset(&out, 0, sizeof(out));
+		out.major = FUSE_KERNEL_VERSION;
+		out.minor = init->minor < FUSE_KERNEL_MINOR_VERSION ? init->minor : FUSE_KERNEL_MINOR_VERSION;
+		out.max_readahead = init->max_readahead;
+		out.max_write = 4096;
+		reply(in, 0, &out, sizeof(out));
+		return;
+	}
+	case FUSE_INTERRUPT:
+		interrupt(((const struct fuse_interrupt_in *)arg)->unique);
+		return;
+	case FUSE_FORGET:
+	case FUSE_BATCH_FORGET:
+		/* never answered */
+		return;
+	case FUSE_DESTROY:
+		reply(in, 0, NULL, 0);
+		exit(0);
+	}
+
+	if (mode == MODE_DELAY || mode == MODE_HANG ||
+	    (mode == MODE_SPLIT && (in->opcode == FUSE_OPENDIR || in->opcode == FUSE_READDIR))) {
+		queue(req, len);
+	} else {
+		answer(in, arg);
+	}
+}
+
+/* Signal handler: SIGUSR1 makes the filesystem stale, SIGUSR2 healthy again */
+static void handle_signal(const int signum)
+{
+	stale = signum == SIGUSR1;
+}
+
+int main(int argc, char *argv[])
+{
+	char options[128];
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <mountpoint> <ok|delay|hang|estale|split> [<delay ms>]\n", argv[0]);
+		return EINVAL;
+	}
+
+	if (strcmp(argv[2], "ok") == 0) {
+		mode = MODE_OK;
+	} else if (strcmp(argv[2], "delay") == 0 && argc > 3) {
+		mode = MODE_DELAY;
+		delay_ms = atoi(argv[3]);
+	} else if (strcmp(argv[2], "hang") == 0) {
+		mode = MODE_HANG;
+	} else if (strcmp(argv[2], "estale") == 0) {
+		mode = MODE_ESTALE;
+	} else if (strcmp(argv[2], "split") == 0) {
+		mode = MODE_SPLIT;
+	} else {
+		fprintf(stderr, "faultfs: unknown mode %s\n", argv[2]);
+		return EINVAL;
+	}
+
+	signal(SIGUSR1, handle_signal);
+	signal(SIGUSR2, handle_signal);
+
+	fuse_fd = open("/dev/fuse", O_RDWR | O_CLOEXEC);
+	if (fuse_fd < 0) {
+		perror("faultfs: /dev/fuse");
+		return errno;
+	}
+
+	snprintf(options, sizeof(options), "fd=%d,rootmode=40000,user_id=0,group_id=0,allow_other", fuse_fd);
+	if (mount("faultfs", argv[1], "fuse.faultfs", MS_NOSUID | MS_NODEV, options) < 0) {
+		perror("faultfs: mount");
+		return errno;
+	}
+
+	for (;;) {
+		struct pollfd pfd = { .fd = fuse_fd, .events = POLLIN, };
+		int timeout = -1;
+		ssize_t len;
+
+		/* the requests are queued in order, and they all have the same delay */
+		if (pending != NULL && pending->due != 0) {
+			const uint64_t now = now_ms();
+
+			timeout = pending->due > now ? (int)(pending->due - now) : 0;
+		}
+
+		if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+			perror("faultfs: poll");
+			return errno;
+		}
+
+		while (pending != NULL && pending->due != 0 && pending->due <= now_ms()) {
+			const struct fuse_in_header *in = (const struct fuse_in_header *)pending->request;
+
+			answer(in, pending->request + sizeof(*in));
+			dequeue(&pending);
+		}
+
+		if (pfd.revents == 0) {
+			continue;
+		}
+
+		len = read(fuse_fd, request, sizeof(request));
+		if (len < 0) {
+			/* ENOENT: the request was interrupted before we read it */
+			if (errno == EINTR || errno == ENOENT || errno == EAGAIN) {
+				continue;
+			}
+
+			/* ENODEV: unmounted */
+			if (errno == ENODEV) {
+				return 0;
+			}
+
+			perror("faultfs: read");
+			return errno;
+		}
+
+		if ((size_t)len < sizeof(struct fuse_in_header)) {
+			fprintf(stderr, "faultfs: short request\n");
+			return EPROTO;
+		}
+
+		dispatch(request, len);
+	}
+}
+
+/* vim: set ts=8 sts=8 sw=8 noet: */